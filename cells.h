@@ -0,0 +1,175 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <Eigen/Dense>
+#include "particles.h"
+#include "geometry.h"
+
+/*
+    Linked-cell spatial index over the charge positions. Cells are at least as wide as
+    the cutoff so every pair inside the cutoff is found among the (up to) 27 cells around
+    a point. Neighboring cells are wrapped in every dimension, which is exact for PBC and
+    only adds a few extra (rejected) candidates for walls.
+*/
+class CellList{
+    private:
+
+    int n[3] = {0, 0, 0};               //Number of cells in x, y, z
+    double len[3], dh[3];               //Cell side lengths and half box
+    std::vector< std::vector<unsigned int> > cells;
+    std::vector<int> cellOf;            //Cell of each particle, -1 if not in the grid
+    std::vector<unsigned int> slot;     //Position of each particle in its cell
+
+    //Points outside the box (e.g. mirrored replicas) are clamped to the closest boundary cell
+    inline int coord(double x, int d){
+        int c = (int) std::floor((x + this->dh[d]) / this->len[d]);
+        return std::min(std::max(c, 0), this->n[d] - 1);
+    }
+
+    //Unique cells c - 1, c, c + 1 along one dimension
+    inline int stencil(int c, int d, int* out){
+        int m = 0;
+        for(int k = -1; k <= 1; k++){
+            int v = (c + k + this->n[d]) % this->n[d];
+            bool found = false;
+            for(int j = 0; j < m; j++){
+                if(out[j] == v) found = true;
+            }
+            if(!found) out[m++] = v;
+        }
+        return m;
+    }
+
+    public:
+
+    double cutoff = 0.0;
+    bool enabled = false;
+    bool useCom = false;                //Key the particles on their COM instead of the charge position
+
+    inline int cell_index(const Eigen::Vector3d& pos){
+        return (coord(pos[0], 0) * this->n[1] + coord(pos[1], 1)) * this->n[2] + coord(pos[2], 2);
+    }
+
+    void build(Particles& particles, Geometry* geo){
+        this->enabled = false;
+        if(this->cutoff <= 0.0 || geo->d.size() < 3) return;
+
+        for(int d = 0; d < 3; d++){
+            //Slightly shrink so that cells are strictly wider than the cutoff
+            this->n[d] = std::max(1, (int) std::floor(geo->d[d] / this->cutoff * (1.0 - 1e-12)));
+            this->len[d] = geo->d[d] / this->n[d];
+            this->dh[d] = geo->dh[d];
+        }
+
+        this->cells.resize(this->n[0] * this->n[1] * this->n[2]);
+        for(auto& c : this->cells){
+            c.clear();
+        }
+        this->cellOf.assign(particles.tot, -1);
+        this->slot.assign(particles.tot, 0);
+
+        for(unsigned int i = 0; i < particles.tot; i++){
+            this->insert(i, (this->useCom) ? particles.com(i) : particles.pos(i));
+        }
+        this->enabled = true;
+    }
+
+    void insert(unsigned int i, const Eigen::Vector3d& pos){
+        if(i >= this->cellOf.size()){
+            this->cellOf.resize(i + 1, -1);
+            this->slot.resize(i + 1, 0);
+        }
+        int c = this->cell_index(pos);
+        this->cellOf[i] = c;
+        this->slot[i] = this->cells[c].size();
+        this->cells[c].push_back(i);
+    }
+
+    void erase(unsigned int i){
+        if(i >= this->cellOf.size() || this->cellOf[i] < 0) return;
+        int c = this->cellOf[i];
+        unsigned int last = this->cells[c].back();
+        this->cells[c][this->slot[i]] = last;
+        this->slot[last] = this->slot[i];
+        this->cells[c].pop_back();
+        this->cellOf[i] = -1;
+    }
+
+    //Particle from is renumbered to, to must not be in the grid
+    void relocate(unsigned int from, unsigned int to){
+        if(from == to || from >= this->cellOf.size() || this->cellOf[from] < 0) return;
+        if(to >= this->cellOf.size()){
+            this->cellOf.resize(to + 1, -1);
+            this->slot.resize(to + 1, 0);
+        }
+        int c = this->cellOf[from];
+        this->cells[c][this->slot[from]] = to;
+        this->cellOf[to] = c;
+        this->slot[to] = this->slot[from];
+        this->cellOf[from] = -1;
+    }
+
+    void update(unsigned int i, const Eigen::Vector3d& pos){
+        if(!this->enabled) return;
+
+        if(i >= this->cellOf.size() || this->cellOf[i] < 0){
+            this->insert(i, pos);
+        }
+        else if(this->cell_index(pos) != this->cellOf[i]){
+            this->erase(i);
+            this->insert(i, pos);
+        }
+    }
+
+    //Call f(cell) for every cell surrounding pos
+    template <typename F>
+    inline void for_each_cell(const Eigen::Vector3d& pos, F&& f){
+        int sx[3], sy[3], sz[3];
+        int mx = stencil(coord(pos[0], 0), 0, sx);
+        int my = stencil(coord(pos[1], 1), 1, sy);
+        int mz = stencil(coord(pos[2], 2), 2, sz);
+
+        for(int a = 0; a < mx; a++){
+            for(int b = 0; b < my; b++){
+                for(int c = 0; c < mz; c++){
+                    f(this->cells[(sx[a] * this->n[1] + sy[b]) * this->n[2] + sz[c]]);
+                }
+            }
+        }
+    }
+
+    //Call f(cell) once for every cell surrounding pos or its mirror at z = imgZ, the two share the x and y stencils
+    template <typename F>
+    inline void for_each_cell(const Eigen::Vector3d& pos, double imgZ, F&& f){
+        int sx[3], sy[3], sz[6];
+        int mx = stencil(coord(pos[0], 0), 0, sx);
+        int my = stencil(coord(pos[1], 1), 1, sy);
+        int mz = stencil(coord(pos[2], 2), 2, sz);
+
+        int iz[3];
+        int mi = stencil(coord(imgZ, 2), 2, iz);
+        for(int k = 0; k < mi; k++){
+            if(std::find(sz, sz + mz, iz[k]) == sz + mz) sz[mz++] = iz[k];
+        }
+
+        for(int a = 0; a < mx; a++){
+            for(int b = 0; b < my; b++){
+                for(int c = 0; c < mz; c++){
+                    f(this->cells[(sx[a] * this->n[1] + sy[b]) * this->n[2] + sz[c]]);
+                }
+            }
+        }
+    }
+
+    //Call f(j) for every particle j in the cells surrounding pos
+    template <typename F>
+    inline void for_each(const Eigen::Vector3d& pos, F&& f){
+        this->for_each_cell(pos, [&](const std::vector<unsigned int>& cell){
+            for(auto j : cell){
+                f(j);
+            }
+        });
+    }
+};
@@ -3,7 +3,32 @@
 #include "particle.h"
 #include "particles.h"
 #include "geometry.h"
+#include "cells.h"
+#include <type_traits>
+#include <tuple>
+#include <utility>
+#include <limits>
 
+//Pair functors that provide batch() and batch_img(), kernels over many partners at once
+template <typename E, typename = void>
+struct is_batched : std::false_type {};
+
+template <typename E>
+struct is_batched<E, std::void_t<decltype(E::batched)> > : std::true_type {};
+
+//Reciprocal functors with a volume trial that can be discarded, rescale()
+template <typename E, typename = void>
+struct has_rescale : std::false_type {};
+
+template <typename E>
+struct has_rescale<E, std::void_t<decltype(std::declval<E&>().rescale(0.0, 0.0, 0.0, std::declval<Particles&>()))> > : std::true_type {};
+
+//Reciprocal functors that bound the energy change of a trial, min_change()
+template <typename E, typename = void>
+struct has_min_change : std::false_type {};
+
+template <typename E>
+struct has_min_change<E, std::void_t<decltype(std::declval<E&>().min_change(0.0))> > : std::true_type {};
 
 class EnergyBase{
 
@@ -14,11 +39,20 @@ class EnergyBase{
 
     public:
     Geometry *geo;
+    CellList *cells = nullptr;  //Neighbor grid, only set for terms with a real-space cutoff
 
     void set_geo(Geometry* geo){
         this->geo = geo;
     }
 
+    void set_cells(CellList* cells){
+        this->cells = cells;
+    }
+
+    double get_cutoff(){
+        return this->cutoff;
+    }
+
     void set_cutoff(double cutoff){
         this->cutoff = cutoff;
         printf("\tEnergy cutoff set to %lf\n", this->cutoff);
@@ -27,98 +61,299 @@ class EnergyBase{
 
     virtual ~EnergyBase(){};
     virtual double all2all(Particles& particles) = 0;
-    virtual double i2all(std::shared_ptr<Particle> p, Particles& particles) = 0;
+    virtual double i2all(const std::shared_ptr<Particle>& p, Particles& particles) = 0;
     virtual double operator()(std::vector< unsigned int >&& p, Particles& particles) = 0;
     virtual double operator()(std::vector< unsigned int >& p, Particles& particles) = 0;
     virtual void update(std::vector< std::shared_ptr<Particle> >&& _old, std::vector< std::shared_ptr<Particle> >&& _new) = 0;
+    //As above for a trial that the caller keeps using, as Pipeline does for each of its terms. By default it is copied
+    virtual void update(const std::vector< std::shared_ptr<Particle> >& _old, const std::vector< std::shared_ptr<Particle> >& _new){
+        this->update(std::vector< std::shared_ptr<Particle> >(_old), std::vector< std::shared_ptr<Particle> >(_new));
+    }
     virtual void update(double x, double y, double z) = 0;
     virtual void initialize(Particles& particles) = 0;
+
+    virtual void set_cache(bool useCache){}
+
+    //Energy of the moved particles in the accepted (old) state, terms that cache it can skip the sweep
+    virtual double old_energy(std::vector< unsigned int >& p, Particles& particles){
+        return (*this)(p, particles);
+    }
+
+    //Energy of the moved particles p in the trial, as operator(). Composed terms may stop once their energy change
+    //is certain to exceed limit and return infinity, old_energy() is called for the trial first
+    virtual double evaluate(std::vector< unsigned int >& p, Particles& particles, double limit){
+        return (*this)(p, particles);
+    }
+
+    //Called when a trial is accepted. old holds copies of the moved particles from before the trial
+    //followed by the removed ones, particles and moved are the new state
+    virtual void save(std::vector< std::shared_ptr<Particle> >& old, Particles& particles, std::vector< unsigned int >& moved){}
+
+    //Called when a trial is rejected, drops whatever update() did for it
+    virtual void revert(){}
+
+    //Called after an accepted trial is saved. Terms whose approximation follows the configuration may
+    //change it here, the change of their energy is returned
+    virtual double refine(Particles& particles){
+        return 0.0;
+    }
+
+    //Lower bound on the energy change of a trial that moves the particles p without changing them,
+    //lets a trial stop early once it is certain to be rejected. -infinity if the term has none
+    virtual double min_change(std::vector< unsigned int >& p, Particles& particles){
+        return -std::numeric_limits<double>::infinity();
+    }
+
+    //Volume trial to a box x, y, z, by default everything is recomputed
+    virtual void rescale(double x, double y, double z, Particles& particles){
+        this->update(x, y, z);
+        this->initialize(particles);
+    }
+
+    //Rejected volume trial, back to the box x, y, z of the old state. The particles are already restored
+    virtual void revert_volume(double x, double y, double z, Particles& particles){
+        this->update(x, y, z);
+        this->initialize(particles);
+    }
 };
 
 
 
-template <typename E>
-class PairEnergy : public EnergyBase{
+template <typename E, typename G = Geometry>
+class PairEnergy final : public EnergyBase{
 
     private:
 
     E energy_func;  //energy functor
 
+    //Optional per-particle energy cache, cache[i] is the pair energy of i with all others in the accepted state
+    bool useCache = false, cacheValid = false;
+    std::vector<double> cache;
+    std::vector< std::pair<unsigned int, double> > trial;          //Terms of the moved particles with each partner within the cutoff in the last trial
+    std::vector< std::pair<unsigned int, double> > trialMoved;     //New cache entries of the moved particles
+    std::vector<double> scratch;                                    //Partner terms of the batched kernels, zero between calls
+
+    //Total energy of the accepted state, kept up to date from the trials so that volume trials only need the new state
+    bool totalValid = false;
+    double total = 0.0, lastOld = 0.0, lastNew = 0.0;
+
+    void build_cache(Particles& particles){
+        this->cache.resize(particles.tot);
+        for(unsigned int i = 0; i < particles.tot; i++){
+            this->cache[i] = this->i2all(particles.particles[i], particles);
+        }
+        this->cacheValid = true;
+    }
+
+    //Concrete geometry, the minimum image inlines into the pair loops unless G is the Geometry base
+    inline G* geometry(){
+        return static_cast<G*>(this->geo);
+    }
+
     public:
 
+    PairEnergy(){}
+    PairEnergy(E energy_func) : energy_func(energy_func){}
+
+    void set_cache(bool useCache){
+        this->useCache = useCache;
+        this->cacheValid = false;
+        printf("\tPair energy cache: %s\n", useCache ? "on" : "off");
+    }
+
     double all2all(Particles& particles){
         double e = 0.0;
 
         //printf("all2all geo: %lf %lf %lf\n", this->geo->dh[0], this->geo->dh[1], this->geo->dh[2]);
         #pragma omp parallel for reduction(+:e) schedule(dynamic, 100) if(particles.tot >= 500)
         for(unsigned int i = 0; i < particles.tot; i++){
-            for(unsigned int j = i + 1; j < particles.tot; j++){
-                //printf("distance %lf\n", this->geo->distance(particles[i]->pos, particles[j]->pos));
-                //printf("Indices: %u, %u\n", i, j);
-                e += i2i(particles[i]->q, particles[j]->q, this->geo->distance(particles[i]->pos, particles[j]->pos));
-            }  
+            Eigen::Vector3d a = particles.pos(i);
+            if constexpr (is_batched<E>::value){
+                unsigned int o = i + 1;
+                e += particles.qs[i] * energy_func.batch(particles.x.data() + o, particles.y.data() + o, particles.z.data() + o, particles.qs.data() + o, nullptr,
+                                                         particles.tot - o, particles.tot, a, this->geo, this->cutoff);
+                continue;
+            }
+            unsigned int o = i + 1;
+            this->geometry()->for_each_within(particles.x.data() + o, particles.y.data() + o, particles.z.data() + o, nullptr, particles.tot - o,
+                                              a, this->cutoff, std::numeric_limits<unsigned int>::max(), [&](unsigned int j, double r2){
+                e += i2i(particles.qs[i], particles.qs[o + j], std::sqrt(r2));
+            });
         }
         //printf("Real energy: %.15lf\n", e);
         return e * constants::lB;
     }
 
-    inline double i2all(std::shared_ptr<Particle> p, Particles& particles){
+    inline double i2all(const std::shared_ptr<Particle>& p, Particles& particles){
+        return this->i2all(p, particles, p->index, nullptr);
+    }
+
+    //Pair energy of p with all but skip. Unless out is nullptr, the term v with each partner j within the cutoff is also passed to out(j, v)
+    template <typename F>
+    inline double i2all(const std::shared_ptr<Particle>& p, Particles& particles, unsigned int skip, F&& out){
+        constexpr bool record = !std::is_same_v<std::decay_t<F>, std::nullptr_t>;
         double e = 0.0;
-        
-        for (unsigned int i = 0; i < particles.tot; i++){
-            if (p->index == particles[i]->index) continue;
-            e += i2i(p->q, particles[i]->q, this->geo->distance(p->pos, particles[i]->pos));
+
+        if constexpr (is_batched<E>::value){
+            //The kernels add the partner terms to an array, read back and cleared for the partners visited
+            double* terms = nullptr;
+            if constexpr (record){
+                if(this->scratch.size() < particles.tot) this->scratch.resize(particles.tot, 0.0);
+                terms = this->scratch.data();
+            }
+            auto flush = [&](const unsigned int* idx, unsigned int n){
+                if constexpr (record){
+                    for(unsigned int k = 0; k < n; k++){
+                        unsigned int j = (idx == nullptr) ? k : idx[k];
+                        if(terms[j] != 0.0) out(j, terms[j]);
+                        terms[j] = 0.0;
+                    }
+                }
+            };
+
+            if(this->cells != nullptr && this->cells->enabled){
+                this->cells->for_each_cell(p->pos, [&](const std::vector<unsigned int>& cell){
+                    e += energy_func.batch(particles.x.data(), particles.y.data(), particles.z.data(), particles.qs.data(), cell.data(),
+                                           cell.size(), skip, p->pos, this->geo, this->cutoff, terms, p->q);
+                    flush(cell.data(), cell.size());
+                });
+            }
+            else{
+                e = energy_func.batch(particles.x.data(), particles.y.data(), particles.z.data(), particles.qs.data(), nullptr,
+                                      particles.tot, skip, p->pos, this->geo, this->cutoff, terms, p->q);
+                flush(nullptr, particles.tot);
+            }
+            return p->q * e;
         }
 
+        auto pair = [&](unsigned int i, double r2){
+            double v = i2i(p->q, particles.qs[i], std::sqrt(r2));
+            e += v;
+            if constexpr (record) out(i, v);
+        };
+
+        if(this->cells != nullptr && this->cells->enabled){
+            this->cells->for_each_cell(p->pos, [&](const std::vector<unsigned int>& cell){
+                this->geometry()->for_each_within(particles.x.data(), particles.y.data(), particles.z.data(), cell.data(), cell.size(),
+                                                  p->pos, this->cutoff, skip, pair);
+            });
+            return e;
+        }
+
+        this->geometry()->for_each_within(particles.x.data(), particles.y.data(), particles.z.data(), nullptr, particles.tot,
+                                          p->pos, this->cutoff, skip, pair);
+        return e;
+    }
+
+    //Pair energy among the moved particles, counted twice by summing i2all over them
+    inline double moved2moved(std::vector< unsigned int >& p, Particles& particles){
+        double e = 0.0;
+        for(std::size_t i = 0; i < p.size(); i++){
+            for(std::size_t j = i + 1; j < p.size(); j++){
+                e += i2i(particles[p[i]]->q, particles[p[j]]->q, this->geometry()->distance(particles[p[i]]->pos, particles[p[j]]->pos));
+            }
+        }
         return e;
     }
 
     double operator()(std::vector< unsigned int >&& p, Particles& particles){
+        return (*this)(p, particles);
+    }
+
+    double operator()(std::vector< unsigned int >& p, Particles& particles){
         //printf("i2all geo: %lf %lf %lf\n", this->geo->dh[0], this->geo->dh[1], this->geo->dh[2]);
         double e = 0.0;
-        // Need to fix this, not a nice solution (when volume move).........
+        // Need to fix this, not a nice solution.........
         if(p.size() == particles.tot){
             e = all2all(particles) / constants::lB;
         }
+        else if(this->useCache){
+            //Record the partner terms so that the cache can be updated if the trial is accepted
+            this->trial.clear();
+            this->trialMoved.clear();
+            for(auto i : p){
+                double u = i2all(particles.particles[i], particles, i, [&](unsigned int j, double v){ this->trial.push_back({j, v}); });
+                this->trialMoved.push_back({i, u});
+                e += u;
+            }
+            e -= moved2moved(p, particles);
+        }
         else{
             #pragma omp parallel for reduction(+:e) schedule(dynamic, 100) if(particles.tot >= 500)
-            for(int i = 0; i < p.size(); i++){
+            for(std::size_t i = 0; i < p.size(); i++){
                 //do instead i2all(s, particles);
                 e += i2all(particles.particles[p[i]], particles);
             }
 
-            for(int i = 0; i < p.size(); i++){
-                for(int j = i + 1; j < p.size(); j++){
-                    e -= i2i(particles[p[i]]->q, particles[p[j]]->q, this->geo->distance(particles[p[i]]->pos, particles[p[j]]->pos));
-                }
-            }
+            e -= moved2moved(p, particles);
         }
 
-        return e * constants::lB;
+        this->lastNew = e * constants::lB;
+        return this->lastNew;
     }
 
-    double operator()(std::vector< unsigned int >& p, Particles& particles){
-        //printf("i2all geo: %lf %lf %lf\n", this->geo->dh[0], this->geo->dh[1], this->geo->dh[2]);
-        double e = 0.0;
-        // Need to fix this, not a nice solution.........
+    double old_energy(std::vector< unsigned int >& p, Particles& particles){
         if(p.size() == particles.tot){
-            e = all2all(particles) / constants::lB;
+            if(!this->totalValid){
+                this->total = (*this)(p, particles);
+                this->totalValid = true;
+            }
+            this->lastOld = this->total;
+        }
+        else if(!this->useCache){
+            this->lastOld = (*this)(p, particles);
         }
         else{
-            #pragma omp parallel for reduction(+:e) schedule(dynamic, 100) if(particles.tot >= 500)
-            for(int i = 0; i < p.size(); i++){
-                //do instead i2all(s, particles);
-                e += i2all(particles.particles[p[i]], particles);
+            if(!this->cacheValid){
+                this->build_cache(particles);
             }
 
-            for(int i = 0; i < p.size(); i++){
-                for(int j = i + 1; j < p.size(); j++){
-                    e -= i2i(particles[p[i]]->q, particles[p[j]]->q, this->geo->distance(particles[p[i]]->pos, particles[p[j]]->pos));
-                }
+            double e = 0.0;
+            for(auto i : p){
+                e += this->cache[i];
             }
+            this->lastOld = (e - moved2moved(p, particles)) * constants::lB;
         }
+        return this->lastOld;
+    }
 
-        return e * constants::lB;
+    void save(std::vector< std::shared_ptr<Particle> >& old, Particles& particles, std::vector< unsigned int >& moved){
+        if(moved.size() == particles.tot){
+            this->total = this->lastNew;
+            this->totalValid = true;
+        }
+        else if(this->totalValid){
+            this->total += this->lastNew - this->lastOld;
+        }
+
+        if(!this->useCache || !this->cacheValid) return;
+
+        //Volume moves, rebuilt at the next trial
+        if(moved.size() == particles.tot){
+            this->cacheValid = false;
+            return;
+        }
+
+        //Removed particles, the last entry takes the slot of each as in Particles::take
+        for(std::size_t k = moved.size(); k < old.size(); k++){
+            this->cache[old[k]->index] = this->cache.back();
+            this->cache.pop_back();
+        }
+        this->cache.resize(particles.tot, 0.0);
+
+        //Remove the old terms of the moved particles from their partners, the entries of
+        //the moved particles themselves are overwritten below. Removed ones have no self to skip
+        for(std::size_t k = 0; k < old.size(); k++){
+            i2all(old[k], particles, (k < moved.size()) ? old[k]->index : particles.tot, [&](unsigned int j, double v){ this->cache[j] -= v; });
+        }
+
+        //Add the new terms, recorded in the trial
+        for(auto& [j, v] : this->trial){
+            this->cache[j] += v;
+        }
+        for(auto& [i, u] : this->trialMoved){
+            this->cache[i] = u;
+        }
     }
 
     inline double i2i(double& q1, double& q2, double&& dist){
@@ -131,7 +366,18 @@ class PairEnergy : public EnergyBase{
     }
 
     void update(std::vector< std::shared_ptr<Particle> >&& _old, std::vector< std::shared_ptr<Particle> >&& _new){}
-    void initialize(Particles& particles){}
+    void update(const std::vector< std::shared_ptr<Particle> >& _old, const std::vector< std::shared_ptr<Particle> >& _new){}
+
+    void initialize(Particles& particles){
+        //Rebuilt from the accepted state at the next trial
+        this->cacheValid = false;
+        this->totalValid = false;
+    }
+
+    //Nothing depends on the box except through geo
+    void rescale(double x, double y, double z, Particles& particles){}
+    void revert_volume(double x, double y, double z, Particles& particles){}
+
     void update(double x, double y, double z){}
 };
 
@@ -175,7 +421,7 @@ class ChargeWell : public EnergyBase{
         return e * constants::lB;
     }
 
-    inline double i2all(std::shared_ptr<Particle> p, Particles& particles){
+    inline double i2all(const std::shared_ptr<Particle>& p, Particles& particles){
 
         double e = this->i2i(p->r, this->geo->distance(p->pos, p->com));
 
@@ -202,6 +448,7 @@ class ChargeWell : public EnergyBase{
     }
 
     void update(std::vector< std::shared_ptr<Particle> >&& _old, std::vector< std::shared_ptr<Particle> >&& _new){}
+    void update(const std::vector< std::shared_ptr<Particle> >& _old, const std::vector< std::shared_ptr<Particle> >& _new){}
     void initialize(Particles& particles){}
     void update(double x, double y, double z){}
 };
@@ -212,19 +459,29 @@ class ChargeWell : public EnergyBase{
 
 
 
-template <typename E>
-class PairEnergyWithRep : public EnergyBase{
+template <typename E, typename G = Geometry>
+class PairEnergyWithRep final : public EnergyBase{
 
     private:
 
     E energy_func;  //energy functor
     int rep;
+
+    //Concrete geometry, the minimum image inlines into the pair loops unless G is the Geometry base
+    inline G* geometry(){
+        return static_cast<G*>(this->geo);
+    }
+
     public:
 
     PairEnergyWithRep(int rep){
         this->rep = rep;
     }
 
+    PairEnergyWithRep(int rep, E energy_func) : energy_func(energy_func){
+        this->rep = rep;
+    }
+
 
     double all2all(Particles& particles){
         double e = 0.0;
@@ -238,7 +495,7 @@ class PairEnergyWithRep : public EnergyBase{
                         for(unsigned int j = 0; j < particles.tot; j++){
                             if(l == 0 && m == 0 && n == 0 && i == j) continue;
                             disp << particles[j]->pos[0] + l * geo->d[0], particles[j]->pos[1] +  m * geo->d[1], particles[j]->pos[2] +  n * geo->d[2];
-                            e += i2i(particles[i]->q, particles[j]->q, this->geo->distance(particles[i]->pos, disp));
+                            e += i2i(particles[i]->q, particles[j]->q, this->geometry()->distance(particles[i]->pos, disp));
                         }  
                     }
                 }
@@ -250,7 +507,7 @@ class PairEnergyWithRep : public EnergyBase{
         return e * constants::lB;
     }
 
-    inline double i2all(std::shared_ptr<Particle> p, Particles& particles){
+    inline double i2all(const std::shared_ptr<Particle>& p, Particles& particles){
         double e = 0.0;
 
         Eigen::Vector3d disp;
@@ -263,10 +520,10 @@ class PairEnergyWithRep : public EnergyBase{
                         if (l == 0 && m == 0 && n == 0 && p->index == particles[i]->index) continue;
                         disp << particles[i]->pos[0] + (double)l * geo->d[0], particles[i]->pos[1] +  (double)m * geo->d[1], particles[i]->pos[2] +  (double)n * geo->d[2];
                         if(p->index == particles[i]->index){
-                            e += 0.5 * i2i(p->q, particles[i]->q, this->geo->distance(p->pos, disp));
+                            e += 0.5 * i2i(p->q, particles[i]->q, this->geometry()->distance(p->pos, disp));
                         }
                         else{
-                            e += i2i(p->q, particles[i]->q, this->geo->distance(p->pos, disp));
+                            e += i2i(p->q, particles[i]->q, this->geometry()->distance(p->pos, disp));
                         }    
                     }
                 }
@@ -284,9 +541,9 @@ class PairEnergyWithRep : public EnergyBase{
             e += i2all(particles.particles[s], particles);
         }
 
-        for(int i = 0; i < p.size(); i++){
-           for(int j = i + 1; j < p.size(); j++){
-               e -= i2i(particles[p[i]]->q, particles[p[j]]->q, this->geo->distance(particles[p[i]]->pos, particles[p[j]]->pos));
+        for(std::size_t i = 0; i < p.size(); i++){
+           for(std::size_t j = i + 1; j < p.size(); j++){
+               e -= i2i(particles[p[i]]->q, particles[p[j]]->q, this->geometry()->distance(particles[p[i]]->pos, particles[p[j]]->pos));
            }
         }
 
@@ -301,9 +558,9 @@ class PairEnergyWithRep : public EnergyBase{
             e += i2all(particles.particles[s], particles);
         }
 
-        for(int i = 0; i < p.size(); i++){
-           for(int j = i + 1; j < p.size(); j++){
-               e -= i2i(particles[p[i]]->q, particles[p[j]]->q, this->geo->distance(particles[p[i]]->pos, particles[p[j]]->pos));
+        for(std::size_t i = 0; i < p.size(); i++){
+           for(std::size_t j = i + 1; j < p.size(); j++){
+               e -= i2i(particles[p[i]]->q, particles[p[j]]->q, this->geometry()->distance(particles[p[i]]->pos, particles[p[j]]->pos));
            }
         }
 
@@ -320,6 +577,7 @@ class PairEnergyWithRep : public EnergyBase{
     }
 
     void update(std::vector< std::shared_ptr<Particle> >&& _old, std::vector< std::shared_ptr<Particle> >&& _new){}
+    void update(const std::vector< std::shared_ptr<Particle> >& _old, const std::vector< std::shared_ptr<Particle> >& _new){}
     void update(double x, double y, double z){}
     void initialize(Particles& particles){}
 };
@@ -335,18 +593,20 @@ class PairEnergyWithRep : public EnergyBase{
 
 
 template <typename E>
-class ExtEnergy : public EnergyBase{
+class ExtEnergy final : public EnergyBase{
 
     private:
 
     E energy_func;  //energy functor
+    double accepted = 0.0, trial = 0.0;     //Energy of the accepted state and of the last evaluated trial
+    bool evaluated = false;                 //trial is set for the pending trial
 
     public:
     ExtEnergy(double x, double y, double z){
         energy_func.set_box(x, y, z);
     }
 
-    double i2all(std::shared_ptr<Particle> p, Particles& particles){ return 0.0; }
+    double i2all(const std::shared_ptr<Particle>& p, Particles& particles){ return 0.0; }
     double i2i(std::shared_ptr<Particle> p1, std::shared_ptr<Particle> p2){ return 0.0; }
 
     double all2all(Particles& particles){
@@ -355,66 +615,145 @@ class ExtEnergy : public EnergyBase{
     }
 
     double operator()(std::vector< unsigned int >&& p, Particles& particles){
-        return energy_func() * constants::lB;
+        return (*this)(p, particles);
     }
 
     double operator()(std::vector< unsigned int >& p, Particles& particles){
-        return energy_func() * constants::lB;
+        this->trial = energy_func() * constants::lB;
+        this->evaluated = true;
+        return this->trial;
+    }
+
+    //The k-sum of the accepted state is kept, so only the trial side is summed
+    double old_energy(std::vector< unsigned int >& p, Particles& particles){
+        return this->accepted;
     }
 
     void update(std::vector< std::shared_ptr<Particle> >&& _old, std::vector< std::shared_ptr<Particle> >&& _new){
         energy_func.update(_old, _new);
     }
 
+    void update(const std::vector< std::shared_ptr<Particle> >& _old, const std::vector< std::shared_ptr<Particle> >& _new){
+        energy_func.update(_old, _new);
+    }
+
     void update(double x, double y, double z){
         energy_func.set_box(x, y, z);
     }
 
     void initialize(Particles& particles){
+        energy_func.discard();
         energy_func.initialize(particles);
+        this->accepted = energy_func() * constants::lB;
+        this->evaluated = false;
+    }
+
+    void save(std::vector< std::shared_ptr<Particle> >& old, Particles& particles, std::vector< unsigned int >& moved){
+        energy_func.commit();
+        this->accepted = (this->evaluated) ? this->trial : energy_func() * constants::lB;
+        this->evaluated = false;
+    }
+
+    void revert(){
+        energy_func.discard();
+        this->evaluated = false;
+    }
+
+    double min_change(std::vector< unsigned int >& p, Particles& particles){
+        if constexpr (has_min_change<E>::value){
+            double Q = 0.0;
+            for(auto i : p){
+                Q += std::fabs(particles.qs[i]);
+            }
+            return energy_func.min_change(Q) * constants::lB;
+        }
+        return -std::numeric_limits<double>::infinity();
+    }
+
+    void rescale(double x, double y, double z, Particles& particles){
+        if constexpr (has_rescale<E>::value){
+            energy_func.rescale(x, y, z, particles);
+        }
+        else{
+            this->update(x, y, z);
+            this->initialize(particles);
+        }
+    }
+
+    void revert_volume(double x, double y, double z, Particles& particles){
+        if constexpr (has_rescale<E>::value){
+            energy_func.discard();
+            this->evaluated = false;
+        }
+        else{
+            this->update(x, y, z);
+            this->initialize(particles);
+        }
     }
 };
 
 
 
 
-template <typename E>
-class ImgEnergy : public EnergyBase{
+template <typename E, typename G = Geometry>
+class ImgEnergy final : public EnergyBase{
 
     private:
 
     E energy_func;  //energy functor
 
-    public:
+    //Concrete geometry, the minimum image inlines into the pair loops unless G is the Geometry base
+    inline G* geometry(){
+        return static_cast<G*>(this->geo);
+    }
 
-    inline double i2all(std::shared_ptr<Particle> p, Particles& particles){
-        double CC = 0.0, CpC = 0.0, self = 0.0;
-        Eigen::Vector3d temp;
+    public:
 
-        // CC
-        #pragma omp parallel for reduction(+:CC) schedule(guided, 500) if(particles.tot >= 3000) 
-        for (unsigned int i = 0; i < particles.tot; i++){
-            if (p->index == particles[i]->index) continue;
+    ImgEnergy(){}
+    ImgEnergy(E energy_func) : energy_func(energy_func){}
 
-            CC += i2i(p->q, particles[i]->q, this->geo->distance(p->pos, particles[i]->pos));
+    //Direct (CC) and image (C'C) terms of p in one pass over the partners, each partner is loaded once and
+    //its distances to p and to the mirror of p are taken together
+    inline double i2all(const std::shared_ptr<Particle>& p, Particles& particles){
+        double e = 0.0;
+        Eigen::Vector3d img = p->pos;
+        img[2] = math::sgn(img[2]) * this->geo->dh[2] - img[2];
+
+        if constexpr (is_batched<E>::value){
+            if(this->cells != nullptr && this->cells->enabled){
+                this->cells->for_each_cell(p->pos, img[2], [&](const std::vector<unsigned int>& cell){
+                    e += energy_func.batch_img(particles.x.data(), particles.y.data(), particles.z.data(), particles.qs.data(), cell.data(),
+                                               cell.size(), p->index, p->pos, img, this->geo, this->cutoff);
+                });
+            }
+            else{
+                e = energy_func.batch_img(particles.x.data(), particles.y.data(), particles.z.data(), particles.qs.data(), nullptr,
+                                          particles.tot, p->index, p->pos, img, this->geo, this->cutoff);
+            }
+            e *= p->q;
         }
-
-
-        //  C'C
-        temp = p->pos;
-        temp[2] = math::sgn(temp[2]) * this->geo->dh[2] - temp[2]; 
-        #pragma omp parallel for reduction(+:CpC) schedule(guided, 500) if(particles.tot >= 3000) 
-        for (unsigned int i = 0; i < particles.tot; i++){
-            if (p->index == particles[i]->index) continue;
-
-            CpC += i2i(-p->q, particles[i]->q, this->geo->distance(temp, particles[i]->pos));
+        else{
+            const double cutoff2 = this->cutoff * this->cutoff;
+            auto pair = [&](unsigned int i, double r2, double r2img){
+                if(r2 <= cutoff2) e += i2i(p->q, particles.qs[i], std::sqrt(r2));
+                if(r2img <= cutoff2) e += i2i(-p->q, particles.qs[i], std::sqrt(r2img));
+            };
+
+            if(this->cells != nullptr && this->cells->enabled){
+                this->cells->for_each_cell(p->pos, img[2], [&](const std::vector<unsigned int>& cell){
+                    this->geometry()->for_each_within(particles.x.data(), particles.y.data(), particles.z.data(), cell.data(), cell.size(),
+                                                      p->pos, img[2], this->cutoff, p->index, pair);
+                });
+            }
+            else{
+                this->geometry()->for_each_within(particles.x.data(), particles.y.data(), particles.z.data(), nullptr, particles.tot,
+                                                  p->pos, img[2], this->cutoff, p->index, pair);
+            }
         }
         // => CC == C'C' and C'C == CC'
 
-        // Self term  
-
-        self = i2i(p->q, -p->q, this->geo->distance(p->pos, temp));
-        return CC + CpC + 0.5 * self;
+        // Self term
+        return e + 0.5 * i2i(p->q, -p->q, this->geometry()->distance(p->pos, img));
     }
 
 
@@ -428,30 +767,21 @@ class ImgEnergy : public EnergyBase{
     }
 
 
+    //CC over the pairs j > i and C'C over all j, including the self image, in one pass per i
     double all2all(Particles& particles){
         double CC = 0.0, CpC = 0.0;
-        Eigen::Vector3d temp;
-        Eigen::Vector3d temp2;
+        const double cutoff2 = this->cutoff * this->cutoff;
 
-        // CC
-        #pragma omp parallel for schedule(guided, 200) reduction(+:CC) if(particles.tot >= 1000)
+        #pragma omp parallel for schedule(dynamic, 200) reduction(+:CC, CpC) if(particles.tot >= 1000)
         for(unsigned int i = 0; i < particles.tot; i++){
-            for(unsigned int j = i + 1; j < particles.tot; j++){
-                //CC += energy_func(particles[i]->q, particles[j]->q, this->geo->distance(particles[i]->pos, particles[j]->pos));
-                CC += i2i(particles[i]->q, particles[j]->q, this->geo->distance(particles[i]->pos, particles[j]->pos));
-            } 
-        }
-
-        //C'C
-        #pragma omp parallel for schedule(dynamic, 200) reduction(+:CpC) private(temp) if(particles.tot >= 1000)
-        for(unsigned int i = 0; i < particles.tot; i++){
-            temp = particles[i]->pos;
-            temp[2] = math::sgn(temp[2]) * this->geo->dh[2] - temp[2]; 
-
-            for(unsigned int j = 0; j < particles.tot; j++){
-                //CpC += energy_func(-particles[i]->q, particles[j]->q, this->geo->distance(temp, particles[j]->pos));
-                CpC += i2i(-particles[i]->q, particles[j]->q, this->geo->distance(temp, particles[j]->pos));
-            } 
+            Eigen::Vector3d a = particles.pos(i);
+            double imgZ = math::sgn(a[2]) * this->geo->dh[2] - a[2];
+
+            this->geometry()->for_each_within(particles.x.data(), particles.y.data(), particles.z.data(), nullptr, particles.tot,
+                                              a, imgZ, this->cutoff, std::numeric_limits<unsigned int>::max(), [&](unsigned int j, double r2, double r2img){
+                if(j > i && r2 <= cutoff2) CC += i2i(particles.qs[i], particles.qs[j], std::sqrt(r2));
+                if(r2img <= cutoff2) CpC += i2i(-particles.qs[i], particles.qs[j], std::sqrt(r2img));
+            });
         }
 
         return (CC + 0.5 * CpC) * constants::lB;
@@ -464,9 +794,9 @@ class ImgEnergy : public EnergyBase{
             e += i2all(particles[s], particles);
         }
 
-        for(int i = 0; i < p.size(); i++){
-           for(int j = i + 1; j < p.size(); j++){
-               e -= i2i(particles[p[i]]->q, particles[p[j]]->q, this->geo->distance(particles[p[i]]->pos, particles[p[j]]->pos));
+        for(std::size_t i = 0; i < p.size(); i++){
+           for(std::size_t j = i + 1; j < p.size(); j++){
+               e -= i2i(particles[p[i]]->q, particles[p[j]]->q, this->geometry()->distance(particles[p[i]]->pos, particles[p[j]]->pos));
            }
         }
 
@@ -480,9 +810,9 @@ class ImgEnergy : public EnergyBase{
             e += i2all(particles[s], particles);
         }
 
-        for(int i = 0; i < p.size(); i++){
-           for(int j = i + 1; j < p.size(); j++){
-               e -= i2i(particles[p[i]]->q, particles[p[j]]->q, this->geo->distance(particles[p[i]]->pos, particles[p[j]]->pos));
+        for(std::size_t i = 0; i < p.size(); i++){
+           for(std::size_t j = i + 1; j < p.size(); j++){
+               e -= i2i(particles[p[i]]->q, particles[p[j]]->q, this->geometry()->distance(particles[p[i]]->pos, particles[p[j]]->pos));
            }
         }
 
@@ -495,6 +825,8 @@ class ImgEnergy : public EnergyBase{
         UNUSED(_new);
     }
 
+    void update(const std::vector< std::shared_ptr<Particle> >& _old, const std::vector< std::shared_ptr<Particle> >& _new){}
+
     void update(double x, double y, double z){}
 
     void initialize(Particles& particles){
@@ -509,37 +841,70 @@ class ImgEnergy : public EnergyBase{
 
 
 
-template <typename E>
-class MIHalfwald : public EnergyBase{
+template <typename E, typename G = Geometry>
+class MIHalfwald final : public EnergyBase{
 
     private:
 
     E energy_func;  //energy functor
     int kMax;
     double eps;
+    std::vector<double> weight, weightImg;    //Dielectric weight of each replica layer, eps^2|k| and eps^(2|k|+1) at k + kMax
+
+    //Concrete geometry, the minimum image inlines into the pair loops unless G is the Geometry base
+    inline G* geometry(){
+        return static_cast<G*>(this->geo);
+    }
+
+    void set_weights(){
+        for(int k = -this->kMax; k <= this->kMax; k++){
+            this->weight.push_back(std::pow(this->eps, 2.0 * std::fabs(k)));
+            this->weightImg.push_back(std::pow(this->eps, 2.0 * std::fabs(k) + 1.0));
+        }
+    }
+
+    //Whether a layer shifted by shift in z can hold an image within the cutoff of z. The charges of the
+    //box lie within half a box of its center and their mirrors within a whole box, i.e. halfWidth
+    inline bool reaches(double z, double shift, double halfWidth){
+        return std::fabs(z - shift) - halfWidth <= this->cutoff;
+    }
 
     public:
 
     MIHalfwald(int kMax, double eps) : kMax(kMax), eps(eps){
         printf("\tNumber of replicas (on each side of original cell): %i\n", this->kMax);
         printf("\teps factor: %lf\n", this->eps);
+        this->set_weights();
+    }
+
+    MIHalfwald(int kMax, double eps, E energy_func) : energy_func(energy_func), kMax(kMax), eps(eps){
+        printf("\tNumber of replicas (on each side of original cell): %i\n", this->kMax);
+        printf("\teps factor: %lf\n", this->eps);
+        this->set_weights();
     }
 
-    inline double i2all(std::shared_ptr<Particle> p, Particles& particles){
+    inline double i2all(const std::shared_ptr<Particle>& p, Particles& particles){
         double CC = 0.0, CpC = 0.0;
         //double self = 0.0;
         Eigen::Vector3d temp;
 
+        if(this->cells != nullptr && this->cells->enabled){
+            return i2all_cells(p, particles);
+        }
+
         // CC
         for(int k = -this->kMax; k <= this->kMax; k++){
+            const double shift = k * 2.0 * this->geo->_d[2], w = this->weight[k + this->kMax];
+            if(!this->reaches(p->pos[2], shift, this->geo->_dh[2])) continue;
+
             #pragma omp parallel for schedule(dynamic, 250) reduction(+:CC) private(temp) if(particles.tot >= 1000)
             for (unsigned int i = 0; i < particles.tot; i++){
-                if (p->index == particles[i]->index && k == 0) continue;
+                if (p->index == i && k == 0) continue;
                 double tmpE = 0.0;
 
-                temp = particles[i]->pos;
-                temp[2] += k * 2.0 * this->geo->_d[2]; 
-                tmpE = i2i(p->q, particles[i]->q, this->geo->distance(p->pos, temp)) * std::pow(this->eps, 2.0 * std::fabs(k)); 
+                temp = particles.pos(i);
+                temp[2] += shift; 
+                tmpE = i2i(p->q, particles.qs[i], this->geometry()->distance(p->pos, temp)) * w; 
 
                 if(p->index == i){
                     tmpE *= 0.5; 
@@ -551,14 +916,17 @@ class MIHalfwald : public EnergyBase{
 
         //  CC'
         for(int k = -this->kMax; k <= this->kMax; k++){
+            const double shift = k * 2.0 * this->geo->_d[2], w = this->weightImg[k + this->kMax];
+            if(!this->reaches(p->pos[2], shift, this->geo->_d[2])) continue;
+
             #pragma omp parallel for schedule(dynamic, 250) reduction(+:CpC) private(temp) if(particles.tot >= 1000)
             for (unsigned int i = 0; i < particles.tot; i++){
                 double tmpE = 0.0;
-                temp = particles[i]->pos;
+                temp = particles.pos(i);
                 //temp[2] = math::sgn(temp[2]) * this->geo->dh[2] - temp[2]; 
-                temp[2] = math::sgn(temp[2]) * this->geo->_d[2] - temp[2] + k * 2.0 * this->geo->_d[2]; 
+                temp[2] = math::sgn(temp[2]) * this->geo->_d[2] - temp[2] + shift; 
 
-                tmpE = i2i(p->q, -particles[i]->q, this->geo->distance(p->pos, temp)) * std::pow(this->eps, 2.0 * std::fabs(k) + 1.0);
+                tmpE = i2i(p->q, -particles.qs[i], this->geometry()->distance(p->pos, temp)) * w;
                 if(p->index == i){
                     tmpE *= 0.5; 
                 }
@@ -571,6 +939,67 @@ class MIHalfwald : public EnergyBase{
         return CC + CpC;
     }
 
+    /*
+        Same sums as i2all but the candidates come from the neighbor grid. Shifting a replica of j
+        by s is the same as querying around p - s, and the mirror z -> c - z is its own inverse, so
+        one query per replica (and per mirror plane) finds every term inside the cutoff. Layers out
+        of reach are not queried, so the cost follows the number of images inside the cutoff.
+    */
+    inline double i2all_cells(const std::shared_ptr<Particle>& p, Particles& particles){
+        double CC = 0.0, CpC = 0.0;
+        Eigen::Vector3d temp, query;
+
+        // CC
+        for(int k = -this->kMax; k <= this->kMax; k++){
+            const double shift = k * 2.0 * this->geo->_d[2], w = this->weight[k + this->kMax];
+            if(!this->reaches(p->pos[2], shift, this->geo->_dh[2])) continue;
+
+            query = p->pos;
+            query[2] -= shift;
+            this->cells->for_each(query, [&](unsigned int i){
+                if (p->index == i && k == 0) return;
+                double tmpE = 0.0;
+
+                temp = particles.pos(i);
+                temp[2] += shift; 
+                tmpE = i2i(p->q, particles.qs[i], this->geometry()->distance(p->pos, temp)) * w; 
+
+                if(p->index == i){
+                    tmpE *= 0.5; 
+                }
+                
+                CC += tmpE;
+            });
+        }
+
+        //  CC', the mirror plane depends on which half j sits in
+        for(int k = -this->kMax; k <= this->kMax; k++){
+            const double shift = k * 2.0 * this->geo->_d[2], w = this->weightImg[k + this->kMax];
+            if(!this->reaches(p->pos[2], shift, this->geo->_d[2])) continue;
+
+            for(int s = -1; s <= 1; s += 2){
+                query = p->pos;
+                query[2] = s * this->geo->_d[2] + shift - query[2];
+                this->cells->for_each(query, [&](unsigned int i){
+                    if(math::sgn(particles.z[i]) != s) return;
+                    double tmpE = 0.0;
+
+                    temp = particles.pos(i);
+                    temp[2] = math::sgn(temp[2]) * this->geo->_d[2] - temp[2] + shift; 
+
+                    tmpE = i2i(p->q, -particles.qs[i], this->geometry()->distance(p->pos, temp)) * w;
+                    if(p->index == i){
+                        tmpE *= 0.5; 
+                    }
+
+                    CpC += tmpE;
+                });
+            }
+        }
+
+        return CC + CpC;
+    }
+
 
     inline double i2i(const double q1, const double q2, const double&& dist){
         if(dist <= this->cutoff){
@@ -588,16 +1017,21 @@ class MIHalfwald : public EnergyBase{
 
         // CC box-box
         for(int k = -this->kMax; k <= this->kMax; k++){
+            const double shift = k * 2.0 * this->geo->_d[2], w = this->weight[k + this->kMax];
+
             #pragma omp parallel for schedule(guided, 200) reduction(+:CC) private(temp) if(particles.tot >= 1000)
             for(unsigned int i = 0; i < particles.tot; i++){
+                Eigen::Vector3d a = particles.pos(i);
+                if(!this->reaches(a[2], shift, this->geo->_dh[2])) continue;
+
                 for(unsigned int j = 0; j < particles.tot; j++){
                     if(k == 0 && i == j) continue;
 
                     double tmpE = 0.0;
-                    temp = particles[j]->pos;
-                    temp[2] += k * 2.0 * this->geo->_d[2]; 
+                    temp = particles.pos(j);
+                    temp[2] += shift; 
 
-                    tmpE = i2i(particles[i]->q, particles[j]->q, this->geo->distance(particles[i]->pos, temp)) * std::pow(this->eps, 2.0 * std::fabs(k));
+                    tmpE = i2i(particles.qs[i], particles.qs[j], this->geometry()->distance(a, temp)) * w;
 
                     CC += tmpE;
                 } 
@@ -607,13 +1041,18 @@ class MIHalfwald : public EnergyBase{
 
         //CC'
         for(int k = -this->kMax; k <= this->kMax; k++){
+            const double shift = k * 2.0 * this->geo->_d[2], w = this->weightImg[k + this->kMax];
+
             #pragma omp parallel for schedule(dynamic, 200) reduction(+:CpC) private(temp) if(particles.tot >= 1000)
             for(unsigned int i = 0; i < particles.tot; i++){
+                Eigen::Vector3d a = particles.pos(i);
+                if(!this->reaches(a[2], shift, this->geo->_d[2])) continue;
+
                 for(unsigned int j = 0; j < particles.tot; j++){
                     double tmpE = 0.0;
-                    temp = particles[j]->pos;
-                    temp[2] = math::sgn(temp[2]) * this->geo->_d[2] - temp[2] + k * 2.0 * this->geo->_d[2];
-                    tmpE = i2i(particles[i]->q, -particles[j]->q, this->geo->distance(particles[i]->pos, temp)) * std::pow(this->eps, 2.0 * std::fabs(k) + 1.0);
+                    temp = particles.pos(j);
+                    temp[2] = math::sgn(temp[2]) * this->geo->_d[2] - temp[2] + shift;
+                    tmpE = i2i(particles.qs[i], -particles.qs[j], this->geometry()->distance(a, temp)) * w;
 
                     CpC += tmpE;
                 } 
@@ -630,9 +1069,9 @@ class MIHalfwald : public EnergyBase{
             e += i2all(particles[s], particles);
         }
 
-        for(int i = 0; i < p.size(); i++){
-           for(int j = i + 1; j < p.size(); j++){
-               e -= i2i(particles[p[i]]->q, particles[p[j]]->q, this->geo->distance(particles[p[i]]->pos, particles[p[j]]->pos));
+        for(std::size_t i = 0; i < p.size(); i++){
+           for(std::size_t j = i + 1; j < p.size(); j++){
+               e -= i2i(particles[p[i]]->q, particles[p[j]]->q, this->geometry()->distance(particles[p[i]]->pos, particles[p[j]]->pos));
            }
         }
 
@@ -646,9 +1085,9 @@ class MIHalfwald : public EnergyBase{
             e += i2all(particles[s], particles);
         }
 
-        for(int i = 0; i < p.size(); i++){
-           for(int j = i + 1; j < p.size(); j++){
-               e -= i2i(particles[p[i]]->q, particles[p[j]]->q, this->geo->distance(particles[p[i]]->pos, particles[p[j]]->pos));
+        for(std::size_t i = 0; i < p.size(); i++){
+           for(std::size_t j = i + 1; j < p.size(); j++){
+               e -= i2i(particles[p[i]]->q, particles[p[j]]->q, this->geometry()->distance(particles[p[i]]->pos, particles[p[j]]->pos));
            }
         }
 
@@ -661,6 +1100,8 @@ class MIHalfwald : public EnergyBase{
         UNUSED(_new);
     }
 
+    void update(const std::vector< std::shared_ptr<Particle> >& _old, const std::vector< std::shared_ptr<Particle> >& _new){}
+
     void update(double x, double y, double z){}
 
     void initialize(Particles& particles){
@@ -701,7 +1142,7 @@ class Ellipsoid : public EnergyBase{
         return e * constants::lB;
     }
 
-    inline double i2all(std::shared_ptr<Particle> p, Particles& particles){
+    inline double i2all(const std::shared_ptr<Particle>& p, Particles& particles){
         double e = 0.0;
 
         //#pragma omp parallel for reduction(+:e) schedule(dynamic, 100) if(particles.tot >= 500)
@@ -744,6 +1185,191 @@ class Ellipsoid : public EnergyBase{
     }
 
     void update(std::vector< std::shared_ptr<Particle> >&& _old, std::vector< std::shared_ptr<Particle> >&& _new){}
+    void update(const std::vector< std::shared_ptr<Particle> >& _old, const std::vector< std::shared_ptr<Particle> >& _new){}
     void update(double x, double y, double z){}
     void initialize(Particles& particles){}
 };
+
+
+
+
+
+/*
+    Terms of one electrostatic model composed at compile time, the real space term first and then the reciprocal
+    and self terms. The terms are held by value and called directly, so State sees a single energy and no call
+    inside goes through the vtable. update() and rescale() are only applied to a term right before its energy is
+    taken, a trial that evaluate() stops early leaves the remaining terms untouched and only the evaluated
+    ones are reverted.
+*/
+template <typename... Terms>
+class Pipeline final : public EnergyBase{
+
+    private:
+
+    static constexpr std::size_t N = sizeof...(Terms);
+
+    std::tuple<Terms...> terms;
+    double olds[N], bounds[N];                                      //old_energy and min_change of each term for the trial
+    unsigned int evaluated = 0;                                     //Terms that have seen the trial
+    std::vector< std::shared_ptr<Particle> > trialOld, trialNew;    //Pending update handed over as rvalues
+    const std::vector< std::shared_ptr<Particle> > *pOld, *pNew;    //Pending update, the vectors above or the caller's
+    double box[3];                                                  //Pending rescale
+    bool pending = false, volumeTrial = false;
+
+    template <typename F>
+    void each(F&& f){
+        std::apply([&](auto&... t){ (f(t), ...); }, this->terms);
+    }
+
+    //Brings term I to the trial and adds its energy to E, false if the change of the terms so far
+    //and the bounds of the rest exceed limit
+    template <std::size_t I>
+    bool step(double& E, std::vector< unsigned int >& p, Particles& particles, double limit){
+        auto& t = std::get<I>(this->terms);
+        if(this->pending){
+            if(this->volumeTrial){
+                t.rescale(this->box[0], this->box[1], this->box[2], particles);
+            }
+            else{
+                t.update(*this->pOld, *this->pNew);
+            }
+        }
+        this->evaluated = I + 1;
+        E += t(p, particles);
+
+        if(I + 1 < N && limit < std::numeric_limits<double>::infinity()){
+            double change = E;
+            for(std::size_t k = 0; k < N; k++){
+                change += (k <= I) ? -this->olds[k] : this->bounds[k];
+            }
+            return change <= limit;
+        }
+        return true;
+    }
+
+    template <std::size_t... I>
+    double run(std::vector< unsigned int >& p, Particles& particles, double limit, std::index_sequence<I...>){
+        double E = 0.0;
+        bool complete = (this->step<I>(E, p, particles, limit) && ...);
+        this->pending = false;
+        return complete ? E : std::numeric_limits<double>::infinity();
+    }
+
+    public:
+
+    Pipeline(Terms&&... terms) : terms(std::move(terms)...){
+        this->geo = std::get<0>(this->terms).geo;
+        this->cutoff = 0.0;
+        this->each([this](auto& t){
+            if(t.cells != nullptr){
+                this->cells = t.cells;
+                this->cutoff = std::max(this->cutoff, t.get_cutoff());
+            }
+        });
+    }
+
+    double all2all(Particles& particles){
+        double E = 0.0;
+        this->each([&](auto& t){ E += t.all2all(particles); });
+        return E;
+    }
+
+    double i2all(const std::shared_ptr<Particle>& p, Particles& particles){
+        double E = 0.0;
+        this->each([&](auto& t){ E += t.i2all(p, particles); });
+        return E;
+    }
+
+    double operator()(std::vector< unsigned int >&& p, Particles& particles){
+        return this->evaluate(p, particles, std::numeric_limits<double>::infinity());
+    }
+
+    double operator()(std::vector< unsigned int >& p, Particles& particles){
+        return this->evaluate(p, particles, std::numeric_limits<double>::infinity());
+    }
+
+    double evaluate(std::vector< unsigned int >& p, Particles& particles, double limit){
+        return this->run(p, particles, limit, std::index_sequence_for<Terms...>());
+    }
+
+    double old_energy(std::vector< unsigned int >& p, Particles& particles){
+        double E = 0.0;
+        std::size_t k = 0;
+        this->each([&](auto& t){
+            this->olds[k] = t.old_energy(p, particles);
+            E += this->olds[k++];
+        });
+        return E;
+    }
+
+    double min_change(std::vector< unsigned int >& p, Particles& particles){
+        double E = 0.0;
+        std::size_t k = 0;
+        this->each([&](auto& t){
+            this->bounds[k] = t.min_change(p, particles);
+            E += this->bounds[k++];
+        });
+        return E;
+    }
+
+    void update(std::vector< std::shared_ptr<Particle> >&& _old, std::vector< std::shared_ptr<Particle> >&& _new){
+        this->trialOld = std::move(_old);
+        this->trialNew = std::move(_new);
+        this->update(this->trialOld, this->trialNew);
+    }
+
+    //The caller keeps _old and _new unchanged until the trial is evaluated
+    void update(const std::vector< std::shared_ptr<Particle> >& _old, const std::vector< std::shared_ptr<Particle> >& _new){
+        this->pOld = &_old;
+        this->pNew = &_new;
+        this->pending = true;
+        this->volumeTrial = false;
+    }
+
+    void rescale(double x, double y, double z, Particles& particles){
+        this->box[0] = x;
+        this->box[1] = y;
+        this->box[2] = z;
+        this->pending = true;
+        this->volumeTrial = true;
+    }
+
+    void update(double x, double y, double z){
+        this->each([&](auto& t){ t.update(x, y, z); });
+    }
+
+    void initialize(Particles& particles){
+        this->each([&](auto& t){ t.initialize(particles); });
+    }
+
+    void set_cache(bool useCache){
+        this->each([&](auto& t){ t.set_cache(useCache); });
+    }
+
+    void save(std::vector< std::shared_ptr<Particle> >& old, Particles& particles, std::vector< unsigned int >& moved){
+        this->each([&](auto& t){ t.save(old, particles, moved); });
+        this->evaluated = 0;
+    }
+
+    double refine(Particles& particles){
+        double E = 0.0;
+        this->each([&](auto& t){ E += t.refine(particles); });
+        return E;
+    }
+
+    void revert(){
+        std::size_t k = 0;
+        this->each([&](auto& t){
+            if(k++ < this->evaluated) t.revert();
+        });
+        this->evaluated = 0;
+    }
+
+    void revert_volume(double x, double y, double z, Particles& particles){
+        std::size_t k = 0;
+        this->each([&](auto& t){
+            if(k++ < this->evaluated) t.revert_volume(x, y, z, particles);
+        });
+        this->evaluated = 0;
+    }
+};
@@ -0,0 +1,660 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <unordered_map>
+#include <unordered_set>
+#include <limits>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include "particles.h"
+#include "energy.h"
+
+/*
+    Coulomb energy of a non-periodic system from an adaptive octree over the box (fast multipole method).
+    A cell is split while it holds more than cap charges, so dense cores get small leaves and dilute
+    shells large ones. Two cells interact through Cartesian multipole expansions, truncated at
+    |m| + |n| <= order for the moments m and n of the two cells, once the gap between them is at least
+    the width of the larger one. Otherwise two leaves interact directly and else the larger cell, or
+    both if they are equally large, is split. Every pair is handled exactly once, so the energy is a
+    symmetric function of the configuration and the per particle energies of a move are consistent
+    with all2all.
+
+    The split cells are kept while the charges move, a trial adds and removes the moved charges from
+    the moments along their paths in the tree, so a move costs O(log N) instead of O(N). Once a leaf
+    holds more than 2 cap charges or a split cell less than cap / 2 after an accepted trial, refine()
+    splits the tree anew for the current configuration. cap is set from a cost model on the first
+    configuration and on every refine().
+
+    Periodic slabs are not covered, they need lattice sums along x and y and are a separate request.
+*/
+class FMMEnergy : public EnergyBase{
+    private:
+
+    struct Source{
+        unsigned int index;
+        Eigen::Vector3d pos;
+        double q;
+    };
+
+    struct Cell{
+        std::vector<double> M;          //Moments q x^m / m! about the center
+        int count = 0;
+        bool split = false;             //Split cells stay in the tree when they are empty
+        std::vector<Source> sources;    //Leaves only
+    };
+
+    struct Term{
+        int m, n, k;                    //k = m + n
+        double sign;                    //(-1)^|m|
+    };
+
+    typedef std::array<int, 3> Coords;
+
+    //Buffers of an energy evaluation, one per thread in all2all
+    struct Scratch{
+        std::vector<double> mu, mu2, dR;
+        std::vector<Coords> path, path2;    //Cells from the root to the leaf of a charge
+    };
+
+    static const int maxLevel = 15;
+
+    int order, nCoef, depth = 0;
+    unsigned int cap = 0;                               //Charges a cell may hold before it is split
+    bool stale = false;                                 //Occupancy has drifted too far from the split cells
+    double box[3];
+    std::unordered_map<uint64_t, Cell> cells;           //Split and occupied cells
+    std::vector<Coords> multi;                          //Multi-indices with |k| <= order, by degree
+    std::vector<int> flat;                              //Flat index of a multi-index
+    std::vector<double> factorial;                      //k! of the multi-indices
+    std::vector<Term> terms;
+    std::vector< std::vector<double> > D;               //Per level, derivatives of 1/R for the offsets in [-3, 3]^3
+    std::vector<Source> trialOld, trialNew;
+    Scratch work;
+
+    inline int flat_index(int a, int b, int c){
+        return this->flat[(a * (this->order + 1) + b) * (this->order + 1) + c];
+    }
+
+    inline uint64_t key(int l, const Coords& c){
+        return ((uint64_t) l << 60) | ((uint64_t) c[0] << 40) | ((uint64_t) c[1] << 20) | (uint64_t) c[2];
+    }
+
+    //Cell on the deepest level that holds pos
+    inline Coords finest(const Eigen::Vector3d& pos){
+        Coords c;
+        int n = 1 << maxLevel;
+        for(int d = 0; d < 3; d++){
+            c[d] = std::min(n - 1, std::max(0, (int) std::floor((pos[d] + this->box[d] / 2.0) / this->box[d] * n)));
+        }
+        return c;
+    }
+
+    inline Eigen::Vector3d center(const Coords& c, int l){
+        Eigen::Vector3d r;
+        for(int d = 0; d < 3; d++){
+            r[d] = -this->box[d] / 2.0 + (c[d] + 0.5) * this->box[d] / (1 << l);
+        }
+        return r;
+    }
+
+    inline int offset_index(int x, int y, int z){
+        return ((x + 3) * 7 + (y + 3)) * 7 + (z + 3);
+    }
+
+    inline bool is_split(int l, const Coords& c){
+        auto it = this->cells.find(this->key(l, c));
+        return it != this->cells.end() && it->second.split;
+    }
+
+    //Fills path with the cells from the root to the leaf that holds pos, returns the level of the leaf
+    int descend(const Eigen::Vector3d& pos, std::vector<Coords>& path){
+        Coords f = this->finest(pos);
+        path.clear();
+        for(int l = 0; l <= maxLevel; l++){
+            int s = maxLevel - l;
+            path.push_back({f[0] >> s, f[1] >> s, f[2] >> s});
+            if(!this->is_split(l, path.back())) return l;
+        }
+        return maxLevel;
+    }
+
+    //The gap between the cells is at least the width of the larger one
+    inline bool separated(int la, const Coords& a, int lb, const Coords& b){
+        int f = 1 << std::abs(la - lb);
+        int wa = (la <= lb) ? f : 1, wb = (lb <= la) ? f : 1;
+        int gap = 0;
+        for(int d = 0; d < 3; d++){
+            int loA = a[d] * wa, loB = b[d] * wb;
+            gap = std::max(gap, std::max(loB - loA - wa, loA - loB - wb));
+        }
+        return gap >= f;
+    }
+
+    //Derivatives of 1/R between the centers of the cells, tabulated for neighbours on the same level
+    const double* derivatives(int la, const Coords& a, int lb, const Coords& b, Scratch& w){
+        int x = b[0] - a[0], y = b[1] - a[1], z = b[2] - a[2];
+        if(la == lb && la >= 2 && std::max(std::abs(x), std::max(std::abs(y), std::abs(z))) <= 3){
+            return &this->D[la][this->offset_index(x, y, z) * this->nCoef];
+        }
+        this->derivatives(this->center(b, lb) - this->center(a, la), w.dR.data());
+        return w.dR.data();
+    }
+
+    //q x^m / m! for all m
+    inline void moments(const Eigen::Vector3d& x, double q, double* out){
+        double p[3][16];
+        for(int d = 0; d < 3; d++){
+            p[d][0] = 1.0;
+            for(int a = 1; a <= this->order; a++){
+                p[d][a] = p[d][a - 1] * x[d] / a;
+            }
+        }
+        for(int i = 0; i < this->nCoef; i++){
+            out[i] = q * p[0][this->multi[i][0]] * p[1][this->multi[i][1]] * p[2][this->multi[i][2]];
+        }
+    }
+
+    //d^k (1/R) from the recurrence of the Taylor coefficients t_k = d^k (1/R) / k!,
+    //|k| R^2 t_k = -(2|k| - 1) sum_i R_i t_{k - e_i} - (|k| - 1) sum_i t_{k - 2e_i}
+    void derivatives(const Eigen::Vector3d& R, double* out){
+        double r2 = R.squaredNorm();
+        out[0] = 1.0 / std::sqrt(r2);
+        for(int i = 1; i < this->nCoef; i++){
+            const Coords& k = this->multi[i];
+            int s = k[0] + k[1] + k[2];
+            double t = 0.0;
+            for(int d = 0; d < 3; d++){
+                Coords km = k;
+                if(k[d] >= 1){
+                    km[d] -= 1;
+                    t -= (2 * s - 1) * R[d] * out[this->flat_index(km[0], km[1], km[2])];
+                }
+                if(k[d] >= 2){
+                    km[d] -= 1;
+                    t -= (s - 1) * out[this->flat_index(km[0], km[1], km[2])];
+                }
+            }
+            out[i] = t / (s * r2);
+        }
+        for(int i = 0; i < this->nCoef; i++){
+            out[i] *= this->factorial[i];
+        }
+    }
+
+    void setup_tables(){
+        this->multi.clear();
+        this->flat.assign((this->order + 1) * (this->order + 1) * (this->order + 1), -1);
+        for(int s = 0; s <= this->order; s++){
+            for(int a = s; a >= 0; a--){
+                for(int b = s - a; b >= 0; b--){
+                    this->flat[(a * (this->order + 1) + b) * (this->order + 1) + s - a - b] = this->multi.size();
+                    this->multi.push_back({a, b, s - a - b});
+                }
+            }
+        }
+        this->nCoef = this->multi.size();
+
+        this->factorial.resize(this->nCoef);
+        for(int i = 0; i < this->nCoef; i++){
+            this->factorial[i] = std::tgamma(this->multi[i][0] + 1) * std::tgamma(this->multi[i][1] + 1) * std::tgamma(this->multi[i][2] + 1);
+        }
+
+        this->terms.clear();
+        for(int m = 0; m < this->nCoef; m++){
+            for(int n = 0; n < this->nCoef; n++){
+                const Coords& a = this->multi[m];
+                const Coords& b = this->multi[n];
+                int sm = a[0] + a[1] + a[2];
+                if(sm + b[0] + b[1] + b[2] > this->order) continue;
+                this->terms.push_back({m, n, this->flat_index(a[0] + b[0], a[1] + b[1], a[2] + b[2]), (sm % 2) ? -1.0 : 1.0});
+            }
+        }
+        this->scratch(this->work);
+    }
+
+    void scratch(Scratch& w){
+        w.mu.resize(this->nCoef);
+        w.mu2.resize(this->nCoef);
+        w.dR.resize(this->nCoef);
+        w.path.reserve(maxLevel + 1);
+        w.path2.reserve(maxLevel + 1);
+    }
+
+    //Derivative tables of the well separated neighbours on every level
+    void setup_derivatives(){
+        this->D.assign(this->depth + 1, std::vector<double>());
+        for(int l = 2; l <= this->depth; l++){
+            this->D[l].assign(343 * this->nCoef, 0.0);
+            for(int x = -3; x <= 3; x++){
+                for(int y = -3; y <= 3; y++){
+                    for(int z = -3; z <= 3; z++){
+                        if(std::max(std::abs(x), std::max(std::abs(y), std::abs(z))) < 2) continue;
+                        Eigen::Vector3d R(x * this->box[0] / (1 << l), y * this->box[1] / (1 << l), z * this->box[2] / (1 << l));
+                        this->derivatives(R, &this->D[l][this->offset_index(x, y, z) * this->nCoef]);
+                    }
+                }
+            }
+        }
+    }
+
+    //Splits the cell l, c holding the charges idx[b, e), sorted by Morton order, while it holds more than cap
+    //of them. The split cells go to splits if given, seen and levels add up n^2 and n * level of the leaves
+    void partition(const std::vector<uint64_t>& morton, const std::vector<unsigned int>& idx, unsigned int b, unsigned int e,
+                   int l, const Coords& c, unsigned int cap, std::unordered_set<uint64_t>* splits, double& seen, double& levels){
+        double n = e - b;
+        if(e - b <= cap || l == maxLevel){
+            seen += n * n;
+            levels += n * l;
+            return;
+        }
+        if(splits != nullptr) splits->insert(this->key(l, c));
+
+        int s = 3 * (maxLevel - l - 1);
+        for(int o = 0; o < 8; o++){
+            unsigned int end = std::partition_point(idx.begin() + b, idx.begin() + e, [&](unsigned int i){
+                                    return (int) ((morton[i] >> s) & 7) <= o; }) - idx.begin();
+            if(end > b){
+                this->partition(morton, idx, b, end, l + 1, {2 * c[0] + (o >> 2), 2 * c[1] + ((o >> 1) & 1), 2 * c[2] + (o & 1)},
+                                cap, splits, seen, levels);
+            }
+            b = end;
+        }
+    }
+
+    //Builds the tree for the particles. With adapt the cells are split anew and cap is set from the cost
+    //of a particle energy, the near field pairs (about four expansion terms each) against the interaction
+    //lists of the levels. Otherwise the split cells are kept
+    void build(Particles& particles, bool adapt){
+        if(adapt){
+            std::vector<uint64_t> morton(particles.tot);
+            for(unsigned int i = 0; i < particles.tot; i++){
+                Coords f = this->finest(particles.pos(i));
+                uint64_t m = 0;
+                for(int bit = maxLevel - 1; bit >= 0; bit--){
+                    m = (m << 3) | (uint64_t) (((f[0] >> bit) & 1) << 2 | ((f[1] >> bit) & 1) << 1 | ((f[2] >> bit) & 1));
+                }
+                morton[i] = m;
+            }
+            std::vector<unsigned int> idx(particles.tot);
+            std::iota(idx.begin(), idx.end(), 0);
+            std::sort(idx.begin(), idx.end(), [&morton](unsigned int i, unsigned int j){ return morton[i] < morton[j]; });
+
+            double best = std::numeric_limits<double>::infinity();
+            for(unsigned int c = 4; c <= 512; c *= 2){
+                double seen = 0.0, levels = 0.0;
+                this->partition(morton, idx, 0, particles.tot, 0, {0, 0, 0}, c, nullptr, seen, levels);
+                double n = std::max(particles.tot, 1u);
+                double cost = 4.0 * 27.0 * seen / n + std::max(levels / n - 1.0, 0.0) * 189.0 * this->terms.size();
+                if(cost < best){
+                    best = cost;
+                    this->cap = c;
+                }
+            }
+
+            std::unordered_set<uint64_t> splits;
+            double seen = 0.0, levels = 0.0;
+            this->partition(morton, idx, 0, particles.tot, 0, {0, 0, 0}, this->cap, &splits, seen, levels);
+
+            this->cells.clear();
+            for(auto k : splits){
+                this->cells[k].split = true;
+            }
+        }
+        else{
+            for(auto it = this->cells.begin(); it != this->cells.end();){
+                if(it->second.split){
+                    it->second.count = 0;
+                    it++;
+                }
+                else{
+                    it = this->cells.erase(it);
+                }
+            }
+        }
+
+        for(unsigned int i = 0; i < particles.tot; i++){
+            int l = this->descend(particles.pos(i), this->work.path);
+            Cell& leaf = this->cells[this->key(l, this->work.path[l])];
+            leaf.sources.push_back(this->source(particles, i));
+            leaf.count++;
+        }
+
+        this->depth = 0;
+        for(auto& it : this->cells){
+            it.second.M.assign(this->nCoef, 0.0);
+            this->depth = std::max(this->depth, (int) (it.first >> 60) + it.second.split);
+        }
+        this->setup_derivatives();
+
+        //Cells by level, leaf moments from their charges
+        std::vector< std::vector< std::pair<Coords, Cell*> > > byLevel(this->depth + 1);
+        for(auto& it : this->cells){
+            Coords c = {(int) ((it.first >> 40) & 0xFFFFF), (int) ((it.first >> 20) & 0xFFFFF), (int) (it.first & 0xFFFFF)};
+            byLevel[it.first >> 60].push_back({c, &it.second});
+        }
+
+        for(int l = 0; l <= this->depth; l++){
+            #pragma omp parallel for schedule(dynamic, 16)
+            for(unsigned int i = 0; i < byLevel[l].size(); i++){
+                Cell& cell = *byLevel[l][i].second;
+                if(cell.split) continue;
+                std::vector<double> mu(this->nCoef);
+                Eigen::Vector3d cc = this->center(byLevel[l][i].first, l);
+                for(auto& s : cell.sources){
+                    this->moments(s.pos - cc, s.q, mu.data());
+                    for(int k = 0; k < this->nCoef; k++){
+                        cell.M[k] += mu[k];
+                    }
+                }
+            }
+        }
+
+        //Upward pass, moments of the children shifted to the parent center
+        for(int l = this->depth; l >= 1; l--){
+            for(auto& ch : byLevel[l]){
+                if(ch.second->count == 0) continue;
+                Coords p = {ch.first[0] >> 1, ch.first[1] >> 1, ch.first[2] >> 1};
+                Cell& cell = this->cells[this->key(l - 1, p)];
+
+                //(x + d)^m / m! = sum_{n <= m} x^n / n! d^{m - n} / (m - n)!
+                this->moments(this->center(ch.first, l) - this->center(p, l - 1), 1.0, this->work.mu.data());
+                for(int m = 0; m < this->nCoef; m++){
+                    const Coords& km = this->multi[m];
+                    for(int n = 0; n <= m; n++){
+                        const Coords& kn = this->multi[n];
+                        if(kn[0] > km[0] || kn[1] > km[1] || kn[2] > km[2]) continue;
+                        cell.M[m] += ch.second->M[n] * this->work.mu[this->flat_index(km[0] - kn[0], km[1] - kn[1], km[2] - kn[2])];
+                    }
+                }
+                cell.count += ch.second->count;
+            }
+        }
+        this->stale = false;
+    }
+
+    //Adds (sign = 1) or removes (sign = -1) a charge
+    void insert(const Source& s, int sign){
+        int leaf = this->descend(s.pos, this->work.path);
+
+        for(int l = 0; l <= leaf; l++){
+            const Coords& c = this->work.path[l];
+            uint64_t k = this->key(l, c);
+            Cell& cell = this->cells[k];
+            if(cell.M.empty()) cell.M.assign(this->nCoef, 0.0);
+
+            this->moments(s.pos - this->center(c, l), sign * s.q, this->work.mu.data());
+            for(int i = 0; i < this->nCoef; i++){
+                cell.M[i] += this->work.mu[i];
+            }
+            cell.count += sign;
+
+            if(l == leaf){
+                if(sign > 0){
+                    cell.sources.push_back(s);
+                }
+                else{
+                    cell.sources.erase(std::find_if(cell.sources.begin(), cell.sources.end(), [&s](const Source& o){ return o.index == s.index; }));
+                }
+                if(cell.count == 0){
+                    this->cells.erase(k);
+                }
+            }
+        }
+    }
+
+    inline double far(const double* Dk, const double* m1, const double* m2){
+        double e = 0.0;
+        for(auto& t : this->terms){
+            e += t.sign * Dk[t.k] * m1[t.m] * m2[t.n];
+        }
+        return e;
+    }
+
+    //Energy of the charge s in the cell w.path[a] with the charges in the cell l, c
+    double interact(const Source& s, int a, int l, const Coords& c, Scratch& w){
+        auto it = this->cells.find(this->key(l, c));
+        if(it == this->cells.end() || it->second.count == 0) return 0.0;
+        const Cell& B = it->second;
+        const Coords& A = w.path[a];
+
+        if(this->separated(a, A, l, c)){
+            this->moments(s.pos - this->center(A, a), s.q, w.mu.data());
+            return this->far(this->derivatives(a, A, l, c, w), w.mu.data(), B.M.data());
+        }
+
+        bool aLeaf = a + 1 == (int) w.path.size();
+        if(aLeaf && !B.split){
+            double e = 0.0;
+            for(auto& o : B.sources){
+                if(o.index != s.index){
+                    e += s.q * o.q / (s.pos - o.pos).norm();
+                }
+            }
+            return e;
+        }
+
+        //The larger cell is split, both if they are equally large
+        bool splitA = !aLeaf && (!B.split || a <= l);
+        bool splitB = B.split && (aLeaf || l <= a);
+        if(!splitB){
+            return this->interact(s, a + 1, l, c, w);
+        }
+
+        double e = 0.0;
+        for(int o = 0; o < 8; o++){
+            e += this->interact(s, splitA ? a + 1 : a, l + 1, {2 * c[0] + (o >> 2), 2 * c[1] + ((o >> 1) & 1), 2 * c[2] + (o & 1)}, w);
+        }
+        return e;
+    }
+
+    //Energy of a charge with every other charge in the tree
+    double energy(const Source& s, Scratch& w){
+        int leaf = this->descend(s.pos, w.path);
+        double e = 0.0;
+
+        //Each cell on the path with its siblings
+        for(int l = 1; l <= leaf; l++){
+            const Coords& p = w.path[l - 1];
+            for(int o = 0; o < 8; o++){
+                Coords c = {2 * p[0] + (o >> 2), 2 * p[1] + ((o >> 1) & 1), 2 * p[2] + (o & 1)};
+                if(c != w.path[l]){
+                    e += this->interact(s, l, l, c, w);
+                }
+            }
+        }
+
+        //Within the leaf
+        auto it = this->cells.find(this->key(leaf, w.path[leaf]));
+        if(it != this->cells.end()){
+            for(auto& o : it->second.sources){
+                if(o.index != s.index){
+                    e += s.q * o.q / (s.pos - o.pos).norm();
+                }
+            }
+        }
+        return e;
+    }
+
+    //The term of a single pair in the energy, direct or between the cells where interact() separates them
+    double pair(const Source& s1, const Source& s2, Scratch& w){
+        int l1 = this->descend(s1.pos, w.path), l2 = this->descend(s2.pos, w.path2);
+        int a = 0, b = 0;
+        while(a < l1 && b < l2 && w.path[a + 1] == w.path2[b + 1]){
+            a++;
+            b++;
+        }
+        if(a == l1 && b == l2) return s1.q * s2.q / (s1.pos - s2.pos).norm();
+        a++;
+        b++;
+
+        while(true){
+            if(this->separated(a, w.path[a], b, w.path2[b])){
+                this->moments(s1.pos - this->center(w.path[a], a), s1.q, w.mu.data());
+                this->moments(s2.pos - this->center(w.path2[b], b), s2.q, w.mu2.data());
+                return this->far(this->derivatives(a, w.path[a], b, w.path2[b], w), w.mu.data(), w.mu2.data());
+            }
+
+            bool aLeaf = a == l1, bLeaf = b == l2;
+            if(aLeaf && bLeaf) return s1.q * s2.q / (s1.pos - s2.pos).norm();
+
+            bool splitA = !aLeaf && (bLeaf || a <= b);
+            bool splitB = !bLeaf && (aLeaf || b <= a);
+            a += splitA;
+            b += splitB;
+        }
+    }
+
+    inline Source source(Particles& particles, unsigned int i){
+        return {i, particles.pos(i), particles.qs[i]};
+    }
+
+    //The source at pos numbered from is renumbered to
+    void relabel(const Eigen::Vector3d& pos, unsigned int from, unsigned int to){
+        int l = this->descend(pos, this->work.path);
+        auto it = this->cells.find(this->key(l, this->work.path[l]));
+        if(it == this->cells.end()) return;
+        for(auto& o : it->second.sources){
+            if(o.index == from) o.index = to;
+        }
+    }
+
+    //Marks the tree stale once a leaf on the path of pos is too full or a split cell too empty
+    void check(const Eigen::Vector3d& pos){
+        int leaf = this->descend(pos, this->work.path);
+        for(int l = 0; l <= leaf; l++){
+            auto it = this->cells.find(this->key(l, this->work.path[l]));
+            int count = (it == this->cells.end()) ? 0 : it->second.count;
+            if((l < leaf && 2 * count < (int) this->cap) || (l == leaf && l < maxLevel && count > 2 * (int) this->cap)){
+                this->stale = true;
+            }
+        }
+    }
+
+    public:
+
+    FMMEnergy(double x, double y, double z, int order){
+        if(order < 0 || order > 15){
+            printf("FMM expansion order must be between 0 and 15!\n");
+            exit(1);
+        }
+        this->order = order;
+        this->update(x, y, z);
+        this->setup_tables();
+        printf("\tExpansion order: %i, %lu terms per cell pair\n", this->order, this->terms.size());
+    }
+
+    void initialize(Particles& particles){
+        bool first = this->cap == 0;
+        this->trialOld.clear();
+        this->trialNew.clear();
+        this->build(particles, first);
+        if(first){
+            printf("\tLeaf capacity: %u, octree depth: %i\n", this->cap, this->depth);
+        }
+    }
+
+    //Splits the tree anew once the occupancy has drifted, the energy changes with the cells
+    double refine(Particles& particles){
+        if(!this->stale) return 0.0;
+        double before = this->all2all(particles);
+        this->build(particles, true);
+        return this->all2all(particles) - before;
+    }
+
+    double all2all(Particles& particles){
+        std::vector<const Source*> all;
+        for(auto& it : this->cells){
+            for(auto& s : it.second.sources){
+                all.push_back(&s);
+            }
+        }
+
+        double e = 0.0;
+        #pragma omp parallel reduction(+:e)
+        {
+            Scratch w;
+            this->scratch(w);
+            #pragma omp for schedule(dynamic, 16)
+            for(unsigned int i = 0; i < all.size(); i++){
+                e += this->energy(*all[i], w);
+            }
+        }
+        return 0.5 * e * constants::lB;
+    }
+
+    double i2all(const std::shared_ptr<Particle>& p, Particles& particles){
+        return this->energy({p->index, p->pos, p->q}, this->work) * constants::lB;
+    }
+
+    double operator()(std::vector< unsigned int >&& p, Particles& particles){
+        return (*this)(p, particles);
+    }
+
+    double operator()(std::vector< unsigned int >& p, Particles& particles){
+        double e = 0.0;
+        for(unsigned int i = 0; i < p.size(); i++){
+            e += this->energy(this->source(particles, p[i]), this->work);
+            for(unsigned int j = i + 1; j < p.size(); j++){
+                e -= this->pair(this->source(particles, p[i]), this->source(particles, p[j]), this->work);
+            }
+        }
+        return e * constants::lB;
+    }
+
+    //The trial is applied to the tree, revert() takes it back
+    void update(std::vector< std::shared_ptr<Particle> >&& _old, std::vector< std::shared_ptr<Particle> >&& _new){
+        this->update(_old, _new);
+    }
+
+    void update(const std::vector< std::shared_ptr<Particle> >& _old, const std::vector< std::shared_ptr<Particle> >& _new){
+        this->trialOld.clear();
+        this->trialNew.clear();
+        for(const auto& o : _old){
+            this->trialOld.push_back({o->index, o->pos, o->q});
+            this->insert(this->trialOld.back(), -1);
+        }
+        for(const auto& n : _new){
+            this->trialNew.push_back({n->index, n->pos, n->q});
+            this->insert(this->trialNew.back(), 1);
+        }
+    }
+
+    void update(double x, double y, double z){
+        this->box[0] = x;
+        this->box[1] = y;
+        this->box[2] = z;
+    }
+
+    void save(std::vector< std::shared_ptr<Particle> >& old, Particles& particles, std::vector< unsigned int >& moved){
+        for(auto& s : this->trialOld){
+            this->check(s.pos);
+        }
+        for(auto& s : this->trialNew){
+            this->check(s.pos);
+        }
+        this->trialOld.clear();
+        this->trialNew.clear();
+
+        //A removal moves the last particle into the slot of the removed one
+        unsigned int last = particles.tot + old.size() - moved.size();
+        for(std::size_t k = moved.size(); k < old.size(); k++){
+            last--;
+            if(old[k]->index != last){
+                this->relabel(particles.pos(old[k]->index), last, old[k]->index);
+            }
+        }
+    }
+
+    void revert(){
+        for(auto& s : this->trialNew){
+            this->insert(s, -1);
+        }
+        for(auto& s : this->trialOld){
+            this->insert(s, 1);
+        }
+        this->trialOld.clear();
+        this->trialNew.clear();
+    }
+};
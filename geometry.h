@@ -1,6 +1,9 @@
 #pragma once
 
 #include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
 #include <Eigen/Dense>
 #include "particle.h"
 
@@ -14,21 +17,155 @@ class Geometry{
     std::vector<double> dh;  //half dimensions
     std::vector<double> _dh;
     double volume;
+    bool periodic[3] = {false, false, false};   //Minimum image in x, y, z
 
     virtual void resize() = 0;
     virtual bool is_inside(std::shared_ptr<Particle>& p) = 0;
-    virtual void pbc(std::shared_ptr<Particle>&& p) = 0;
+    virtual void pbc(const std::shared_ptr<Particle>& p) = 0;
     virtual double distance(Eigen::Vector3d& a, Eigen::Vector3d& b) = 0;
     virtual Eigen::Vector3d displacement(Eigen::Vector3d& a, Eigen::Vector3d& b) = 0;
     virtual Eigen::Vector3d mirror(Eigen::Vector3d pos) = 0;
     virtual Eigen::Vector3d random_pos(double rf) = 0;
     virtual ~Geometry(){};
 
+    //Squared minimum image distances from p to the points first + k (idx == nullptr) or idx[k], k < n, of a
+    //coordinate block. Periodic dimensions are wrapped by rounding to the nearest image, without branches.
+    //The points within sqrt(cutoff2), skip excluded, are written compacted to hits and r2, the count is returned.
+    //The cuboids hide these with versions that fix the periodic dimensions at compile time
+    unsigned int distances2(const double* x, const double* y, const double* z, const unsigned int* idx, unsigned int first,
+                            unsigned int n, const Eigen::Vector3d& p, double cutoff2, unsigned int* hits, double* r2,
+                            unsigned int skip = std::numeric_limits<unsigned int>::max()) const{
+        double L[3], inv[3];
+        this->box_lengths(this->periodic[0], this->periodic[1], this->periodic[2], L, inv);
+        return this->wrapped_distances2<true, true, true>(L, inv, x, y, z, idx, first, n, p, cutoff2, hits, r2, skip);
+    }
+
+    //Calls f(j, r2) for the points of the block within cutoff of p, in chunks through distances2
+    template <typename F>
+    void for_each_within(const double* x, const double* y, const double* z, const unsigned int* idx, unsigned int n,
+                         const Eigen::Vector3d& p, double cutoff, unsigned int skip, F&& f) const{
+        double L[3], inv[3];
+        this->box_lengths(this->periodic[0], this->periodic[1], this->periodic[2], L, inv);
+        this->wrapped_for_each_within<true, true, true>(L, inv, x, y, z, idx, n, p, cutoff, skip, f);
+    }
+
+    //As distances2 for p and its mirror img at once, img only differs from p in z. A point is a hit if it is
+    //within sqrt(cutoff2) of either, r2img holds the squared distances to img
+    unsigned int distances2(const double* x, const double* y, const double* z, const unsigned int* idx, unsigned int first,
+                            unsigned int n, const Eigen::Vector3d& p, double imgZ, double cutoff2,
+                            unsigned int* hits, double* r2, double* r2img, unsigned int skip) const{
+        double L[3], inv[3];
+        this->box_lengths(this->periodic[0], this->periodic[1], this->periodic[2], L, inv);
+        return this->wrapped_distances2<true, true, true>(L, inv, x, y, z, idx, first, n, p, imgZ, cutoff2, hits, r2, r2img, skip);
+    }
+
+    //Calls f(j, r2, r2img) for the points of the block within cutoff of p or of its mirror at z = imgZ
+    template <typename F>
+    void for_each_within(const double* x, const double* y, const double* z, const unsigned int* idx, unsigned int n,
+                         const Eigen::Vector3d& p, double imgZ, double cutoff, unsigned int skip, F&& f) const{
+        double L[3], inv[3];
+        this->box_lengths(this->periodic[0], this->periodic[1], this->periodic[2], L, inv);
+        this->wrapped_for_each_within<true, true, true>(L, inv, x, y, z, idx, n, p, imgZ, cutoff, skip, f);
+    }
+
+    protected:
+
+    //Box lengths L and their inverses inv of the periodic dimensions x, y, z, zero for the others
+    void box_lengths(bool x, bool y, bool z, double* L, double* inv) const{
+        const bool w[3] = {x, y, z};
+        for(int a = 0; a < 3; a++){
+            L[a] = w[a] ? this->d[a] : 0.0;
+            inv[a] = w[a] ? 1.0 / this->d[a] : 0.0;
+        }
+    }
+
+    //Kernels of the above, only the dimensions X, Y, Z are wrapped, by the lengths L with inverses inv
+    template <bool X, bool Y, bool Z>
+    unsigned int wrapped_distances2(const double* L, const double* inv, const double* x, const double* y, const double* z,
+                                    const unsigned int* idx, unsigned int first, unsigned int n, const Eigen::Vector3d& p,
+                                    double cutoff2, unsigned int* hits, double* r2, unsigned int skip) const{
+        unsigned int m = 0;
+
+        for(unsigned int k = 0; k < n; k++){
+            unsigned int j = (idx == nullptr) ? first + k : idx[k];
+            double dx = p[0] - x[j], dy = p[1] - y[j], dz = p[2] - z[j];
+            if constexpr (X) dx -= L[0] * std::nearbyint(dx * inv[0]);
+            if constexpr (Y) dy -= L[1] * std::nearbyint(dy * inv[1]);
+            if constexpr (Z) dz -= L[2] * std::nearbyint(dz * inv[2]);
+
+            double s = dx * dx + dy * dy + dz * dz;
+            hits[m] = j;
+            r2[m] = s;
+            m += (s <= cutoff2) & (j != skip);
+        }
+        return m;
+    }
+
+    template <bool X, bool Y, bool Z>
+    unsigned int wrapped_distances2(const double* L, const double* inv, const double* x, const double* y, const double* z,
+                                    const unsigned int* idx, unsigned int first, unsigned int n, const Eigen::Vector3d& p,
+                                    double imgZ, double cutoff2, unsigned int* hits, double* r2, double* r2img, unsigned int skip) const{
+        unsigned int m = 0;
+
+        for(unsigned int k = 0; k < n; k++){
+            unsigned int j = (idx == nullptr) ? first + k : idx[k];
+            double dx = p[0] - x[j], dy = p[1] - y[j], dz = p[2] - z[j], iz = imgZ - z[j];
+            if constexpr (X) dx -= L[0] * std::nearbyint(dx * inv[0]);
+            if constexpr (Y) dy -= L[1] * std::nearbyint(dy * inv[1]);
+            if constexpr (Z){
+                dz -= L[2] * std::nearbyint(dz * inv[2]);
+                iz -= L[2] * std::nearbyint(iz * inv[2]);
+            }
+
+            double xy = dx * dx + dy * dy;
+            double s = xy + dz * dz, si = xy + iz * iz;
+            hits[m] = j;
+            r2[m] = s;
+            r2img[m] = si;
+            m += (std::min(s, si) <= cutoff2) & (j != skip);
+        }
+        return m;
+    }
+
+    template <bool X, bool Y, bool Z, typename F>
+    void wrapped_for_each_within(const double* L, const double* inv, const double* x, const double* y, const double* z,
+                                 const unsigned int* idx, unsigned int n, const Eigen::Vector3d& p, double cutoff, unsigned int skip, F&& f) const{
+        constexpr unsigned int chunk = 256;
+        unsigned int hits[chunk];
+        double r2[chunk];
+
+        for(unsigned int s = 0; s < n; s += chunk){
+            unsigned int c = std::min(chunk, n - s);
+            unsigned int m = this->wrapped_distances2<X, Y, Z>(L, inv, x, y, z, (idx == nullptr) ? nullptr : idx + s, s, c, p, cutoff * cutoff, hits, r2, skip);
+            for(unsigned int i = 0; i < m; i++){
+                f(hits[i], r2[i]);
+            }
+        }
+    }
+
+    template <bool X, bool Y, bool Z, typename F>
+    void wrapped_for_each_within(const double* L, const double* inv, const double* x, const double* y, const double* z,
+                                 const unsigned int* idx, unsigned int n, const Eigen::Vector3d& p, double imgZ, double cutoff,
+                                 unsigned int skip, F&& f) const{
+        constexpr unsigned int chunk = 256;
+        unsigned int hits[chunk];
+        double r2[chunk], r2img[chunk];
+
+        for(unsigned int s = 0; s < n; s += chunk){
+            unsigned int c = std::min(chunk, n - s);
+            unsigned int m = this->wrapped_distances2<X, Y, Z>(L, inv, x, y, z, (idx == nullptr) ? nullptr : idx + s, s, c, p, imgZ,
+                                                               cutoff * cutoff, hits, r2, r2img, skip);
+            for(unsigned int i = 0; i < m; i++){
+                f(hits[i], r2[i], r2img[i]);
+            }
+        }
+    }
+
 };
 
 
 template<bool X = true, bool Y = true, bool Z = true>
-class Cuboid : public Geometry{
+class Cuboid final : public Geometry{
 
     public:
 
@@ -38,6 +175,9 @@ class Cuboid : public Geometry{
         this->dh = {x / 2.0, y / 2.0, z / 2.0};
         this->_dh = dh;
         this->volume = x * y * z;
+        this->periodic[0] = X;
+        this->periodic[1] = Y;
+        this->periodic[2] = Z;
         printf("\tVolume: %lf\n", this->volume);
     }
 
@@ -85,7 +225,7 @@ class Cuboid : public Geometry{
         return true;
     }
 
-    void pbc(std::shared_ptr<Particle>&& p){
+    void pbc(const std::shared_ptr<Particle>& p){
 
         if(X){
             if(p->com[0] > this->dh[0]){
@@ -211,6 +351,39 @@ class Cuboid : public Geometry{
         return disp;
     }
 
+    //Geometry::distances2 and for_each_within with the periodic dimensions X, Y, Z known at compile time
+    unsigned int distances2(const double* x, const double* y, const double* z, const unsigned int* idx, unsigned int first,
+                            unsigned int n, const Eigen::Vector3d& p, double cutoff2, unsigned int* hits, double* r2,
+                            unsigned int skip = std::numeric_limits<unsigned int>::max()) const{
+        double L[3], inv[3];
+        this->box_lengths(X, Y, Z, L, inv);
+        return this->template wrapped_distances2<X, Y, Z>(L, inv, x, y, z, idx, first, n, p, cutoff2, hits, r2, skip);
+    }
+
+    template <typename F>
+    void for_each_within(const double* x, const double* y, const double* z, const unsigned int* idx, unsigned int n,
+                         const Eigen::Vector3d& p, double cutoff, unsigned int skip, F&& f) const{
+        double L[3], inv[3];
+        this->box_lengths(X, Y, Z, L, inv);
+        this->template wrapped_for_each_within<X, Y, Z>(L, inv, x, y, z, idx, n, p, cutoff, skip, f);
+    }
+
+    unsigned int distances2(const double* x, const double* y, const double* z, const unsigned int* idx, unsigned int first,
+                            unsigned int n, const Eigen::Vector3d& p, double imgZ, double cutoff2,
+                            unsigned int* hits, double* r2, double* r2img, unsigned int skip) const{
+        double L[3], inv[3];
+        this->box_lengths(X, Y, Z, L, inv);
+        return this->template wrapped_distances2<X, Y, Z>(L, inv, x, y, z, idx, first, n, p, imgZ, cutoff2, hits, r2, r2img, skip);
+    }
+
+    template <typename F>
+    void for_each_within(const double* x, const double* y, const double* z, const unsigned int* idx, unsigned int n,
+                         const Eigen::Vector3d& p, double imgZ, double cutoff, unsigned int skip, F&& f) const{
+        double L[3], inv[3];
+        this->box_lengths(X, Y, Z, L, inv);
+        this->template wrapped_for_each_within<X, Y, Z>(L, inv, x, y, z, idx, n, p, imgZ, cutoff, skip, f);
+    }
+
     Eigen::Vector3d mirror(Eigen::Vector3d pos){
         Eigen::Vector3d m;
         m << pos[0], pos[1], (pos[2] >= 0) ? 2.0 * dh[2] - pos[2] : -2.0 * dh[2] - pos[2];
@@ -232,7 +405,7 @@ class Cuboid : public Geometry{
 
 
 template<bool X = true, bool Y = true, bool Z = true>
-class CuboidImg : public Geometry{
+class CuboidImg final : public Geometry{
 
     public:
 
@@ -243,6 +416,9 @@ class CuboidImg : public Geometry{
         this->_dh = {this->_d[0] / 2.0, this->_d[1] / 2.0, this->_d[2] / 2.0};
 
         this->volume = x * y * z;
+        this->periodic[0] = X;
+        this->periodic[1] = Y;
+        this->periodic[2] = Z;
         printf("\tBox dimensions: %.3lf, %.3lf, %.3lf\n", this->_d[0], this->_d[1], this->_d[2]);
         printf("\tVolume %.3lf\n", this->volume);
     }
@@ -260,7 +436,7 @@ class CuboidImg : public Geometry{
         return true;
     }
 
-    void pbc(std::shared_ptr<Particle>&& p){
+    void pbc(const std::shared_ptr<Particle>& p){
         if(p->com[0] > this->_dh[0]){
             p->com[0] -= _d[0];
         }
@@ -358,6 +534,41 @@ class CuboidImg : public Geometry{
 
 
 
+    //Geometry::distances2 and for_each_within with the periodic dimensions X, Y, Z known at compile time
+    unsigned int distances2(const double* x, const double* y, const double* z, const unsigned int* idx, unsigned int first,
+                            unsigned int n, const Eigen::Vector3d& p, double cutoff2, unsigned int* hits, double* r2,
+                            unsigned int skip = std::numeric_limits<unsigned int>::max()) const{
+        double L[3], inv[3];
+        this->box_lengths(X, Y, Z, L, inv);
+        return this->template wrapped_distances2<X, Y, Z>(L, inv, x, y, z, idx, first, n, p, cutoff2, hits, r2, skip);
+    }
+
+    template <typename F>
+    void for_each_within(const double* x, const double* y, const double* z, const unsigned int* idx, unsigned int n,
+                         const Eigen::Vector3d& p, double cutoff, unsigned int skip, F&& f) const{
+        double L[3], inv[3];
+        this->box_lengths(X, Y, Z, L, inv);
+        this->template wrapped_for_each_within<X, Y, Z>(L, inv, x, y, z, idx, n, p, cutoff, skip, f);
+    }
+
+    unsigned int distances2(const double* x, const double* y, const double* z, const unsigned int* idx, unsigned int first,
+                            unsigned int n, const Eigen::Vector3d& p, double imgZ, double cutoff2,
+                            unsigned int* hits, double* r2, double* r2img, unsigned int skip) const{
+        double L[3], inv[3];
+        this->box_lengths(X, Y, Z, L, inv);
+        return this->template wrapped_distances2<X, Y, Z>(L, inv, x, y, z, idx, first, n, p, imgZ, cutoff2, hits, r2, r2img, skip);
+    }
+
+    template <typename F>
+    void for_each_within(const double* x, const double* y, const double* z, const unsigned int* idx, unsigned int n,
+                         const Eigen::Vector3d& p, double imgZ, double cutoff, unsigned int skip, F&& f) const{
+        double L[3], inv[3];
+        this->box_lengths(X, Y, Z, L, inv);
+        this->template wrapped_for_each_within<X, Y, Z>(L, inv, x, y, z, idx, n, p, imgZ, cutoff, skip, f);
+    }
+
+
+
     Eigen::Vector3d mirror(Eigen::Vector3d pos){
         Eigen::Vector3d m;
         m << pos[0], pos[1], (pos[2] >= 0) ? 2.0 * dh[2] - pos[2] : -2.0 * _dh[2] - pos[2];
@@ -388,7 +599,7 @@ class Sphere : public Geometry{
 
     double distance(Eigen::Vector3d& a, Eigen::Vector3d& b){ return 0.0; }
 
-    void pbc(std::shared_ptr<Particle>&& p){  }
+    void pbc(const std::shared_ptr<Particle>& p){  }
 
     Eigen::Vector3d displacement(Eigen::Vector3d& a, Eigen::Vector3d& b){
         Eigen::Vector3d disp = a - b;
@@ -17,7 +17,7 @@ class IO{
         for(unsigned int i = 0; i < p.tot; i++){
             //printf("Saving state %d\n", i);
             fprintf(f, "%5d%-5s%5s%5d%8.3f%8.3f%8.3f\n", i + 1, "ion",
-                    p[i]->name.c_str(), i + 1,
+                    p.species.name[p[i]->species].c_str(), i + 1,
                     p[i]->pos[0] * 0.1 + d[0] * 0.5,
                     p[i]->pos[1] * 0.1 + d[1] * 0.5,
                     p[i]->pos[2] * 0.1 + d[2] * 0.5);
@@ -34,7 +34,7 @@ class IO{
             f << p.tot << "\n\n";
             for(unsigned int i = 0; i < p.tot; i++){
 
-                f << std::fixed << std::setprecision(3) << p[i]->name << " " <<  p[i]->pos[0] << " " << p[i]->pos[1] << " " << p[i]->pos[2] << "\n";
+                f << std::fixed << std::setprecision(3) << p.species.name[p[i]->species] << " " <<  p[i]->pos[0] << " " << p[i]->pos[1] << " " << p[i]->pos[2] << "\n";
             }
             f << "10 10 10" << "\n";
             f.close();
@@ -47,7 +47,7 @@ class IO{
             fq << p.tot << "\n\n";
             for(unsigned int i = 0; i < p.tot; i++){
 
-                fq << std::fixed << std::setprecision(3) << p[i]->name << " " <<  p[i]->com[0] << " " << p[i]->com[1] << " " << p[i]->com[2] << "\n";
+                fq << std::fixed << std::setprecision(3) << p.species.name[p[i]->species] << " " <<  p[i]->com[0] << " " << p[i]->com[1] << " " << p[i]->com[2] << "\n";
             }
             fq << d[0] << " " << d[1] << " " << d[2] << "\n";
             fq.close();
@@ -65,7 +65,7 @@ class IO{
                 f << std::fixed << std::setprecision(15) << " " <<  p[i]->com[0] << " " << p[i]->com[1] << " " << p[i]->com[2] << " " << 
                                                                     p[i]->pos[0] << " " << p[i]->pos[1] << " " << p[i]->pos[2] << " " << 
                                                                     p[i]->q << " " << p[i]->r << " " << p[i]->rf << " " << 
-                                                                    p[i]->b << " " << p[i]->b_min << " " << p[i]->b_max << " " << p[i]->name << "\n";
+                                                                    p[i]->b << " " << p[i]->b_min << " " << p[i]->b_max << " " << p.species.name[p[i]->species] << "\n";
             }
             f.close();
         }
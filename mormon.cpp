@@ -215,7 +215,7 @@ class Simulator{
                 wIt = std::lower_bound(mWeights.begin(), mWeights.end(), Random::get_random());
                 (*moves[wIt - mWeights.begin()])();
                 //printf("accepting\n");
-                if(moves[wIt - mWeights.begin()]->accept( state.get_energy_change() )){
+                if(moves[wIt - mWeights.begin()]->accept( state.get_energy_change(moves[wIt - mWeights.begin()]->max_dE()) )){
                     //printf("saving\n");
                     state.save();
                 }
@@ -353,9 +353,11 @@ PYBIND11_MODULE(mormon, m) {
         .def("set_geometry", &State::set_geometry)
         .def("load_cp", &State::load_cp)
         .def("set_energy", &State::set_energy)
+        .def("tune_ewald", &State::tune_ewald, py::arg("tolerance"))
         .def("equilibrate", &State::equilibrate)
         .def("load_spline", &State::load_spline)
         .def("reset_energy", &State::reset_energy)
+        .def("set_cache", &State::set_cache)
         .def_readwrite("particles", &State::particles)
         .def_readonly("energy", &State::energy)
         .def_readonly("cummulativeEnergy", &State::cummulativeEnergy);
@@ -363,14 +365,23 @@ PYBIND11_MODULE(mormon, m) {
 
     py::class_<Particles>(m, "Particles")
         .def_readonly("particles", &Particles::particles)
-        .def_readonly("pModel", &Particles::pModel)
-        .def_readonly("nModel", &Particles::nModel)
+        .def_readonly("species", &Particles::species)
+        .def_readonly("pSpecies", &Particles::pSpecies)
+        .def_readonly("nSpecies", &Particles::nSpecies)
         //.def("load", &Particles::load)
         //.def("set_models", &Particles::set_models, py::arg("q"), py::arg("r"), py::arg("rf"), py::arg("b"), py::arg("names"))
         //.def("create", &Particles::create, py::arg("pNum"), py::arg("nNum"), py::arg("p"), py::arg("n"), py::arg("rfp") = 2.5, 
         //            py::arg("rfn") = 2.5, py::arg("rp") = 2.5, py::arg("rn") = 2.5, py::arg("bp") = 0.0, py::arg("bn") = 0.0);
         .def("create", &Particles::create, py::arg("pNum"), py::arg("nNum"), py::arg("params"));
 
+    py::class_<Species>(m, "Species")
+        .def_readonly("name", &Species::name)
+        .def_readonly("q", &Species::q)
+        .def_readonly("r", &Species::r)
+        .def_readonly("rf", &Species::rf)
+        .def_readonly("b_min", &Species::b_min)
+        .def_readonly("b_max", &Species::b_max);
+
     py::class_<Particle>(m, "Particle")
         .def_readonly("com", &Particle::com)
         .def_readonly("pos", &Particle::pos)
@@ -378,6 +389,7 @@ PYBIND11_MODULE(mormon, m) {
         .def_readonly("q", &Particle::q)
         .def_readonly("b", &Particle::b)
         .def_readonly("r", &Particle::r)
-        .def_readonly("rf", &Particle::rf);
+        .def_readonly("rf", &Particle::rf)
+        .def_readonly("species", &Particle::species);
 }
 #endif
\ No newline at end of file
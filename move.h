@@ -31,12 +31,21 @@ class Move{
     virtual void operator()() = 0;
     virtual bool accept(double dE) = 0;
     virtual std::string dump() = 0;
+
+    //Largest dE the trial can have and still be accepted, State::get_energy_change stops early beyond it.
+    //Moves that draw their Metropolis number together with the trial know it before the energy is evaluated
+    virtual double max_dE(){
+        return std::numeric_limits<double>::infinity();
+    }
 };
 
 
 
 
 class Translate : public Move{
+    private:
+    double u = 0.0;     //Metropolis number, drawn with the trial
+
     public:
 
     Translate(double step, double w, State* s, CallBack move_callback) : Move(step, w, s, move_callback){
@@ -53,6 +62,7 @@ class Translate : public Move{
         std::vector< unsigned int > particles = {p->index};
         //printf("Translating particle %lu\n", p->index);
         //std::cout << p->pos << std::endl;
+        this->s->record(p->index);
         p->translate(this->stepSize);
         //printf("after move\n");
         //std::cout << p->pos << std::endl;
@@ -60,13 +70,14 @@ class Translate : public Move{
 
 
         this->move_callback(particles);
+        this->u = Random::get_random();
         this->attempted++;
     }
 
     bool accept(double dE){
         bool ret = false;
         //printf("dE trans %lf\n", dE);
-        if(exp(-dE) >= Random::get_random() || dE < 0.0){
+        if(exp(-dE) >= this->u || dE < 0.0){
             ret = true;
             this->accepted++;
          } 
@@ -77,6 +88,11 @@ class Translate : public Move{
 
         return ret;
     }
+
+    double max_dE(){
+        return -std::log(this->u);
+    }
+
     std::string dump(){
         std::ostringstream s;
         s.precision(1);
@@ -89,6 +105,9 @@ class Translate : public Move{
 
 
 class Rotate : public Move{
+    private:
+    double u = 0.0;     //Metropolis number, drawn with the trial
+
     public:
 
     Rotate(double step, double w, State* s, CallBack move_callback) : Move(step, w, s, move_callback){
@@ -104,15 +123,17 @@ class Rotate : public Move{
         //std::shared_ptr<Particle> p = std::static_pointer_cast<Particle>(argument);
         std::vector< unsigned int > particles = {p->index};
 
+        this->s->record(p->index);
         p->rotate(this->stepSize);
         this->move_callback(particles);
+        this->u = Random::get_random();
         attempted++;
     }
 
     bool accept(double dE){
         bool ret = false;
 
-        if(exp(-dE) >= Random::get_random() || dE < 0.0){
+        if(exp(-dE) >= this->u || dE < 0.0){
             ret = true;
             this->accepted++;
          } 
@@ -123,6 +144,11 @@ class Rotate : public Move{
 
         return ret;
     }
+
+    double max_dE(){
+        return -std::log(this->u);
+    }
+
     std::string dump(){
         std::ostringstream ss;
         ss.precision(1);
@@ -145,17 +171,24 @@ class Swap : public Move{
     void operator()(){
         int rand = Random::get_random(s->particles.tot), rand2;
 
-        do{
-            rand2 = Random::get_random(s->particles.tot);
-        } while(this->s->particles[rand]->q == this->s->particles[rand2]->q);
+        //Partner of the other sign
+        std::shared_ptr<Particle> partner = this->s->particles.random(1 - this->s->particles.kinds[rand]);
+        if(partner == nullptr){
+            this->move_callback({});
+            attempted++;
+            return;
+        }
+        rand2 = partner->index;
 
         /*std::swap(this->s->particles.particles[rand]->q, this->s->particles.particles[rand2]->q);
-        std::swap(this->s->particles.particles[rand]->name, this->s->particles.particles[rand2]->name);
+        std::swap(this->s->particles.particles[rand]->species, this->s->particles.particles[rand2]->species);
         std::swap(this->s->particles.particles[rand]->r, this->s->particles.particles[rand2]->r);
         std::swap(this->s->particles.particles[rand]->rf, this->s->particles.particles[rand2]->rf);
         std::swap(this->s->particles.particles[rand]->b, this->s->particles.particles[rand2]->b);
         std::swap(this->s->particles.particles[rand]->qDisp, this->s->particles.particles[rand2]->qDisp);*/
 
+        this->s->record(rand);
+        this->s->record(rand2);
         std::swap(this->s->particles.particles[rand]->pos, this->s->particles.particles[rand2]->pos);
         std::swap(this->s->particles.particles[rand]->com, this->s->particles.particles[rand2]->com);
         std::vector< unsigned int > particles = {static_cast<unsigned int>(rand), static_cast<unsigned int>(rand2)};
@@ -211,14 +244,15 @@ class SingleSwap : public Move{
         //std::shared_ptr<Particle> p = std::static_pointer_cast<Particle>(argument);
         //std::vector< unsigned int > particles = {p->index};
         int rand = Random::get_random(s->particles.tot);
+        this->s->record(rand);
         //int rand2;
 
         //If cation
         if(this->s->particles[rand]->q > 0){
-            this->s->particles[rand]->q = this->s->particles.nModel.q;
-            this->s->particles[rand]->b = this->s->particles.nModel.b;
-            this->s->particles[rand]->r = this->s->particles.nModel.r;
-            this->s->particles[rand]->rf = this->s->particles.nModel.rf;
+            this->s->particles[rand]->q = this->s->particles.species.q[this->s->particles.nSpecies];
+            this->s->particles[rand]->b = this->s->particles.species.b_min[this->s->particles.nSpecies];
+            this->s->particles[rand]->r = this->s->particles.species.r[this->s->particles.nSpecies];
+            this->s->particles[rand]->rf = this->s->particles.species.rf[this->s->particles.nSpecies];
 
             //Set qDisp
             Eigen::Vector3d v = Random::get_vector();
@@ -226,18 +260,18 @@ class SingleSwap : public Move{
             this->s->particles[rand]->qDisp = this->s->particles[rand]->qDisp.normalized() * this->s->particles[rand]->b;
             this->s->particles[rand]->pos = this->s->particles[rand]->com + this->s->particles[rand]->qDisp;
 
-            this->s->particles[rand]->name = "Cl";
+            this->s->particles[rand]->species = this->s->particles.nSpecies;
             this->s->particles.aTot++;
             this->s->particles.cTot--;
         }
 
         //anion
         else{
-            //flip charge and change name
-            this->s->particles[rand]->q = this->s->particles.pModel.q;
-            this->s->particles[rand]->b = this->s->particles.pModel.b;
-            this->s->particles[rand]->r = this->s->particles.pModel.r;
-            this->s->particles[rand]->rf = this->s->particles.pModel.rf;
+            //flip charge and change species
+            this->s->particles[rand]->q = this->s->particles.species.q[this->s->particles.pSpecies];
+            this->s->particles[rand]->b = this->s->particles.species.b_min[this->s->particles.pSpecies];
+            this->s->particles[rand]->r = this->s->particles.species.r[this->s->particles.pSpecies];
+            this->s->particles[rand]->rf = this->s->particles.species.rf[this->s->particles.pSpecies];
 
             //Set qDisp
             Eigen::Vector3d v = Random::get_vector();
@@ -245,7 +279,7 @@ class SingleSwap : public Move{
             this->s->particles[rand]->qDisp = this->s->particles[rand]->qDisp.normalized() * this->s->particles[rand]->b;
             this->s->particles[rand]->pos = this->s->particles[rand]->com + this->s->particles[rand]->qDisp;
 
-            this->s->particles[rand]->name = "Na";
+            this->s->particles[rand]->species = this->s->particles.pSpecies;
             this->s->particles.cTot++;
             this->s->particles.aTot--;      
         }
@@ -311,8 +345,8 @@ class GrandCanonical : public Move{
         }
         printf("\t%s\n", this->id.c_str());
         constants::cp = chemPot;
-        this->pVolume = this->s->geo->_d[0] * this->s->geo->_d[1] * (this->s->geo->_d[2] - 2.0 * this->s->particles.pModel.rf);
-        this->nVolume = this->s->geo->_d[0] * this->s->geo->_d[1] * (this->s->geo->_d[2] - 2.0 * this->s->particles.nModel.rf);
+        this->pVolume = this->s->geo->_d[0] * this->s->geo->_d[1] * (this->s->geo->_d[2] - 2.0 * this->s->particles.species.rf[this->s->particles.pSpecies]);
+        this->nVolume = this->s->geo->_d[0] * this->s->geo->_d[1] * (this->s->geo->_d[2] - 2.0 * this->s->particles.species.rf[this->s->particles.nSpecies]);
         printf("\tCation accessible volume: %.3lf, Anion accessible volume: %.3lf\n", this->pVolume, this->nVolume);
         printf("\tChemical potential: %.3lf, Bias potential: %.3lf\n", this->cp, this->d);
         printf("\tWeight: %lf\n", this->weight);
@@ -331,9 +365,10 @@ class GrandCanonical : public Move{
         }
 
         else{
-            auto [ind, qt] = s->particles.remove_random();
+            auto [ind, qt] = s->particles.pick_random();
             this->q = qt;
             if(ind != -1){
+                this->s->remove(ind);
                 particles.push_back(ind);
             }
             this->move_callback(particles);        
@@ -428,6 +463,8 @@ class VolumeMove: public Move{
         std::vector<double> LV = {L, L, L};
         std::vector<double> LVh = {L / 2.0, L / 2.0, L / 2.0};
 
+        this->s->record_box();
+
         this->s->geo->_d = LV;
         this->s->geo->_dh = LVh;
         this->s->geo->d = LV;
@@ -437,6 +474,7 @@ class VolumeMove: public Move{
         std::vector< unsigned int > particles;
 
         for(unsigned int i = 0; i < this->s->particles.tot; i++){
+            this->s->record(i);
             this->s->particles[i]->com *= RL;
             this->s->particles[i]->pos = this->s->particles[i]->com + this->s->particles[i]->qDisp;
             particles.push_back(s->particles[i]->index);
@@ -478,6 +516,9 @@ class VolumeMove: public Move{
 
 class ChargeTrans: public Move{
 
+    private:
+    double u = 0.0;     //Metropolis number, drawn with the trial
+
     public:
 
     ChargeTrans(double step, double w, State* s, CallBack move_callback) : Move(step, w, s, move_callback){
@@ -489,22 +530,24 @@ class ChargeTrans: public Move{
 
 
     void operator()(){
-        int rand = 0;
-        do{
-            rand = Random::get_random(s->particles.tot);
-        } while(s->particles[rand]->q < 0.0);
+        std::vector< unsigned int > particles;
+        std::shared_ptr<Particle> p = this->s->particles.random(0);
         
-        std::vector< unsigned int > particles = {s->particles[rand]->index};
-        //printf("Translating\n");
-        this->s->particles[rand]->chargeTrans(this->stepSize);
+        if(p != nullptr){
+            particles.push_back(p->index);
+            //printf("Translating\n");
+            this->s->record(p->index);
+            p->chargeTrans(this->stepSize);
+        }
         this->move_callback(particles);
+        this->u = Random::get_random();
         this->attempted++;
     }
 
     bool accept(double dE){
         bool ret = false;
 
-        if(exp(-dE) >= Random::get_random() || dE < 0.0){
+        if(exp(-dE) >= this->u || dE < 0.0){
             ret = true;
             this->accepted++;
          } 
@@ -516,6 +559,10 @@ class ChargeTrans: public Move{
         return ret;
     }
 
+    double max_dE(){
+        return -std::log(this->u);
+    }
+
     std::string dump(){
         std::ostringstream ss;
         ss.precision(1);
@@ -542,13 +589,11 @@ class ChargeTransRand: public Move{
     void operator()(){
         //printf("Move\n");
         std::vector< unsigned int > particles;
-        int rand = 0;
-        if(s->particles.cTot > 0){
-            do{
-                rand = Random::get_random(s->particles.tot);
-            } while(s->particles[rand]->q < 0.0);
-            this->s->particles[rand]->chargeTransRand();
-            particles.push_back(s->particles[rand]->index);
+        std::shared_ptr<Particle> p = this->s->particles.random(0);
+        if(p != nullptr){
+            this->s->record(p->index);
+            p->chargeTransRand();
+            particles.push_back(p->index);
         }
         this->move_callback(particles);
         
@@ -606,13 +651,11 @@ class Cluster : public Move{
         std::vector<unsigned int> indices;
         Eigen::Vector3d disp;
 
-        for(auto i : this->s->particles.particles){
-            if(i->index == this->p->index) continue;
-
-            if(this->s->geo->distance(i->pos, this->p->pos) <= this->minDist){
-                indices.push_back(i->index);
-            }
-        }
+        const Particles& P = this->s->particles;
+        this->s->geo->for_each_within(P.x.data(), P.y.data(), P.z.data(), nullptr, P.tot, this->p->pos, this->minDist, this->p->index,
+                                      [&](unsigned int j, double r2){
+            indices.push_back(j);
+        });
         //Choose random particle
         //If particle is in cluster
         //Move cluster
@@ -623,6 +666,9 @@ class Cluster : public Move{
 
             disp = Random::get_norm_vector();
             disp *= this->stepSize;
+            for(auto i : indices){
+                this->s->record(i);
+            }
             this->s->particles.translate(indices, disp);
             this->move_callback(indices);
             this->attempted++;
@@ -644,12 +690,11 @@ class Cluster : public Move{
 
         if(found){
 
-            for(auto i : this->s->particles.particles){
-                if(i->index == this->p->index) continue;
-                if(this->s->geo->distance(i->pos, this->p->pos) <= this->minDist){
-                    count++;
-                }
-            }
+            const Particles& P = this->s->particles;
+            this->s->geo->for_each_within(P.x.data(), P.y.data(), P.z.data(), nullptr, P.tot, this->p->pos, this->minDist, this->p->index,
+                                          [&](unsigned int j, double r2){
+                count++;
+            });
             if(count != this->pNum) return false;
             
             if(exp(-dE) >= Random::get_random() || dE < 0.0){
@@ -730,6 +775,7 @@ class WidomDeletion : public Move{
     double q;
     double cp = 0.0;
     int samples = 0;
+    bool found = false;
     public:
 
     WidomDeletion(double w, State* s, CallBack move_callback) : Move(0.0, w, s, move_callback) {
@@ -740,15 +786,24 @@ class WidomDeletion : public Move{
     }
 
     void operator()(){      
-        auto [ind, qt] = s->particles.remove_random();
+        std::vector< unsigned int > particles;
+        auto [ind, qt] = s->particles.pick_random();
         this->q = qt;
-        std::vector< unsigned int > particles{ind};
+        this->found = ind != -1;
+        if(this->found){
+            this->s->remove(ind);
+            particles.push_back(ind);
+        }
         this->move_callback(particles);
 
         this->attempted++;
     }
 
     bool accept(double dE){
+        //Nothing was removed, there is no sample
+        if(!this->found){
+            return false;
+        }
         if(this->samples > 10000){
             this->samples = 0;
             this->cp = 0.0;
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include "spme.h"
+
+namespace EwaldLike{
+
+    int p3mOrder = 5;      //Charge assignment order of LongP3M, 1 (nearest grid point) to 7
+
+    /*
+        Particle-particle particle-mesh (Hockney & Eastwood) reciprocal energy of a slab with image charges,
+        the mesh counterpart of LongHW. Every charge and its negative image in the doubled z box are
+        assigned to a kM[0] x kM[1] x kM[2] mesh with the order p3mOrder assignment function, and G is
+        the influence function that minimizes the RMS energy error for that assignment
+        (Ballenegger, Cerda & Holm 2012),
+
+        G(k) = sum_m U^2(k_m) phi(k_m) / (sum_m U^2(k_m))^2,   k_m = k + 2 pi m / h,
+
+        with U the Fourier transform of the assignment function and phi the Ewald kernel. The energy is
+        half that of the periodic system of charges and images, as in LongHW.
+    */
+    class LongP3M : public MeshEwald{
+        private:
+        static constexpr int aliases = 2;       //Alias sums run over |m| <= aliases along each axis
+
+        //Charge and image, the shift centers the assignment function on the charge
+        void spread_charge(const Eigen::Vector3d& pos, double q, Spread& out){
+            Eigen::Vector3d img(pos[0], pos[1], math::sgn(pos[2]) * this->zb / 2.0 - pos[2]);
+            this->spread(pos, q, this->order / 2.0, out);
+            this->spread(img, -q, this->order / 2.0, out);
+        }
+
+        //U^2 of wavenumber m + a * k along one axis, U = sinc^order
+        inline double assignment2(int m, int a, int k){
+            double x = constants::PI * ((double) m / k + a);
+            return (std::fabs(x) < 1e-12) ? 1.0 : std::pow(std::sin(x) / x, 2 * this->order);
+        }
+
+        public:
+
+        void initialize(Particles &particles){
+            this->order = p3mOrder;
+            if(this->order < 1 || this->order > 7){
+                printf("P3M charge assignment order must be between 1 and 7!\n");
+                exit(1);
+            }
+            for(int d = 0; d < 3; d++){
+                this->K[d] = kM[d];
+            }
+            int M = this->K[0] * this->K[1] * this->K[2];
+            double L[3] = {this->xb, this->yb, this->zb};
+
+            printf("Setting up P3M\n");
+            printf("\tMesh: %i x %i x %i, assignment order %i\n", this->K[0], this->K[1], this->K[2], this->order);
+
+            //Optimal influence function, the denominator factorizes over the axes
+            this->G.assign(M, 0.0);
+            for(int a = 0; a < this->K[0]; a++){
+                int ma = this->wavenumber(a, this->K[0]);
+                double sa = 0.0;
+                for(int i = -aliases; i <= aliases; i++){
+                    sa += this->assignment2(ma, i, this->K[0]);
+                }
+
+                for(int b = 0; b < this->K[1]; b++){
+                    int mb = this->wavenumber(b, this->K[1]);
+                    double sb = 0.0;
+                    for(int j = -aliases; j <= aliases; j++){
+                        sb += this->assignment2(mb, j, this->K[1]);
+                    }
+
+                    for(int c = 0; c < this->K[2]; c++){
+                        int mc = this->wavenumber(c, this->K[2]);
+                        if(ma == 0 && mb == 0 && mc == 0) continue;
+
+                        double sc = 0.0, num = 0.0;
+                        for(int l = -aliases; l <= aliases; l++){
+                            sc += this->assignment2(mc, l, this->K[2]);
+                        }
+
+                        for(int i = -aliases; i <= aliases; i++){
+                            double kx = 2.0 * constants::PI * (ma + i * this->K[0]) / L[0];
+                            double ux = this->assignment2(ma, i, this->K[0]);
+                            for(int j = -aliases; j <= aliases; j++){
+                                double ky = 2.0 * constants::PI * (mb + j * this->K[1]) / L[1];
+                                double uxy = ux * this->assignment2(mb, j, this->K[1]);
+                                for(int l = -aliases; l <= aliases; l++){
+                                    double kz = 2.0 * constants::PI * (mc + l * this->K[2]) / L[2];
+                                    double k2 = kx * kx + ky * ky + kz * kz;
+                                    num += uxy * this->assignment2(mc, l, this->K[2]) * std::exp(-k2 / (4.0 * alpha * alpha)) / k2;
+                                }
+                            }
+                        }
+
+                        //pi / V instead of 2 pi / V, the images are only there to shape the field
+                        this->G[(a * this->K[1] + b) * this->K[2] + c] = constants::PI / this->volume * num / std::pow(sa * sb * sc, 2);
+                    }
+                }
+            }
+
+            this->build_mesh(particles);
+            printf("\tP3M initialization Complete\n");
+        }
+    };
+}
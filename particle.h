@@ -12,7 +12,7 @@ class Particle{
     Eigen::Vector3d pos;    //Position of charge
     Eigen::Vector3d com;    //COM position
     Eigen::Vector3d qDisp;  //Charge vector
-    std::string name;       //name
+    int species;            //Id in the species registry
     double r, b, b_min, b_max, q, rf;     //radius, length of charge vector, charge, minimum distance to wall
 
     unsigned int index;
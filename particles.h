@@ -3,6 +3,7 @@
 #include <Eigen/Dense>
 #include <vector>
 #include "particle.h"
+#include "species.h"
 #include <chrono>
 #include <iostream>
 #include <fstream>
@@ -11,30 +12,112 @@
 #include <map>
 //#include "../libxdrfile/include/xdrfile_xtc.h"
 
+template <typename T>
+using AlignedVector = std::vector< T, Eigen::aligned_allocator<T> >;
+
 class Particles{
     private:
+
+    std::vector<unsigned int> kindSlot;     //Position of each particle in cations or anions
+
+    void soa_resize(std::size_t n){
+        for(auto v : {&x, &y, &z, &cx, &cy, &cz, &qs, &rs, &rfs, &bs}){
+            v->resize(n);
+        }
+        this->kinds.resize(n);
+        this->kindSlot.resize(n, 0);
+    }
+
+    inline std::vector<unsigned int>& kind(int s){
+        return (s == 0) ? this->cations : this->anions;
+    }
+
+    inline bool listed(unsigned int i, int s){
+        std::vector<unsigned int>& l = this->kind(s);
+        return this->kindSlot[i] < l.size() && l[this->kindSlot[i]] == i;
+    }
+
+    //Removes i from list s, the last entry of the list takes its place
+    void unlist(unsigned int i, int s){
+        std::vector<unsigned int>& l = this->kind(s);
+        unsigned int last = l.back();
+        l[this->kindSlot[i]] = last;
+        this->kindSlot[last] = this->kindSlot[i];
+        l.pop_back();
+    }
+
+    //Particle from of list s is renumbered to
+    void relist(unsigned int from, unsigned int to, int s){
+        this->kind(s)[this->kindSlot[from]] = to;
+        this->kindSlot[to] = this->kindSlot[from];
+    }
  
 
     public:
-    bool setPModel = false;
-    bool setNModel = false;
     //Eigen::MatrixXd positions;
-    Particle pModel;
-    Particle nModel;
-    std::vector< std::shared_ptr<Particle> > particles, cations, anions;
+    Species species;                    //Registry of the species in the system
+    int pSpecies = -1, nSpecies = -1;   //Species of the inserted cations and anions
+    std::vector< std::shared_ptr<Particle> > particles;
+    std::vector<unsigned int> cations, anions;      //Indices of the particles of each sign, kept by sync
     std::vector<int> movedParticles;
     unsigned int cTot = 0, aTot = 0, tot = 0;
 
+    //Contiguous copy of the particle data read in the energy loops, particles[i] is the handle used by the moves.
+    //Entry i must be refreshed with sync(i) whenever particles[i] is changed.
+    AlignedVector<double> x, y, z;      //Charge positions
+    AlignedVector<double> cx, cy, cz;   //COM positions
+    AlignedVector<double> qs, rs, rfs, bs;
+    std::vector<int> kinds;             //0 for cations, 1 for anions
+
     //Eigen::MatrixXd get_subset(int sr, int fr){
     //    return this->positions.block(sr, 0, fr, 3);
     //}
 
     Particles(){}
 
-    std::shared_ptr<Particle> operator[](std::size_t index){
+    const std::shared_ptr<Particle>& operator[](std::size_t index){
         return particles[index];
     }
 
+    inline Eigen::Vector3d pos(std::size_t i) const{
+        return Eigen::Vector3d(this->x[i], this->y[i], this->z[i]);
+    }
+
+    inline Eigen::Vector3d com(std::size_t i) const{
+        return Eigen::Vector3d(this->cx[i], this->cy[i], this->cz[i]);
+    }
+
+    void sync(std::size_t i){
+        const Particle& p = *(this->particles[i]);
+        this->x[i] = p.pos[0];
+        this->y[i] = p.pos[1];
+        this->z[i] = p.pos[2];
+        this->cx[i] = p.com[0];
+        this->cy[i] = p.com[1];
+        this->cz[i] = p.com[2];
+        this->qs[i] = p.q;
+        this->rs[i] = p.r;
+        this->rfs[i] = p.rf;
+        this->bs[i] = p.b;
+        this->kinds[i] = (p.q > 0) ? 0 : 1;
+
+        //New particle or changed sign
+        if(!this->listed(i, this->kinds[i])){
+            if(this->listed(i, 1 - this->kinds[i])) this->unlist(i, 1 - this->kinds[i]);
+            this->kindSlot[i] = this->kind(this->kinds[i]).size();
+            this->kind(this->kinds[i]).push_back(i);
+        }
+    }
+
+    void sync(){
+        this->soa_resize(this->tot);
+        this->cations.clear();
+        this->anions.clear();
+        for(unsigned int i = 0; i < this->tot; i++){
+            this->sync(i);
+        }
+    }
+
     std::vector< std::shared_ptr<Particle> > get_subset(std::vector<unsigned int> &ps){
         std::vector< std::shared_ptr<Particle> > subset;
 
@@ -100,7 +183,7 @@ class Particles{
         this->particles[this->tot]->b = b;
         this->particles[this->tot]->b_min = b_min;
         this->particles[this->tot]->b_max = b_max;
-        this->particles[this->tot]->name = name;
+        this->particles[this->tot]->species = this->species.add(name, q, r, rf, b_min, b_max);
             
         if(q > 0){
             this->cTot++;
@@ -111,36 +194,26 @@ class Particles{
 
         this->tot++;
         assert(this->tot <= this->particles.size() && "tot is larger than particle vector size\n");
+        this->soa_resize(this->tot);
+        this->sync(this->tot - 1);
 
-        if(!this->setPModel){
-            if(q > 0){
-                this->pModel.q = q;
-                this->pModel.b_min = b_min;
-                this->pModel.b_max = b_max;
-                this->pModel.r = r;
-                this->pModel.rf = rf;
-                this->pModel.name = name;
-                this->setPModel = true;
-            }
+        if(this->pSpecies < 0 && q > 0){
+            this->pSpecies = this->particles[this->tot - 1]->species;
         }
 
-        if(!this->setNModel){
-            if(q < 0){
-                this->nModel.q = q;
-                this->nModel.b_min = b_min;
-                this->nModel.b_max = b_max;
-                this->nModel.r = r;
-                this->nModel.rf = rf;
-                this->nModel.name = name;
-                this->setNModel = true;
-            }
+        if(this->nSpecies < 0 && q < 0){
+            this->nSpecies = this->particles[this->tot - 1]->species;
         }
     }
 
 
 
+    //Adds a particle of species s at com
     template <typename T>
-    void add(T com, double r, double rf, double q, double b_min, double b_max, std::string name){
+    void add(T com, int s){
+        double r = this->species.r[s], rf = this->species.rf[s], q = this->species.q[s];
+        double b_min = this->species.b_min[s], b_max = this->species.b_max[s];
+
         //Resize positions
         //this->positions.conservativeResize(this->positions.rows() + 1, 3);
         //this->positions.row(this->positions.rows() - 1) << pos[0], pos[1], pos[2];
@@ -164,7 +237,7 @@ class Particles{
         this->particles[this->tot]->b_max = b_max;
         this->particles[this->tot]->r = r;
         this->particles[this->tot]->rf = rf;
-        this->particles[this->tot]->name = name;
+        this->particles[this->tot]->species = s;
         this->particles[this->tot]->index = this->tot;
 
 
@@ -177,6 +250,8 @@ class Particles{
 
         this->tot++;
         assert(this->tot <= this->particles.size() && "tot is larger than particle vector size\n");
+        this->soa_resize(this->tot);
+        this->sync(this->tot - 1);
     }
 
 
@@ -198,7 +273,7 @@ class Particles{
         this->particles[this->tot]->b = p->b;
         this->particles[this->tot]->b_min = p->b_min;
         this->particles[this->tot]->b_max = p->b_max;
-        this->particles[this->tot]->name = p->name;
+        this->particles[this->tot]->species = p->species;
 
         if(p->q > 0){
             this->cTot++;
@@ -208,6 +283,8 @@ class Particles{
         }
 
         this->tot++;
+        this->soa_resize(this->tot);
+        this->sync(this->tot - 1);
     }
 
 
@@ -238,14 +315,17 @@ class Particles{
         this->particles[index]->b = p->b;
         this->particles[index]->b_min = p->b_min;
         this->particles[index]->b_max = p->b_max;
-        this->particles[index]->name = p->name;
+        this->particles[index]->species = p->species;
 
         if(p->q > 0){
             this->cTot++;
         }
         else {
             this->aTot++;
-        }      
+        }
+
+        //Particles above index were shifted
+        this->sync();
     }
 
 
@@ -254,18 +334,18 @@ class Particles{
         double rand = Random::get_random();
         double q;
         Eigen::Vector3d com;
-        com = Random::random_pos_box(this->pModel.rf, box);
+        com = Random::random_pos_box(this->species.rf[this->pSpecies], box);
         if(type != 0) rand = type;
         //Add cation
         if(rand < 0.5){
-            this->add(com, this->pModel.r, this->pModel.rf, this->pModel.q, this->pModel.b_min, this->pModel.b_max, "Na");
-            q = this->pModel.q;
+            this->add(com, this->pSpecies);
+            q = this->species.q[this->pSpecies];
         }
 
         //Add anion
         else{
-            this->add(com, this->nModel.r, this->nModel.rf, this->nModel.q, this->nModel.b_min, this->nModel.b_max, "Cl");
-            q = this->nModel.q;
+            this->add(com, this->nSpecies);
+            q = this->species.q[this->nSpecies];
         }
         //printf("Adding %i charge %lf com %lf %lf %lf\n", this->tot - 1, q, com[0], com[1], com[2]);
         return {this->tot - 1, q};
@@ -273,95 +353,89 @@ class Particles{
 
 
 
-    std::tuple<unsigned int, double> remove_random(){
-        double q;
-        double rand = Random::get_random();
-        int rand2 = Random::get_random(this->tot);
-
-        if(rand < 0.5){
-            if(this->cTot > 0){
-                do{
-                    rand2 = Random::get_random(this->tot);
-                } while(this->particles[rand2]->q != this->pModel.q);
-                q = this->particles[rand2]->q;
-                this->remove(rand2);
-            }
-
-            else{
-                rand2 = -1;
-            }
-        }
-        else{
-            if(this->aTot > 0){
-                do{
-                    rand2 = Random::get_random(this->tot);
-                } while(this->particles[rand2]->q != this->nModel.q);
-                q = this->particles[rand2]->q;
-                this->remove(rand2);
-            }
-            else{
-                rand2 = -1;
-            }
+    std::tuple<int, double> remove_random(){
+        auto [index, q] = this->pick_random();
+        if(index != -1){
+            this->remove(index);
         }
+        return {index, q};
+    }
 
-        /*if(this->cTot <= 0 || this->aTot <= 0){
-            printf("Trying to remove last particle!\n");
-        }*/
+    //Random cation or anion with equal probability, index is -1 if there is none of that kind
+    std::tuple<int, double> pick_random(){
+        double q = 0.0;
+        int rand2 = -1;
+        std::vector<unsigned int>& l = this->kind((Random::get_random() < 0.5) ? 0 : 1);
+
+        if(!l.empty()){
+            rand2 = (int) l[Random::get_random(l.size())];
+            q = this->particles[rand2]->q;
+        }
 
         //printf("Removing %i charge %lf\n", rand2, q);
         return {rand2, q};
     }
 
+    //Random particle of sign s, 0 for cations and 1 for anions, nullptr if there is none
+    std::shared_ptr<Particle> random(int s){
+        std::vector<unsigned int>& l = this->kind(s);
+        return (l.empty()) ? nullptr : this->particles[l[Random::get_random(l.size())]];
+    }
+
 
 
     void remove(std::size_t index){
-        //this->particles.erase(this->particles.begin() + i);
-        //printf("Copying in remove\n");
-        //std::copy(this->particles.begin() + i + 1, this->particles.begin() + this->tot, this->particles.begin() + i);
-        //std::copy(this->particles.begin() + i, this->particles.begin() + this->tot, this->particles.begin() + i - 1);
+        this->take(index);
+    }
 
-        if(this->particles[index]->q > 0){
-            this->cTot--;
-        }
-        else{
-            this->aTot--; 
+    //Removes particle index and hands it over, the last particle takes its place.
+    //put() with the same index undoes it
+    std::shared_ptr<Particle> take(std::size_t index){
+        std::shared_ptr<Particle> p = this->particles[index];
+        (p->q > 0) ? this->cTot-- : this->aTot--;
+
+        unsigned int last = this->tot - 1;
+        this->unlist(index, this->kinds[index]);
+        if(index != last){
+            this->relist(last, index, this->kinds[last]);
+            this->particles[index] = this->particles[last];
+            this->particles[index]->index = index;
+            this->sync(index);
         }
-        
-        //move last particle in particles to position of particle to be removed
-        this->particles.erase(this->particles.begin() + index);
+        this->particles.pop_back();
+        this->tot--;
+        this->soa_resize(this->tot);
+        return p;
+    }
 
-        for(unsigned int i = index; i < this->tot - 1; i++){
-            //printf("Remove: Moving particle %i to %i\n", i + 1, i);
-            //*(this->particles[i]) = *(this->particles[i + 1]);
-            this->particles[i]->index = i;
-        }
+    //Inserts p at index, the particle there moves to the end
+    void put(const std::shared_ptr<Particle>& p, std::size_t index){
+        (p->q > 0) ? this->cTot++ : this->aTot++;
 
-        this->tot--;
+        this->particles.push_back(p);
+        this->tot++;
+        this->soa_resize(this->tot);
+        if(index != this->tot - 1){
+            this->relist(index, this->tot - 1, this->kinds[index]);
+            std::swap(this->particles[index], this->particles.back());
+            this->particles.back()->index = this->tot - 1;
+            this->sync(this->tot - 1);
+        }
+        p->index = index;
+        this->sync(index);
     }
 
 
     //void create(int pNum, int nNum, double p, double n, double rfp = 2.5, double rfn = 2.5, double rp = 2.5, double rn = 2.5, double bp = 0.0, double bp_min = 0.0, double bn = 0.0, double bn_min = 0.0){
     void create(int pNum, int nNum, std::map<std::string, double> params){
 
-        this->pModel.q = params["p"];
-        this->pModel.r = params["rp"];
-        this->pModel.rf = params["rfp"];
-        this->pModel.b_min = params["bp_min"];
-        this->pModel.b_max = params["bp_max"];
-        this->pModel.name = "Na";
-
-        this->nModel.q = params["n"];
-        this->nModel.r = params["rn"];
-        this->nModel.rf = params["rfn"];
-        this->nModel.b_min = params["bn_min"];
-        this->nModel.b_max = params["bn_max"];
-        this->nModel.name = "Cl";
+        this->pSpecies = this->species.add("Na", params["p"], params["rp"], params["rfp"], params["bp_min"], params["bp_max"]);
+        this->nSpecies = this->species.add("Cl", params["n"], params["rn"], params["rfn"], params["bn_min"], params["bn_max"]);
 
         Eigen::Vector3d com;
         for(int i = 0; i < pNum + nNum; i++){
             com = Random::get_vector();
-            (i < pNum) ? this->add(com, this->pModel.r, this->pModel.rf, this->pModel.q, this->pModel.b_min, this->pModel.b_max, "Na") : 
-                         this->add(com, this->nModel.r, this->nModel.rf, this->nModel.q, this->nModel.b_min, this->nModel.b_max, "Cl");
+            (i < pNum) ? this->add(com, this->pSpecies) : this->add(com, this->nSpecies);
         }
 
         printf("\nCreated %i cations and %i anions\n", pNum, nNum);
@@ -1,7 +1,9 @@
 #include "particle.h"
 #include <vector>
+#include <numeric>
 #include "geometry.h"
 #include "Faddeeva.h"
+#include "simd.h"
 
 /*
 #pragma omp declare reduction(vec_double_plus : std::vector<std::complex<double>> : \
@@ -75,6 +77,112 @@ class Sture{
 
 
 
+/*
+    Cubic Hermite table of a pair functor, E(q1, q2, r) = q1 * q2 * f(r) with f(r) = E(1, 1, r).
+    Nodes are uniform in r (or in r^2 if squared) between rMin and rMax, and their number is doubled until
+    the largest deviation from E, checked between the nodes, is below tol. Outside the table E is used.
+    Construct after the globals E reads (alpha, R, ...) are set.
+*/
+template <typename E>
+class Tabulated{
+    private:
+
+    E func;
+    bool squared = false;
+    int n = 0;
+    double xMin, xMax, h, invH, maxError = 0.0;
+    std::vector<double> c0, c1, c2, c3;     //Polynomial coefficients in t for each interval
+
+    inline double f(double r){
+        return this->func(1.0, 1.0, r);
+    }
+
+    inline double x2r(double x){
+        return (this->squared) ? std::sqrt(x) : x;
+    }
+
+    //df/dx by central difference
+    inline double dfdx(double x){
+        double dx = 1e-5 * std::max(std::fabs(x), 1e-3);
+        return (f(x2r(x + dx)) - f(x2r(x - dx))) / (2.0 * dx);
+    }
+
+    void build(int n){
+        this->n = n;
+        this->h = (this->xMax - this->xMin) / n;
+        this->invH = 1.0 / this->h;
+        this->c0.resize(n);
+        this->c1.resize(n);
+        this->c2.resize(n);
+        this->c3.resize(n);
+
+        double x = this->xMin;
+        double f0 = f(x2r(x)), m0 = dfdx(x) * this->h;
+        for(int i = 0; i < n; i++){
+            x = this->xMin + (i + 1) * this->h;
+            double f1 = f(x2r(x)), m1 = dfdx(x) * this->h;
+
+            this->c0[i] = f0;
+            this->c1[i] = m0;
+            this->c2[i] = 3.0 * (f1 - f0) - 2.0 * m0 - m1;
+            this->c3[i] = 2.0 * (f0 - f1) + m0 + m1;
+            f0 = f1;
+            m0 = m1;
+        }
+    }
+
+    inline double eval(double x){
+        double s = (x - this->xMin) * this->invH;
+        int i = std::min((int) s, this->n - 1);
+        double t = s - i;
+        return this->c0[i] + t * (this->c1[i] + t * (this->c2[i] + t * this->c3[i]));
+    }
+
+    double measure(){
+        double err = 0.0;
+        for(int i = 0; i < this->n; i++){
+            for(double t : {0.25, 0.5, 0.75}){
+                double x = this->xMin + (i + t) * this->h;
+                err = std::max(err, std::fabs(eval(x) - f(x2r(x))));
+            }
+        }
+        return err;
+    }
+
+    public:
+
+    Tabulated(double rMin, double rMax, double tol, bool squared = false) : squared(squared){
+        this->xMin = (squared) ? rMin * rMin : rMin;
+        this->xMax = (squared) ? rMax * rMax : rMax;
+
+        for(int n = 64; ; n *= 2){
+            this->build(n);
+            this->maxError = this->measure();
+            if(this->maxError <= tol || n >= (1 << 20)) break;
+        }
+
+        printf("\tTabulated potential: %d intervals in %s on [%lf, %lf], max error: %e\n", this->n,
+               (squared) ? "r^2" : "r", rMin, rMax, this->maxError);
+        if(this->maxError > tol){
+            printf("\tWarning: requested tolerance %e not reached\n", tol);
+        }
+    }
+
+    double max_error(){
+        return this->maxError;
+    }
+
+    inline double operator()(const double& q1, const double& q2, const double& dist){
+        double x = (this->squared) ? dist * dist : dist;
+        if(x < this->xMin || x >= this->xMax){
+            return this->func(q1, q2, dist);
+        }
+        return q1 * q2 * eval(x);
+    }
+};
+
+
+
 
 namespace Fanourgakis{
     double R;
@@ -95,7 +203,7 @@ namespace Fanourgakis{
     class SP2Self{
         private:
 
-        double selfTerm = 0.0;
+        double selfTerm = 0.0, dSelf = 0.0;     //dSelf is the change from the pending trial
 
         public:
 
@@ -107,28 +215,39 @@ namespace Fanourgakis{
             this->selfTerm = 0.0;
 
             for(unsigned int i = 0; i < particles.tot; i++){
-                this->selfTerm += particles[i]->q * particles[i]->q;
+                this->selfTerm += particles.qs[i] * particles.qs[i];
             }
             printf("Self term: %lf\n", this->selfTerm);
         }
 
-        inline void update(std::vector< std::shared_ptr<Particle> >& _old, std::vector< std::shared_ptr<Particle> >& _new){
+        inline void update(const std::vector< std::shared_ptr<Particle> >& _old, const std::vector< std::shared_ptr<Particle> >& _new){
+            this->dSelf = 0.0;
             if(_old.empty()){
                 for(auto n : _new){
-                    this->selfTerm += n->q * n->q;
+                    this->dSelf += n->q * n->q;
                 }
             }
 
             if(_new.empty()){
                 for(auto o : _old){
-                    this->selfTerm -= o->q * o->q;
+                    this->dSelf -= o->q * o->q;
                 }
             }
         }
 
 
+        void commit(){
+            this->selfTerm += this->dSelf;
+            this->dSelf = 0.0;
+        }
+
+        void discard(){
+            this->dSelf = 0.0;
+        }
+
+
         inline double operator()(){
-            return -1.0 / R * this->selfTerm;
+            return -1.0 / R * (this->selfTerm + this->dSelf);
         } 
     };
 
@@ -148,7 +267,7 @@ namespace Fanourgakis{
     class SP3Self{
         private:
 
-        double selfTerm = 0.0;
+        double selfTerm = 0.0, dSelf = 0.0;     //dSelf is the change from the pending trial
 
         public:
 
@@ -159,27 +278,38 @@ namespace Fanourgakis{
         void initialize(Particles &particles){
             this->selfTerm = 0.0;
             for(unsigned int i = 0; i < particles.tot; i++){
-                this->selfTerm += particles[i]->q * particles[i]->q;
+                this->selfTerm += particles.qs[i] * particles.qs[i];
             }
         }
 
-        inline void update(std::vector< std::shared_ptr<Particle> >& _old, std::vector< std::shared_ptr<Particle> >& _new){
+        inline void update(const std::vector< std::shared_ptr<Particle> >& _old, const std::vector< std::shared_ptr<Particle> >& _new){
+            this->dSelf = 0.0;
             if(_old.empty()){
                 for(auto n : _new){
-                    this->selfTerm += n->q * n->q;
+                    this->dSelf += n->q * n->q;
                 }
             }
 
             if(_new.empty()){
                 for(auto o : _old){
-                    this->selfTerm -= o->q * o->q;
+                    this->dSelf -= o->q * o->q;
                 }
             }
         }
 
 
+        void commit(){
+            this->selfTerm += this->dSelf;
+            this->dSelf = 0.0;
+        }
+
+        void discard(){
+            this->dSelf = 0.0;
+        }
+
+
         inline double operator()(){
-            return -7.0 / (8.0 * R) * this->selfTerm;
+            return -7.0 / (8.0 * R) * (this->selfTerm + this->dSelf);
         } 
     };
 }
@@ -284,6 +414,7 @@ namespace EwaldLike{
     double R;
     double eta;
     bool spherical;
+    int slabKM = 0;         //2D wave numbers along x and y of the Levin wall term
 
     void set_km(std::vector<int> v){
         kM = v;
@@ -296,6 +427,8 @@ namespace EwaldLike{
 
         public:
 
+        static constexpr bool batched = true;
+
         inline double operator()(const double& q1, const double& q2, const double& dist){
 
             //math::sgn(p2->pos[2]) * d[2] - p2->pos[2];   //Mirror of p2
@@ -305,6 +438,22 @@ namespace EwaldLike{
             //printf("Real %.15lf\n", real);
             return real;    //tinfoil
         }
+
+        //sum_j q_j erfc(alpha r) / r over partners within the cutoff, see simd.h
+        inline double batch(const double* x, const double* y, const double* z, const double* q, const unsigned int* idx,
+                            unsigned int n, unsigned int skip, const Eigen::Vector3d& p, Geometry* geo, double cutoff,
+                            double* out = nullptr, double outScale = 1.0){
+            return simd::ewald_short()(x, y, z, q, idx, n, skip, p.data(), nullptr, geo->d.data(), geo->dh.data(), geo->periodic, alpha, cutoff,
+                                       out, outScale);
+        }
+
+        //As batch, minus the same sum seen from the image point img, in one pass over the partners
+        inline double batch_img(const double* x, const double* y, const double* z, const double* q, const unsigned int* idx,
+                                unsigned int n, unsigned int skip, const Eigen::Vector3d& p, const Eigen::Vector3d& img,
+                                Geometry* geo, double cutoff){
+            return simd::ewald_short()(x, y, z, q, idx, n, skip, p.data(), img.data(), geo->d.data(), geo->dh.data(), geo->periodic,
+                                       alpha, cutoff, nullptr, 1.0);
+        }
     };
 
 
@@ -348,12 +497,87 @@ namespace EwaldLike{
 
 
 
-    class LongTruncated{
+    /*
+        Reciprocal space structure factors with trial-and-commit updates. update() writes the
+        change of a trial move into drkVec (and dSelf) and the energy is evaluated on rkVec + drkVec.
+        commit() folds the change in when the move is accepted, discard() drops it when rejected,
+        so rejected moves do not need a second k-vector sweep to undo the update.
+    */
+    class Reciprocal{
+        protected:
+        std::vector< std::complex<double> > rkVec, drkVec;
+        double selfTerm = 0.0, dSelf = 0.0;
+        bool pending = false;
+
+        std::vector< Eigen::Vector3i > kIdx;                   //Integer wave numbers of each k-vector
+        std::vector< std::complex<double> > eikx, eiky, eikz;  //Per axis e^{i 2pi n x / L}, n = -kM..kM
+
+        //e^{i 2pi n x / L} for n = -m..m (stored at n + m) by repeated multiplication instead of sin/cos for each n
+        inline void axis_powers(double x, double L, int m, std::vector< std::complex<double> >& e){
+            double theta = 2.0 * constants::PI * x / L;
+            std::complex<double> e1(std::cos(theta), std::sin(theta));
+
+            e.resize(2 * m + 1);
+            e[m] = 1.0;
+            for(int n = 1; n <= m; n++){
+                e[m + n] = e[m + n - 1] * e1;
+                e[m - n] = std::conj(e[m + n]);
+            }
+        }
+
+        inline void set_powers(const Eigen::Vector3d& pos, double xb, double yb, double zb){
+            this->axis_powers(pos[0], xb, kM[0], this->eikx);
+            this->axis_powers(pos[1], yb, kM[1], this->eiky);
+            this->axis_powers(pos[2], zb, kM[2], this->eikz);
+        }
+
+        //e^{ik.r} of k-vector k at the position given to set_powers
+        inline std::complex<double> eikr(unsigned int k){
+            return this->eikx[this->kIdx[k][0] + kM[0]] * this->eiky[this->kIdx[k][1] + kM[1]] * this->eikz[this->kIdx[k][2] + kM[2]];
+        }
+
+        //Start a new trial
+        inline void begin(){
+            this->drkVec.assign(this->rkVec.size(), 0.0);
+            this->dSelf = 0.0;
+            this->pending = true;
+        }
+
+        inline std::complex<double> rho(unsigned int k){
+            return (this->pending) ? this->rkVec[k] + this->drkVec[k] : this->rkVec[k];
+        }
+
+        inline double self(){
+            return this->selfTerm + this->dSelf;
+        }
+
+        public:
+
+        void commit(){
+            if(!this->pending) return;
+            for(unsigned int k = 0; k < this->rkVec.size(); k++){
+                this->rkVec[k] += this->drkVec[k];
+            }
+            this->selfTerm += this->dSelf;
+            this->discard();
+        }
+
+        void discard(){
+            this->dSelf = 0.0;
+            this->pending = false;
+        }
+    };
+
+
+
+
+
+
+    class LongTruncated : public Reciprocal{
         private:
-        std::vector<double> resFac, kNorm;
+        std::vector<double> resFac, kNorm, akFac;     //akFac = Re(Ak) / k^2, only depends on |k|, R and alpha
         std::vector< Eigen::Vector3d > kVec;
-        std::vector< std::complex<double> > rkVec;
-        double volume, selfTerm = 0.0, xb, yb, zb;
+        double volume, xb, yb, zb, selfFac = 0.0;
 
         public:
 
@@ -372,6 +596,13 @@ namespace EwaldLike{
             printf("Setting up truncated ewald\n");
             printf("\tWavevectors in x, y, z: %i, %i, %i\n", kM[0], kM[1], kM[2]);
 
+            this->kVec.clear();
+            this->kIdx.clear();
+            this->resFac.clear();
+            this->kNorm.clear();
+            this->akFac.clear();
+            this->selfTerm = 0.0;
+
             //get k-vectors
             double factor = 1;
             Eigen::Vector3d vec;
@@ -396,11 +627,13 @@ namespace EwaldLike{
                             if(spherical){
                                 if(kx * kx + ky * ky + kz * kz < kMax * kMax){
                                     this->kVec.push_back(vec);
+                                    this->kIdx.push_back(Eigen::Vector3i(kx, ky, kz));
                                     this->resFac.push_back(factor * std::exp(-k2 / (4.0 * alpha * alpha)) / k2);
                                 }
                             }
                             else{
                                 this->kVec.push_back(vec);
+                                this->kIdx.push_back(Eigen::Vector3i(kx, ky, kz));
                                 this->resFac.push_back(factor * std::exp(-k2 / (4.0 * alpha * alpha)) / k2);
                             }
                         }
@@ -415,28 +648,33 @@ namespace EwaldLike{
                 this->kNorm.push_back(math::norm(kVec[i]));
             }
 
-            std::complex<double> rho;
-            std::complex<double> rk;
-            std::complex<double> charge;
-
+            //Tabulate the truncated reciprocal coefficients
+            std::complex<double> _Ak;
             for(unsigned int k = 0; k < kVec.size(); k++){
-                rho = 0;
-                for(unsigned int i = 0; i < particles.tot; i++){
-                    rk.imag(std::sin(math::dot(particles[i]->pos, kVec[k])));
-                    rk.real(std::cos(math::dot(particles[i]->pos, kVec[k])));
-                    charge = particles[i]->q;
-                    rk = rk * charge;
-                    rho += rk;
+                _Ak = Ak(k);
+                if(std::fabs(_Ak.imag()) > 1E-12){
+                    printf("Imaginary is too large! \n");
+                    printf("%lf\n", std::fabs(_Ak.imag()));
+                    exit(0);
                 }
-                this->rkVec.push_back(rho);
+                this->akFac.push_back(_Ak.real() / (kNorm[k] * kNorm[k]));
             }
 
+            this->rkVec.assign(kVec.size(), 0.0);
             for(unsigned int i = 0; i < particles.tot; i++){
-                this->selfTerm += particles[i]->q * particles[i]->q;
+                this->set_powers(particles.pos(i), this->xb, this->yb, this->zb);
+                for(unsigned int k = 0; k < kVec.size(); k++){
+                    this->rkVec[k] += this->eikr(k) * particles.qs[i];
+                }
+            }
+
+            for(unsigned int i = 0; i < particles.tot; i++){
+                this->selfTerm += particles.qs[i] * particles.qs[i];
             }
             //this->selfTerm *= std::sqrt(2.0) * (1.0 -  std::exp(-R*R / (2.0 * alpha * alpha)));
-            this->selfTerm *= 1.0 / (std::sqrt(2.0) * alpha) / sqrt(constants::PI) * (1.0 - std::exp(-eta * eta));
-            this->selfTerm /= 1.0 - math::erfc_x(eta) - 2.0 * eta / std::sqrt(constants::PI) * std::exp(-eta * eta);
+            this->selfFac = 1.0 / (std::sqrt(2.0) * alpha) / sqrt(constants::PI) * (1.0 - std::exp(-eta * eta));
+            this->selfFac /= 1.0 - math::erfc_x(eta) - 2.0 * eta / std::sqrt(constants::PI) * std::exp(-eta * eta);
+            this->selfTerm *= this->selfFac;
             //this->selfTerm /= (1.0 - math::erfc_x(R / (std::sqrt(2.0) * alpha)) - std::sqrt(2.0) * R * std::exp(-R*R / (2.0 * alpha * alpha)) / (std::sqrt(constants::PI) * alpha)) * (std::sqrt(constants::PI) * alpha) * 2.0;
             //this->selfTerm *= alpha / sqrt(constants::PI);
             printf("\tEwald initialization Complete\n");
@@ -503,43 +741,36 @@ namespace EwaldLike{
 
 
 
-        inline void update(std::vector< std::shared_ptr<Particle> >& _old, std::vector< std::shared_ptr<Particle> >& _new){
-            std::complex<double> rk_new;
-            std::complex<double> rk_old;
+        inline void update(const std::vector< std::shared_ptr<Particle> >& _old, const std::vector< std::shared_ptr<Particle> >& _new){
+            this->begin();
 
             if(_old.empty()){
                 for(auto n : _new){
-                    this->selfTerm += n->q * n->q * alpha / std::sqrt(constants::PI);
+                    this->dSelf += n->q * n->q * this->selfFac;
                 }
             }
             else{
                 for(auto o : _old){
+                    this->set_powers(o->pos, this->xb, this->yb, this->zb);
 
-                    #pragma omp parallel for private(rk_new, rk_old) if(kM[0] > 8)
+                    #pragma omp parallel for if(kM[0] > 8)
                     for(unsigned int k = 0; k < kVec.size(); k++){
-                        double dot = o->pos.dot(this->kVec[k]);//math::dot(o->pos, this->kVec[k]);
-                        rk_old.imag(std::sin(dot));
-                        rk_old.real(std::cos(dot));
-
-                        this->rkVec[k] -= rk_old * o->q;
+                        this->drkVec[k] -= this->eikr(k) * o->q;
                     }
                 }
             }
             if(_new.empty()){
                 for(auto o : _old){
-                    this->selfTerm -= o->q * o->q * alpha / std::sqrt(constants::PI);
+                    this->dSelf -= o->q * o->q * this->selfFac;
                 }
             }
             else{
                 for(auto n : _new){
+                    this->set_powers(n->pos, this->xb, this->yb, this->zb);
 
-                    #pragma omp parallel for private(rk_new, rk_old) if(kM[0] > 8)
+                    #pragma omp parallel for if(kM[0] > 8)
                     for(unsigned int k = 0; k < kVec.size(); k++){
-                        double dot = n->pos.dot(this->kVec[k]);//math::dot(n->pos, this->kVec[k]);
-                        rk_new.imag(std::sin(dot));
-                        rk_new.real(std::cos(dot));
-
-                        this->rkVec[k] += rk_new * n->q;
+                        this->drkVec[k] += this->eikr(k) * n->q;
                     }
                 }
             }
@@ -550,18 +781,11 @@ namespace EwaldLike{
             double energy = 0.0;
 
             //#pragma omp parallel for reduction(+:energy)
-            std::complex<double> _Ak;
             for(unsigned int k = 0; k < this->kVec.size(); k++){
-                    _Ak = Ak(k);
-                    energy += std::norm(this->rkVec[k]) * _Ak.real() * 1.0 / (kNorm[k] * kNorm[k]);//this->resFac[k];
-                    if(std::fabs(_Ak.imag()) > 1E-12){
-                        printf("Imaginary is too large! \n");
-                        printf("%lf\n", std::fabs(_Ak.imag()));
-                        exit(0);
-                    }
+                    energy += std::norm(this->rho(k)) * this->akFac[k];
             }
             //printf("Reciprocal term: %.15lf selfterm: %.15lf\n", energy * 2.0 * constants::PI / this->volume, this->selfTerm);
-            return energy * 2.0 * constants::PI / this->volume - this->selfTerm;
+            return energy * 2.0 * constants::PI / this->volume - this->self();
         } 
     };
 
@@ -582,12 +806,22 @@ namespace EwaldLike{
 
 
     //In GC ewald should only return reciprocal part in previous state
-    class Long{
+    class Long : public Reciprocal{
         private:
         std::vector<double> resFac, kNorm;
         std::vector< Eigen::Vector3d > kVec;
-        std::vector< std::complex<double> > rkVec;
-        double volume, selfTerm, xb, yb, zb;
+        double volume, xb, yb, zb;
+
+        //Accepted state kept during a volume trial
+        bool volumePending = false;
+        std::vector<double> savedResFac, savedKNorm;
+        std::vector< Eigen::Vector3d > savedKVec;
+        std::vector< std::complex<double> > savedRk;
+        double savedBox[3];
+        std::vector< std::complex<double> > dNew[3], dOld[3];     //Per axis powers of qDisp in the new and old box
+
+        //sum resFac |rho|^2 of the accepted state and of the last trial (-1 if not known) and sum resFac, for min_change
+        double norm = -1.0, trialNorm = -1.0, resSum = 0.0, savedResSum = 0.0;
 
         public:
 
@@ -601,6 +835,7 @@ namespace EwaldLike{
 
         void set_kvectors(){
             this->kVec.clear();
+            this->kIdx.clear();
             this->resFac.clear();
             this->kNorm.clear();
 
@@ -632,12 +867,14 @@ namespace EwaldLike{
                             if(spherical){
                                 if(kx * kx + ky * ky + kz * kz < kMax * kMax){
                                     this->kVec.push_back(vec);
+                                    this->kIdx.push_back(Eigen::Vector3i(kx, ky, kz));
                                     this->resFac.push_back(factor * std::exp(-k2 / (4.0 * alpha * alpha)) / k2);
                                 }
                             }
 
                             else{
                                 this->kVec.push_back(vec);
+                                this->kIdx.push_back(Eigen::Vector3i(kx, ky, kz));
                                 this->resFac.push_back(factor * std::exp(-k2 / (4.0 * alpha * alpha)) / k2);
                             }
                         }
@@ -651,13 +888,14 @@ namespace EwaldLike{
             for(unsigned int i = 0; i < kVec.size(); i++){
                 this->kNorm.push_back(math::norm(kVec[i]));
             }
+            this->resSum = std::accumulate(this->resFac.begin(), this->resFac.end(), 0.0);
         }
 
         void set_self(Particles &particles){
             this->selfTerm = 0.0;
 
             for(unsigned int i = 0; i < particles.tot; i++){
-                this->selfTerm += particles[i]->q * particles[i]->q;
+                this->selfTerm += particles.qs[i] * particles.qs[i];
             }
             this->selfTerm *= alpha / sqrt(constants::PI);
         }
@@ -666,64 +904,114 @@ namespace EwaldLike{
         void initialize(Particles &particles){
             set_kvectors();
             set_self(particles);
+            this->norm = this->trialNorm = -1.0;
             this->rkVec.clear();
 
-            std::complex<double> rho;
-            std::complex<double> rk;
-            std::complex<double> charge;
-
-            //#pragma omp parallel for private(rk_new, rk_old)
-            for(unsigned int k = 0; k < kVec.size(); k++){
-                rho = 0;
-                for(unsigned int i = 0; i < particles.tot; i++){
-                    rk.imag(std::sin(math::dot(particles[i]->pos, kVec[k])));
-                    rk.real(std::cos(math::dot(particles[i]->pos, kVec[k])));
-                    charge = particles[i]->q;
-                    rk = rk * charge;
-                    rho += rk;
+            this->rkVec.assign(kVec.size(), 0.0);
+            for(unsigned int i = 0; i < particles.tot; i++){
+                this->set_powers(particles.pos(i), this->xb, this->yb, this->zb);
+                for(unsigned int k = 0; k < kVec.size(); k++){
+                    this->rkVec[k] += this->eikr(k) * particles.qs[i];
                 }
-                this->rkVec.push_back(rho);
             }
             //printf("\tEwald initialization Complete\n");
         }
 
-        inline void update(std::vector< std::shared_ptr<Particle> >& _old, std::vector< std::shared_ptr<Particle> >& _new){
-            std::complex<double> rk_new;
-            std::complex<double> rk_old;
+        /*
+            Volume trial to a box x, y, z with the centers of mass scaled affinely. The integer
+            wavevectors are kept so k.com does not change and only the charges displaced from
+            their center of mass (qDisp) change the structure factors. The accepted state is kept
+            so that discard() restores it without any recomputation.
+        */
+        void rescale(double x, double y, double z, Particles &particles){
+            Reciprocal::discard();
+
+            this->savedBox[0] = this->xb;
+            this->savedBox[1] = this->yb;
+            this->savedBox[2] = this->zb;
+            std::swap(this->kVec, this->savedKVec);
+            std::swap(this->resFac, this->savedResFac);
+            std::swap(this->kNorm, this->savedKNorm);
+            this->savedRk = this->rkVec;
+            this->savedResSum = this->resSum;
+            this->trialNorm = -1.0;
+            this->volumePending = true;
+
+            this->set_box(x, y, z);
+            this->set_kvectors();
+
+            //rho_k += q e^{ik.com} (e^{ik.qDisp} - e^{ik_old.qDisp})
+            double L[3] = {x, y, z};
+            for(unsigned int i = 0; i < particles.tot; i++){
+                //pos is wrapped on its own, so take the displacement from the particle rather than pos - com
+                const Eigen::Vector3d& qDisp = particles[i]->qDisp;
+                if(qDisp.squaredNorm() < 1e-24) continue;
+
+                this->set_powers(particles.com(i), this->xb, this->yb, this->zb);
+                for(int d = 0; d < 3; d++){
+                    this->axis_powers(qDisp[d], L[d], kM[d], this->dNew[d]);
+                    this->axis_powers(qDisp[d], this->savedBox[d], kM[d], this->dOld[d]);
+                }
+
+                for(unsigned int k = 0; k < this->kVec.size(); k++){
+                    int a = this->kIdx[k][0] + kM[0], b = this->kIdx[k][1] + kM[1], c = this->kIdx[k][2] + kM[2];
+                    std::complex<double> diff = this->dNew[0][a] * this->dNew[1][b] * this->dNew[2][c] - 
+                                                this->dOld[0][a] * this->dOld[1][b] * this->dOld[2][c];
+                    this->rkVec[k] += particles.qs[i] * this->eikr(k) * diff;
+                }
+            }
+        }
+
+        void commit(){
+            if(this->pending || this->volumePending) this->norm = this->trialNorm;
+            this->volumePending = false;
+            Reciprocal::commit();
+        }
+
+        void discard(){
+            if(this->volumePending){
+                this->set_box(this->savedBox[0], this->savedBox[1], this->savedBox[2]);
+                std::swap(this->kVec, this->savedKVec);
+                std::swap(this->resFac, this->savedResFac);
+                std::swap(this->kNorm, this->savedKNorm);
+                std::swap(this->rkVec, this->savedRk);
+                this->resSum = this->savedResSum;
+                this->volumePending = false;
+            }
+            Reciprocal::discard();
+        }
+
+        inline void update(const std::vector< std::shared_ptr<Particle> >& _old, const std::vector< std::shared_ptr<Particle> >& _new){
+            this->begin();
+            this->trialNorm = -1.0;
 
             if(_old.empty()){
                 for(auto n : _new){
-                    this->selfTerm += n->q * n->q * alpha / std::sqrt(constants::PI);
+                    this->dSelf += n->q * n->q * alpha / std::sqrt(constants::PI);
                 }
             }
             else{
                 for(auto o : _old){
+                    this->set_powers(o->pos, this->xb, this->yb, this->zb);
 
-                    #pragma omp parallel for private(rk_new, rk_old) if(kM[0] > 8)
+                    #pragma omp parallel for if(kM[0] > 8)
                     for(unsigned int k = 0; k < kVec.size(); k++){
-                        double dot = o->pos.dot(this->kVec[k]);//math::dot(o->pos, this->kVec[k]);
-                        rk_old.imag(std::sin(dot));
-                        rk_old.real(std::cos(dot));
-
-                        this->rkVec[k] -= rk_old * o->q;
+                        this->drkVec[k] -= this->eikr(k) * o->q;
                     }
                 }
             }
             if(_new.empty()){
                 for(auto o : _old){
-                    this->selfTerm -= o->q * o->q * alpha / std::sqrt(constants::PI);
+                    this->dSelf -= o->q * o->q * alpha / std::sqrt(constants::PI);
                 }
             }
             else{
                 for(auto n : _new){
+                    this->set_powers(n->pos, this->xb, this->yb, this->zb);
 
-                    #pragma omp parallel for private(rk_new, rk_old) if(kM[0] > 8)
+                    #pragma omp parallel for if(kM[0] > 8)
                     for(unsigned int k = 0; k < kVec.size(); k++){
-                        double dot = n->pos.dot(this->kVec[k]);//math::dot(n->pos, this->kVec[k]);
-                        rk_new.imag(std::sin(dot));
-                        rk_new.real(std::cos(dot));
-
-                        this->rkVec[k] += rk_new * n->q;
+                        this->drkVec[k] += this->eikr(k) * n->q;
                     }
                 }
             }
@@ -735,11 +1023,22 @@ namespace EwaldLike{
 
             #pragma omp parallel for reduction(+:energy)
             for(unsigned int k = 0; k < this->kVec.size(); k++){
-                    energy += std::norm(this->rkVec[k]) * this->resFac[k];
+                    energy += std::norm(this->rho(k)) * this->resFac[k];
             }
+            (this->pending || this->volumePending) ? this->trialNorm = energy : this->norm = energy;
             //printf("Reciprocal term: %.15lf selfterm: %.15lf\n", energy * 2.0 * constants::PI / (this->volume), this->selfTerm);
-            return energy * 2.0 * constants::PI / (this->volume) - this->selfTerm;
+            return energy * 2.0 * constants::PI / (this->volume) - this->self();
         } 
+
+        /*
+            Lower bound on the energy change of a trial that moves charges with sum |q| = Q without
+            changing them. Each structure factor changes by at most 2 Q, so by Cauchy-Schwarz
+            sum resFac (|rho + d|^2 - |rho|^2) >= -4 Q sqrt(sum resFac |rho|^2 sum resFac).
+        */
+        double min_change(double Q){
+            if(this->norm < 0.0 || this->volumePending) return -std::numeric_limits<double>::infinity();
+            return -4.0 * Q * std::sqrt(this->norm * this->resSum) * 2.0 * constants::PI / this->volume;
+        }
     };
 
 
@@ -755,12 +1054,24 @@ namespace EwaldLike{
 
 
 
-    class LongHWIPBC{
+    class LongHWIPBC : public Reciprocal{
         private:
         std::vector<double> resFac, kNorm;
         std::vector< Eigen::Vector3d > kVec;
-        std::vector< std::complex<double> > rkVec;
-        double volume, selfTerm = 0.0, xb, yb, zb;
+        double volume, xb, yb, zb;
+        std::vector< std::complex<double> > eikzImg;
+
+        //Tables of a charge at pos and of its mirror image, which shares x and y
+        inline void set_image_powers(const Eigen::Vector3d& pos){
+            this->set_powers(pos, this->xb, this->yb, this->zb);
+            this->axis_powers(math::sgn(pos[2]) * this->zb / 2.0 - pos[2], this->zb, kM[2], this->eikzImg);
+        }
+
+        //Structure factor term of a unit charge and its (negative) image
+        inline std::complex<double> sk(unsigned int k){
+            double cosXY = this->eikx[this->kIdx[k][0] + kM[0]].real() * this->eiky[this->kIdx[k][1] + kM[1]].real();
+            return cosXY * std::conj(this->eikz[this->kIdx[k][2] + kM[2]] - this->eikzImg[this->kIdx[k][2] + kM[2]]);
+        }
 
         public:
         
@@ -804,6 +1115,7 @@ namespace EwaldLike{
 
                         if(fabs(k2) > 1e-8){// && fabs(k2) < kMax) {
                             this->kVec.push_back(vec);
+                            this->kIdx.push_back(Eigen::Vector3i(kx, ky, kz));
                             this->resFac.push_back(factor * std::exp(-k2 / (4.0 * alpha * alpha)) / k2);
                         }
                     }
@@ -817,98 +1129,47 @@ namespace EwaldLike{
                 this->kNorm.push_back(math::norm(kVec[i]));
             }
 
-            std::complex<double> rho;
-            std::complex<double> rk;
-            std::complex<double> charge;
-            Eigen::Vector3d temp;
-
-            for(unsigned int k = 0; k < kVec.size(); k++){
-                rho = 0.0;
-                for(unsigned int i = 0; i < particles.tot; i++){
-                    
-                    double cosXY = std::cos(particles[i]->pos[0] * kVec[k][0]) * std::cos(particles[i]->pos[1] * kVec[k][1]);
-                    rk.imag(-cosXY * std::sin(particles[i]->pos[2] * kVec[k][2]));
-                    rk.real(cosXY * std::cos(particles[i]->pos[2] * kVec[k][2]));
-                    charge = particles[i]->q;
-                    rk *= charge;
-                    rho += rk;
-
-                    //Mirror images
-                    temp = particles[i]->pos;
-                    temp[2] = math::sgn(temp[2]) * this->zb / 2.0 - temp[2]; 
-                    cosXY = std::cos(temp[0] * kVec[k][0]) * std::cos(temp[1] * kVec[k][1]);
-                    rk.imag(-cosXY * std::sin(temp[2] * kVec[k][2]));
-                    rk.real(cosXY * std::cos(temp[2] * kVec[k][2]));
-                    charge = -particles[i]->q;
-                    rk *= charge;
-                    rho += rk;
+            this->rkVec.assign(kVec.size(), 0.0);
+            for(unsigned int i = 0; i < particles.tot; i++){
+                this->set_image_powers(particles.pos(i));
+                for(unsigned int k = 0; k < kVec.size(); k++){
+                    this->rkVec[k] += this->sk(k) * particles.qs[i];
                 }
-                this->rkVec.push_back(rho);
             }
 
             for(unsigned int i = 0; i < particles.tot; i++){
-                this->selfTerm += particles[i]->q * particles[i]->q;
+                this->selfTerm += particles.qs[i] * particles.qs[i];
             }
 
             this->selfTerm *= alpha / sqrt(constants::PI); //   *2.0 due to images
             printf("\tEwald initialization Complete\n");
         }
 
-        inline void update(std::vector< std::shared_ptr<Particle> >& _old, std::vector< std::shared_ptr<Particle> >& _new){
-            std::complex<double> rk_new;
-            std::complex<double> rk_old;
-            std::complex<double> charge;
-            Eigen::Vector3d temp;
-
+        inline void update(const std::vector< std::shared_ptr<Particle> >& _old, const std::vector< std::shared_ptr<Particle> >& _new){
+            this->begin();
             if(_old.empty()){
                 for(auto n : _new){
-                    this->selfTerm += n->q * n->q * alpha / sqrt(constants::PI);
+                    this->dSelf += n->q * n->q * alpha / sqrt(constants::PI);
                 }
             }
             else{
                 for(auto o : _old){
-                    //#pragma omp parallel for private(rk_new, rk_old)
+                    this->set_image_powers(o->pos);
                     for(unsigned int k = 0; k < kVec.size(); k++){
-                        double cosXY = std::cos(o->pos[0] * kVec[k][0]) * std::cos(o->pos[1] * kVec[k][1]);
-                        rk_old.imag(-cosXY * std::sin(o->pos[2] * kVec[k][2]));
-                        rk_old.real(cosXY * std::cos(o->pos[2] * kVec[k][2]));
-                        charge = o->q;
-                        this->rkVec[k] -= rk_old * charge;
-
-                        // Remove image
-                        temp = o->pos;
-                        temp[2] = math::sgn(temp[2]) * this->zb / 2.0 - temp[2]; 
-                        cosXY = std::cos(temp[0] * kVec[k][0]) * std::cos(temp[1] * kVec[k][1]);
-                        rk_old.imag(-cosXY * std::sin(temp[2] * kVec[k][2]));
-                        rk_old.real(cosXY * std::cos(temp[2] * kVec[k][2]));
-                        charge = -o->q;
-                        this->rkVec[k] -= rk_old * charge;
+                        this->drkVec[k] -= this->sk(k) * o->q;
                     }
                 }
             }
             if(_new.empty()){
                 for(auto o : _old){
-                    this->selfTerm -= o->q * o->q * alpha / sqrt(constants::PI);
+                    this->dSelf -= o->q * o->q * alpha / sqrt(constants::PI);
                 }
             }
             else{
                 for(auto n : _new){
-                    //#pragma omp parallel for private(rk_new, rk_old)
+                    this->set_image_powers(n->pos);
                     for(unsigned int k = 0; k < kVec.size(); k++){
-                        double cosXY = std::cos(n->pos[0] * kVec[k][0]) * std::cos(n->pos[1] * kVec[k][1]);
-                        rk_new.imag(-cosXY * std::sin(n->pos[2] * kVec[k][2]));
-                        rk_new.real(cosXY * std::cos(n->pos[2] * kVec[k][2]));
-                        charge = n->q;
-                        this->rkVec[k] += rk_new * charge;
-
-                        // Add image
-                        temp = n->pos;
-                        temp[2] = math::sgn(temp[2]) * this->zb / 2.0 - temp[2]; 
-                        cosXY = std::cos(temp[0] * kVec[k][0]) * std::cos(temp[1] * kVec[k][1]);
-                        rk_new.imag(-cosXY * std::sin(temp[2] * kVec[k][2]));
-                        rk_new.real(cosXY * std::cos(temp[2] * kVec[k][2]));
-                        charge = -n->q;
-                        this->rkVec[k] += rk_new * charge;
+                        this->drkVec[k] += this->sk(k) * n->q;
                     }
                 }
             }
@@ -920,10 +1181,10 @@ namespace EwaldLike{
 
             //#pragma omp parallel for reduction(+:energy)
             for(unsigned int k = 0; k < this->kVec.size(); k++){
-                    energy += std::norm(this->rkVec[k]) * this->resFac[k];
+                    energy += std::norm(this->rho(k)) * this->resFac[k];
             }
             
-            return energy * constants::PI / (this->volume) - this->selfTerm;
+            return energy * constants::PI / (this->volume) - this->self();
         } 
     };
 
@@ -945,12 +1206,24 @@ namespace EwaldLike{
 
 
 
-    class LongHW{
+    class LongHW : public Reciprocal{
         private:
         std::vector<double> resFac, kNorm;
         std::vector< Eigen::Vector3d > kVec;
-        std::vector< std::complex<double> > rkVec;
-        double volume, selfTerm, xb, yb, zb;
+        double volume, xb, yb, zb;
+        std::vector< std::complex<double> > eikzImg;
+
+        //Tables of a charge at pos and of its mirror image, which shares x and y
+        inline void set_image_powers(const Eigen::Vector3d& pos){
+            this->set_powers(pos, this->xb, this->yb, this->zb);
+            this->axis_powers(math::sgn(pos[2]) * this->zb / 2.0 - pos[2], this->zb, kM[2], this->eikzImg);
+        }
+
+        //Structure factor term of a unit charge and its (negative) image
+        inline std::complex<double> sk(unsigned int k){
+            return this->eikx[this->kIdx[k][0] + kM[0]] * this->eiky[this->kIdx[k][1] + kM[1]] * 
+                   (this->eikz[this->kIdx[k][2] + kM[2]] - this->eikzImg[this->kIdx[k][2] + kM[2]]);
+        }
 
         public:
  
@@ -970,6 +1243,7 @@ namespace EwaldLike{
             printf("\tWavevectors in x, y, z: %i, %i, %i\n", kM[0], kM[1], kM[2]);
 
             this->kVec.clear();
+            this->kIdx.clear();
             this->resFac.clear();
             this->kNorm.clear();
             this->rkVec.clear();
@@ -1000,6 +1274,7 @@ namespace EwaldLike{
 
                         if(fabs(k2) > 1e-8){// && fabs(k2) < kMax) {
                             this->kVec.push_back(vec);
+                            this->kIdx.push_back(Eigen::Vector3i(kx, ky, kz));
                             this->resFac.push_back(factor * std::exp(-k2 / (4.0 * alpha * alpha)) / k2);
                         }
                     }
@@ -1013,36 +1288,18 @@ namespace EwaldLike{
                 this->kNorm.push_back(math::norm(kVec[i]));
             }
 
-            std::complex<double> rho;
-            std::complex<double> rk;
-            std::complex<double> charge;
-            Eigen::Vector3d temp;
-
-            for(unsigned int k = 0; k < kVec.size(); k++){
-                rho = 0.0;
-                for(unsigned int i = 0; i < particles.tot; i++){
-                    rk.imag(std::sin(math::dot(particles[i]->pos, kVec[k])));
-                    rk.real(std::cos(math::dot(particles[i]->pos, kVec[k])));
-                    charge = particles[i]->q;
-                    rk *= charge;
-                    rho += rk;
-
-                    //Mirror images
-                    temp = particles[i]->pos;
-                    temp[2] = math::sgn(temp[2]) * this->zb / 2.0 - temp[2]; 
-                    rk.imag(std::sin(math::dot(temp, kVec[k])));
-                    rk.real(std::cos(math::dot(temp, kVec[k])));
-                    charge = -particles[i]->q;
-                    rk *= charge;
-                    rho += rk;
+            this->rkVec.assign(kVec.size(), 0.0);
+            for(unsigned int i = 0; i < particles.tot; i++){
+                this->set_image_powers(particles.pos(i));
+                for(unsigned int k = 0; k < kVec.size(); k++){
+                    this->rkVec[k] += this->sk(k) * particles.qs[i];
                 }
-                this->rkVec.push_back(rho);
             }
 
             
 
             for(unsigned int i = 0; i < particles.tot; i++){
-                this->selfTerm += particles[i]->q * particles[i]->q;
+                this->selfTerm += particles.qs[i] * particles.qs[i];
             }
 
             this->selfTerm *= alpha / std::sqrt(constants::PI); //   *2.0 due to images
@@ -1050,62 +1307,35 @@ namespace EwaldLike{
             printf("\tEwald initialization Complete\n");
         }
 
-        inline void update(std::vector< std::shared_ptr<Particle> >& _old, std::vector< std::shared_ptr<Particle> >& _new){
-            std::complex<double> rk_new;
-            std::complex<double> rk_old;
-            Eigen::Vector3d temp;
-
+        inline void update(const std::vector< std::shared_ptr<Particle> >& _old, const std::vector< std::shared_ptr<Particle> >& _new){
+            this->begin();
             if(_old.empty()){
                 for(auto n : _new){
-                    this->selfTerm += n->q * n->q * alpha / std::sqrt(constants::PI);
+                    this->dSelf += n->q * n->q * alpha / std::sqrt(constants::PI);
                 }
             }
             else{
                 for(auto o : _old){
-                    temp = o->pos;
-                    temp[2] = math::sgn(temp[2]) * this->zb / 2.0 - temp[2]; 
+                    this->set_image_powers(o->pos);
 
-                    #pragma omp parallel for private(rk_new, rk_old) if(kM[0] > 6)
+                    #pragma omp parallel for if(kM[0] > 6)
                     for(unsigned int k = 0; k < kVec.size(); k++){
-                        double dot = o->pos.dot(this->kVec[k]);
-                        rk_old.imag(std::sin(dot));
-                        rk_old.real(std::cos(dot));
-
-                        this->rkVec[k] -= rk_old * o->q;
-
-                        // Remove image
-                        dot = temp.dot(this->kVec[k]);
-                        rk_old.imag(std::sin(dot));
-                        rk_old.real(std::cos(dot));
-
-                        this->rkVec[k] -= rk_old * (-o->q);
+                        this->drkVec[k] -= this->sk(k) * o->q;
                     }
                 }
             }
             if(_new.empty()){
                 for(auto o : _old){
-                    this->selfTerm -= o->q * o->q * alpha / std::sqrt(constants::PI);
+                    this->dSelf -= o->q * o->q * alpha / std::sqrt(constants::PI);
                 }
             }
             else{
                 for(auto n : _new){
-                    temp = n->pos;
-                    temp[2] = math::sgn(temp[2]) * this->zb / 2.0 - temp[2]; 
+                    this->set_image_powers(n->pos);
 
-                    #pragma omp parallel for private(rk_new, rk_old) if(kM[0] > 6)
+                    #pragma omp parallel for if(kM[0] > 6)
                     for(unsigned int k = 0; k < kVec.size(); k++){
-                        double dot = n->pos.dot(this->kVec[k]);
-                        rk_new.imag(std::sin(dot));
-                        rk_new.real(std::cos(dot));
-
-                        this->rkVec[k] += rk_new * n->q;
-
-                        // Add image
-                        dot = temp.dot(this->kVec[k]);
-                        rk_new.imag(std::sin(dot));
-                        rk_new.real(std::cos(dot));
-
-                        this->rkVec[k] += rk_new * (-n->q);
+                        this->drkVec[k] += this->sk(k) * n->q;
                     }
                 }
             }
@@ -1117,9 +1347,9 @@ namespace EwaldLike{
 
             #pragma omp parallel for reduction(+:energy) if(kM[0] > 8)
             for(unsigned int k = 0; k < this->kVec.size(); k++){
-                    energy += std::norm(this->rkVec[k]) * this->resFac[k];
+                    energy += std::norm(this->rho(k)) * this->resFac[k];
             }
-            return energy * constants::PI / (this->volume) - this->selfTerm;
+            return energy * constants::PI / (this->volume) - this->self();
         } 
     };
 
@@ -1135,12 +1365,11 @@ namespace EwaldLike{
 
 
 
-    class LongEllipsoidal{
+    class LongEllipsoidal : public Reciprocal{
         private:
         std::vector<double> resFac, kNorm;
         std::vector< Eigen::Vector3d > kVec;
-        std::vector< std::complex<double> > rkVec;
-        double volume, selfTerm = 0.0, xb, yb, zb;
+        double volume, xb, yb, zb;
 
         public:
 
@@ -1191,6 +1420,7 @@ namespace EwaldLike{
 
                         if(fabs(k2) > 1e-8){// && fabs(k2) < kMax) {
                             this->kVec.push_back(vec);
+                            this->kIdx.push_back(Eigen::Vector3i(kx, ky, kz));
                             this->resFac.push_back(factor * std::exp(-l2 / (4.0 * c0 * c0)) / k2);
                         }
                     }
@@ -1204,24 +1434,16 @@ namespace EwaldLike{
                 this->kNorm.push_back(math::norm(kVec[i]));
             }
 
-            std::complex<double> rho;
-            std::complex<double> rk;
-            std::complex<double> charge;
-
-            for(unsigned int k = 0; k < kVec.size(); k++){
-                rho = 0;
-                for(unsigned int i = 0; i < particles.tot; i++){
-                    rk.imag(std::sin(math::dot(particles[i]->pos, kVec[k])));
-                    rk.real(std::cos(math::dot(particles[i]->pos, kVec[k])));
-                    charge = particles[i]->q;
-                    rk = rk * charge;
-                    rho += rk;
+            this->rkVec.assign(kVec.size(), 0.0);
+            for(unsigned int i = 0; i < particles.tot; i++){
+                this->set_powers(particles.pos(i), this->xb, this->yb, this->zb);
+                for(unsigned int k = 0; k < kVec.size(); k++){
+                    this->rkVec[k] += this->eikr(k) * particles.qs[i];
                 }
-                this->rkVec.push_back(rho);
             }
 
             for(unsigned int i = 0; i < particles.tot; i++){
-                this->selfTerm += particles[i]->q * particles[i]->q;
+                this->selfTerm += particles.qs[i] * particles.qs[i];
             }
             //this->selfTerm *= alpha / sqrt(constants::PI);
 
@@ -1229,43 +1451,36 @@ namespace EwaldLike{
             printf("\tEwald initialization Complete\n");
         }
 
-        inline void update(std::vector< std::shared_ptr<Particle> >& _old, std::vector< std::shared_ptr<Particle> >& _new){
-            std::complex<double> rk_new;
-            std::complex<double> rk_old;
+        inline void update(const std::vector< std::shared_ptr<Particle> >& _old, const std::vector< std::shared_ptr<Particle> >& _new){
+            this->begin();
 
             if(_old.empty()){
                 for(auto n : _new){
-                    this->selfTerm += n->q * n->q * alpha / std::sqrt(constants::PI);
+                    this->dSelf += n->q * n->q * alpha / std::sqrt(constants::PI);
                 }
             }
             else{
                 for(auto o : _old){
+                    this->set_powers(o->pos, this->xb, this->yb, this->zb);
 
-                    #pragma omp parallel for private(rk_new, rk_old) if(kM[0] > 8)
+                    #pragma omp parallel for if(kM[0] > 8)
                     for(unsigned int k = 0; k < kVec.size(); k++){
-                        double dot = o->pos.dot(this->kVec[k]);//math::dot(o->pos, this->kVec[k]);
-                        rk_old.imag(std::sin(dot));
-                        rk_old.real(std::cos(dot));
-
-                        this->rkVec[k] -= rk_old * o->q;
+                        this->drkVec[k] -= this->eikr(k) * o->q;
                     }
                 }
             }
             if(_new.empty()){
                 for(auto o : _old){
-                    this->selfTerm -= o->q * o->q * alpha / std::sqrt(constants::PI);
+                    this->dSelf -= o->q * o->q * alpha / std::sqrt(constants::PI);
                 }
             }
             else{
                 for(auto n : _new){
+                    this->set_powers(n->pos, this->xb, this->yb, this->zb);
 
-                    #pragma omp parallel for private(rk_new, rk_old) if(kM[0] > 8)
+                    #pragma omp parallel for if(kM[0] > 8)
                     for(unsigned int k = 0; k < kVec.size(); k++){
-                        double dot = n->pos.dot(this->kVec[k]);//math::dot(n->pos, this->kVec[k]);
-                        rk_new.imag(std::sin(dot));
-                        rk_new.real(std::cos(dot));
-
-                        this->rkVec[k] += rk_new * n->q;
+                        this->drkVec[k] += this->eikr(k) * n->q;
                     }
                 }
             }
@@ -1277,134 +1492,142 @@ namespace EwaldLike{
 
             //#pragma omp parallel for reduction(+:energy)
             for(unsigned int k = 0; k < this->kVec.size(); k++){
-                    energy += std::norm(this->rkVec[k]) * this->resFac[k];
+                    energy += std::norm(this->rho(k)) * this->resFac[k];
             }
-            printf("Reciprocal term: %.15lf selfterm: %.15lf\n", energy * 2.0 * constants::PI / (this->volume), this->selfTerm);
-            return energy * 2.0 * constants::PI / (this->volume) - this->selfTerm;
+            printf("Reciprocal term: %.15lf selfterm: %.15lf\n", energy * 2.0 * constants::PI / (this->volume), this->self());
+            return energy * 2.0 * constants::PI / (this->volume) - this->self();
         } 
     };
-}
-
-
-
-
-
-
-
-
 
 
 
+    /*
+        Wall term of a slab between two grounded metal walls at z = -+zb / 4, zb the doubled box of
+        CuboidImg, for Long in the doubled box and a real space pair energy of the charges alone.
+        Long then sums the charges with replicas 2L apart, which are the positive images of the walls.
+        This term adds the slab dipole correction (Yeh & Berkowitz, with the charged system terms of
+        Ballenegger et al. 2009), so that the replicas only enter through k != 0 as in ELC, and the
+        negative images (Levin) from the 2D Fourier sums
 
+        F-(k) = sum q e^{ik.r} e^{-k(z + L/2)},   F+(k) = sum q e^{ik.r} e^{k(z - L/2)},
 
+        E = -2 pi / A sum_k (|F-|^2 + |F+|^2) / (k (1 - e^{-2kL})) + k = 0 terms,
 
+        over the half plane of k with |kx|, |ky| <= slabKM. The ELC term of the replicas and the cross
+        term of the images cancel for a box of exactly 2L. A move updates the sums in O(K).
+    */
+    class Levin : public Reciprocal{
+        private:
+        std::vector<double> kNorm, fac;
+        std::vector< std::complex<double> > fp, dfp;        //F+ and its change, F- is rkVec
+        double xb, yb, zb, L, area;
+        double M = 0.0, Q = 0.0, Z2 = 0.0;                  //sum q z, sum q and sum q z^2
+        double dM = 0.0, dQ = 0.0, dZ2 = 0.0;
+
+        inline void begin(){
+            Reciprocal::begin();
+            this->dfp.assign(this->fp.size(), 0.0);
+            this->dM = this->dQ = this->dZ2 = 0.0;
+        }
 
+        //Adds a charge to the pending change
+        inline void add(const Eigen::Vector3d& pos, double q){
+            this->axis_powers(pos[0], this->xb, slabKM, this->eikx);
+            this->axis_powers(pos[1], this->yb, slabKM, this->eiky);
 
+            for(unsigned int k = 0; k < this->kNorm.size(); k++){
+                std::complex<double> e = q * this->eikx[this->kIdx[k][0] + slabKM] * this->eiky[this->kIdx[k][1] + slabKM];
+                this->drkVec[k] += e * std::exp(-this->kNorm[k] * (pos[2] + this->L / 2.0));
+                this->dfp[k] += e * std::exp(this->kNorm[k] * (pos[2] - this->L / 2.0));
+            }
+            this->dM += q * pos[2];
+            this->dQ += q;
+            this->dZ2 += q * pos[2] * pos[2];
+        }
 
+        public:
 
+        void set_box(double x, double y, double z){
+            this->xb = x;
+            this->yb = y;
+            this->zb = z;
+            this->L = z / 2.0;
+            this->area = x * y;
+        }
 
+        void initialize(Particles &particles){
+            printf("Setting up metal slab correction\n");
+            printf("\tWavevectors in x, y: %i, %i\n", slabKM, slabKM);
 
-/*
-
-class Levin{
-
-    private:
-    double sumC, xb, yb, zb, volume, dipoleM;
-    std::vector<double> f1, f2, f3, f4, kNorms;
-    std::vector<int> kM;
-    std::vector< Eigen::Vector2d> kVec;
-
-    public:
-
-    void set_km(std::vector<int> v){
-        kM = v;
-    }
-
-    void set_box(double x, double y, double z){
-        this->xb = x;
-        this->yb = y;
-        this->zb = z;
-        this->volume = x * y * z;
-    }
-
-    void initialize(Particles &particles){
-        Eigen::Vector2d vec;
-
-        for(int x = -kM[0]; x <= kM[0]; x++){
-            for(int y = -kM[1]; y <= kM[1]; y++){
-                if(x != 0 || y != 0){
-                    vec[0] = (double) x;//(double) x * 2.0 * PI / Base::xL; // 
-                    vec[1] = (double) y;//(double) y * 2.0 * PI / Base::xL; // 
-                    kVec.push_back(vec);
-                    kNorms.push_back(2.0 * PI * sqrt((double)(x * x)/(Base::xL * Base::xL) + (double)(y * y)/(Base::yL * Base::yL)));
-
+            this->kIdx.clear();
+            this->kNorm.clear();
+            this->fac.clear();
+            for(int kx = 0; kx <= slabKM; kx++){
+                for(int ky = -slabKM; ky <= slabKM; ky++){
+                    if(kx == 0 && ky <= 0) continue;
+
+                    double k = 2.0 * constants::PI * std::sqrt(kx * kx / (this->xb * this->xb) + ky * ky / (this->yb * this->yb));
+                    this->kIdx.push_back(Eigen::Vector3i(kx, ky, 0));
+                    this->kNorm.push_back(k);
+                    this->fac.push_back(-2.0 * constants::PI / (this->area * k * (1.0 - std::exp(-2.0 * k * this->L))));
                 }
             }
-        }
-        printf("\tFound %lu k-vectors.\n", kVec.size());
 
-        double factor = 0;
-        for(int i = 0; i < kVec.size(); i++){
-            for(int j = 0; j < particles.tot; j++){
-                factor = 2.0 * constants::PI / Base::xL * (kVec[i][0] * particles[j]->pos[0] + kVec[i][1] * particles[j]->pos[1]);
-                double fac = kNorms[i] * (particles[j]->pos[2] + this->zb / 2.0);
-                f1[i] += particles[j]->q * std::cos(factor) * std::exp(-fac);
-                f2[i] += particles[j]->q * std::sin(factor) * std::exp(-fac);
-                f3[i] += particles[j]->q * std::cos(factor) * std::exp( fac);
-                f4[i] += particles[j]->q * std::sin(factor) * std::exp( fac);
-            }  
-        }
+            this->rkVec.assign(this->kNorm.size(), 0.0);
+            this->fp.assign(this->kNorm.size(), 0.0);
+            this->M = this->Q = this->Z2 = 0.0;
 
-        printf("Calculated f-functions\n");
-        for(int i = 0; i < kVec.size(); i++){
-            eFactors[i] = exp(-2.0 * kNorms[i] * Base::zLBox);
+            this->begin();
+            for(unsigned int i = 0; i < particles.tot; i++){
+                this->add(particles.pos(i), particles.qs[i]);
+            }
+            this->commit();
+            printf("\tFound: %lu k-vectors\n", this->kNorm.size());
         }
 
-        for(int i = 0; i < particles.tot; i++){
-            sumC += particles[i]->q;
+        inline void update(const std::vector< std::shared_ptr<Particle> >& _old, const std::vector< std::shared_ptr<Particle> >& _new){
+            this->begin();
+            for(auto o : _old){
+                this->add(o->pos, -o->q);
+            }
+            for(auto n : _new){
+                this->add(n->pos, n->q);
+            }
         }
 
-        for(int i = 0; i < particles.numOfParticles; i++){
-            dipoleM += particles[i].q * ( particles[i].pos[2] + this->zb / 2.0 );
+        void commit(){
+            if(!this->pending) return;
+            for(unsigned int k = 0; k < this->fp.size(); k++){
+                this->fp[k] += this->dfp[k];
+            }
+            this->M += this->dM;
+            this->Q += this->dQ;
+            this->Z2 += this->dZ2;
+            this->dM = this->dQ = this->dZ2 = 0.0;
+            Reciprocal::commit();
         }
-    }
 
-    inline double operator()(){
-        double polarization = 0.0, gamma = 0.0, dipoleM = 0.0;;
-
-        for(int i = 0; i < kVec.size(); i++){    
-            polarization += -1.0 / (kNorms[i] * (1.0 - eFactors[i])) * 
-                    (f1[i] * f1[i] + f2[i] * f2[i] + eFactors[i] * (f3[i] * f3[i] + f4[i] * f4[i]) - 
-                    2.0 * eFactors[i] * (f3[i] * f1[i] + f2[i] * f4[i]));
+        void discard(){
+            this->dM = this->dQ = this->dZ2 = 0.0;
+            Reciprocal::discard();
         }
 
-        gamma = -2.0 * (dipoleM * dipoleM / this->zb - sumC * dipoleM);
-
-        return constants::PI / (Base::xL * Base::xL) * (polarization + gamma);
-    }
-
-    void update_f(Particle &_old, Particle &_new){
-        for(int i = 0; i < kVec.size(); i++){
-            double oldFactor = 2.0 * constants::PI / this->xb * (kVec[i][0] * _old.pos[0] + kVectors[i][1] * _old.pos[1]);
-            double newFactor = 2.0 * constants::PI / this->xb * (kVec[i][0] * _new.pos[0] + kVectors[i][1] * _new.pos[1]);
-            f1[i] -= _old.q * std::cos(oldFactor) * std::exp(-kNorms[i] * (_old.pos[2] + this->zb/ 2.0));
-            f1[i] += _new.q * std::cos(newFactor) * std::exp(-kNorms[i] * (_new.pos[2] + this->zb / 2.0));
-
-            f2[i] -= _old.q * std::sin(oldFactor) * std::exp(-kNorms[i] * (_old.pos[2] + this->zb / 2.0));
-            f2[i] += _new.q * std::sin(newFactor) * std::exp(-kNorms[i] * (_new.pos[2] + this->zb / 2.0) );
-
-            f3[i] -= _old.q * std::cos(oldFactor) * std::exp(kNorms[i] * (_old.pos[2] + this->zb / 2.0) );
-            f3[i] += _new.q * std::cos(newFactor) * std::exp(kNorms[i] * (_new.pos[2] + this->zb / 2.0) );
+        inline double operator()(){
+            double energy = 0.0;
+            for(unsigned int k = 0; k < this->kNorm.size(); k++){
+                std::complex<double> f = (this->pending) ? this->fp[k] + this->dfp[k] : this->fp[k];
+                energy += this->fac[k] * (std::norm(this->rho(k)) + std::norm(f));
+            }
 
-            f4[i] -= _old.q * std::sin(oldFactor) * std::exp(kNorms[i] * (_old.pos[2] + this->zb / 2.0) );
-            f4[i] += _new.q * std::sin(newFactor) * std::exp(kNorms[i] * (_new.pos[2] + this->zb / 2.0));
+            double m = this->M + this->dM, q = this->Q + this->dQ, z2 = this->Z2 + this->dZ2;
+            double mw = m + q * this->L / 2.0;    //Dipole moment from the lower wall
 
-            sumC += _new.q;
-            sumC -= _old.q;
+            energy += 2.0 * constants::PI / (this->area * this->zb) * (m * m - q * z2 - q * q * this->zb * this->zb / 12.0);
+            energy -= 2.0 * constants::PI / this->area * (mw * mw / this->L - q * mw);
 
-            dipoleM += 
+            //The images neutralize the slab, remove the background Long assumes for a net charge
+            energy -= constants::PI * q * q / (2.0 * this->area * this->zb * alpha * alpha);
+            return energy;
         }
-    }
-};
-
-*/
+    };
+}
@@ -48,14 +48,14 @@ class Density : public Sampler{
     }
 
     void sample(State& state){
+        const AlignedVector<double>& pos = (d == 0) ? state.particles.x : (d == 1) ? state.particles.y : state.particles.z;
         for(unsigned int i = 0; i < state.particles.tot; i++){
-            //printf("%lu %i\n", this->density.size(), (int) (particles.particles[i]->pos[d] + this->dh));
-            if(state.particles.particles[i]->q > 0){
-                pDens.at( (unsigned int) ( (state.particles[i]->pos[d] + this->dh) / this->binWidth ) )++;
+            if(state.particles.qs[i] > 0){
+                pDens.at( (unsigned int) ( (pos[i] + this->dh) / this->binWidth ) )++;
             }
 
             else{
-                nDens.at( (unsigned int) ( (state.particles[i]->pos[d] + this->dh) / this->binWidth ) )++;
+                nDens.at( (unsigned int) ( (pos[i] + this->dh) / this->binWidth ) )++;
             }
         }
         this->samples++;
@@ -120,6 +120,8 @@ class Energy : public Sampler{
 
 class WidomHS : public Sampler{
     double cp = 0.0;
+    int widom = -1;                                                     //Species of the test particle
+    std::shared_ptr<Particle> test = std::make_shared<Particle>();     //Test particle, charged like a cation with radius 2.5
 
     public:
 
@@ -133,7 +135,24 @@ class WidomHS : public Sampler{
         qDisp << 0.0, 0.0, 0.0;
         com[2] = (Random::get_random() * 0.2 - 0.1) * state.geo->_dh[2];
         //std::cout << com[0] << " " << com[1] << " " << com[2] << std::endl;
-        state.particles.add(com, com, qDisp, 2.5, state.particles.pModel.rf, state.particles.pModel.q, state.particles.pModel.b, 0.0, 0.0, "WIDOM_PARTICLE");
+        //The test particle has its own species, registered on the first sample when the cation model is known
+        Species& sp = state.particles.species;
+        if(this->widom < 0){
+            int p = state.particles.pSpecies;
+            this->widom = sp.add("WHS", sp.q[p], 2.5, sp.rf[p], 0.0, 0.0);
+        }
+        int s = this->widom;
+        this->test->com = com;
+        this->test->pos = com;
+        this->test->qDisp = qDisp;
+        this->test->r = sp.r[s];
+        this->test->rf = sp.rf[s];
+        this->test->q = sp.q[s];
+        this->test->b = 0.0;
+        this->test->b_min = sp.b_min[s];
+        this->test->b_max = sp.b_max[s];
+        this->test->species = s;
+        state.particles.add(this->test);
 
         if(!state.overlap(state.particles.tot - 1)){
             this->cp += 1.0;
@@ -175,17 +194,15 @@ class QDist : public Sampler{
     }
 
     void sample(State& state){
+        Eigen::Vector3d pos, com;
         for(unsigned int i = 0; i < state.particles.tot; i++){
-            if(state.particles.particles[i]->q > 0.0){
-
-            //printf("%lu %i\n", this->density.size(), (int) (particles.particles[i]->pos[d] + this->dh));
-                //printf("%lf\n", state.geo->distance(state.particles.particles[i]->pos, state.particles.particles[i]->com));
-                pqDist.at( (int) ( (state.geo->distance(state.particles.particles[i]->pos, state.particles.particles[i]->com)) /
-                                this->binWidth ) )++;
+            pos = state.particles.pos(i);
+            com = state.particles.com(i);
+            if(state.particles.qs[i] > 0.0){
+                pqDist.at( (int) ( (state.geo->distance(pos, com)) / this->binWidth ) )++;
             }
             else{
-                nqDist.at( (int) ( (state.geo->distance(state.particles.particles[i]->pos, state.particles.particles[i]->com)) /
-                                this->binWidth ) )++; 
+                nqDist.at( (int) ( (state.geo->distance(pos, com)) / this->binWidth ) )++; 
             }
         }
         this->samples++;
@@ -253,9 +270,9 @@ class XDR : public Sampler{
             //size_t N = 0;
 
             for (unsigned int i = 0; i < state.particles.tot; i++) {
-                ps[i][0] = state.particles[i]->pos[0] * 0.1 + state.geo->_d[0] * 0.5;
-                ps[i][1] = state.particles[i]->pos[1] * 0.1 + state.geo->_d[1] * 0.5;
-                ps[i][2] = state.particles[i]->pos[2] * 0.1 + state.geo->_d[2] * 0.5; 
+                ps[i][0] = state.particles.x[i] * 0.1 + state.geo->_d[0] * 0.5;
+                ps[i][1] = state.particles.y[i] * 0.1 + state.geo->_d[1] * 0.5;
+                ps[i][2] = state.particles.z[i] * 0.1 + state.geo->_d[2] * 0.5; 
             }
 
             write_xtc(xdf, state.particles.tot, state.step, state.step, box, ps, 1000);
@@ -0,0 +1,345 @@
+#pragma once
+
+#include <cmath>
+#include <string>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define SIMD_X86 1
+#endif
+
+/*
+    Batched real space Ewald kernel: sum_j q_j * erfc(alpha * r_ij) / r_ij over partners j within the cutoff,
+    with minimum image in the periodic dimensions. Partners are either the contiguous range [0, n) of the
+    arrays (idx == nullptr) or the gathered entries idx[0..n). Entry skip is left out. If img is given, the
+    terms of the partners with the point img are subtracted in the same pass, each partner is loaded once for
+    both (the image charges of ImgEnergy). If out is given, the term of partner j times outScale is also added to out[j].
+    The AVX2 and AVX-512 versions are compiled with target attributes and picked at runtime.
+*/
+namespace simd{
+
+    typedef double (*EwaldShortKernel)(const double* x, const double* y, const double* z, const double* q,
+                                       const unsigned int* idx, unsigned int n, unsigned int skip,
+                                       const double* p, const double* img, const double* d, const double* dh, const bool* periodic,
+                                       double alpha, double cutoff, double* out, double outScale);
+
+    //Same polynomial as math::erfc_x
+    constexpr double A0 = 0.3275911;
+    constexpr double a1 = 0.254829592;
+    constexpr double a2 = -0.284496736;
+    constexpr double a3 = 1.421413741;
+    constexpr double a4 = -1.453152027;
+    constexpr double a5 = 1.061405429;
+
+    //Cephes exp coefficients
+    constexpr double LOG2E = 1.4426950408889634073599;
+    constexpr double C1 = 6.93145751953125E-1;
+    constexpr double C2 = 1.42860682030941723212E-6;
+    constexpr double P0 = 1.26177193074810590878E-4;
+    constexpr double P1 = 3.02994407707441961300E-2;
+    constexpr double P2 = 9.99999999999999999910E-1;
+    constexpr double Q0 = 3.00198505138664455042E-6;
+    constexpr double Q1 = 2.52448340349684104192E-3;
+    constexpr double Q2 = 2.27265548208155028766E-1;
+    constexpr double Q3 = 2.00000000000000000009E0;
+
+    inline double ewald_short_pair(double dx, double dy, double dz, double qj,
+                                   const double* d, const double* dh, const bool* periodic, double alpha, double cutoff){
+        double disp[3] = {dx, dy, dz};
+        for(int k = 0; k < 3; k++){
+            if(periodic[k]){
+                if(disp[k] > dh[k]){
+                    disp[k] -= d[k];
+                }
+                else if(disp[k] < -dh[k]){
+                    disp[k] += d[k];
+                }
+            }
+        }
+
+        double r = std::sqrt(disp[0] * disp[0] + disp[1] * disp[1] + disp[2] * disp[2]);
+        if(r > cutoff) return 0.0;
+
+        double x = alpha * r;
+        double t = 1.0 / (1.0 + A0 * x);
+        return qj / r * t * (a1 + t * (a2 + t * (a3 + t * (a4 + t * a5)))) * std::exp(-x * x);
+    }
+
+    inline double ewald_short_scalar(const double* x, const double* y, const double* z, const double* q,
+                                     const unsigned int* idx, unsigned int n, unsigned int skip,
+                                     const double* p, const double* img, const double* d, const double* dh, const bool* periodic,
+                                     double alpha, double cutoff, double* out = nullptr, double outScale = 1.0){
+        double e = 0.0;
+        for(unsigned int k = 0; k < n; k++){
+            unsigned int j = (idx == nullptr) ? k : idx[k];
+            if(j == skip) continue;
+            double v = ewald_short_pair(p[0] - x[j], p[1] - y[j], p[2] - z[j], q[j], d, dh, periodic, alpha, cutoff);
+            if(img != nullptr){
+                v -= ewald_short_pair(img[0] - x[j], img[1] - y[j], img[2] - z[j], q[j], d, dh, periodic, alpha, cutoff);
+            }
+            e += v;
+            if(out != nullptr) out[j] += outScale * v;
+        }
+        return e;
+    }
+
+
+
+#ifdef SIMD_X86
+
+    __attribute__((target("avx2,fma")))
+    inline __m256d exp_avx2(__m256d x){
+        x = _mm256_max_pd(x, _mm256_set1_pd(-708.0));
+        __m256d n = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        x = _mm256_fnmadd_pd(n, _mm256_set1_pd(C1), x);
+        x = _mm256_fnmadd_pd(n, _mm256_set1_pd(C2), x);
+
+        __m256d x2 = _mm256_mul_pd(x, x);
+        __m256d px = _mm256_fmadd_pd(_mm256_fmadd_pd(_mm256_set1_pd(P0), x2, _mm256_set1_pd(P1)), x2, _mm256_set1_pd(P2));
+        px = _mm256_mul_pd(px, x);
+        __m256d qx = _mm256_fmadd_pd(_mm256_fmadd_pd(_mm256_fmadd_pd(_mm256_set1_pd(Q0), x2, _mm256_set1_pd(Q1)), x2,
+                                     _mm256_set1_pd(Q2)), x2, _mm256_set1_pd(Q3));
+        __m256d e = _mm256_div_pd(px, _mm256_sub_pd(qx, px));
+        e = _mm256_fmadd_pd(_mm256_set1_pd(2.0), e, _mm256_set1_pd(1.0));
+
+        //Multiply by 2^n
+        __m128i ni = _mm_add_epi32(_mm256_cvtpd_epi32(n), _mm_set1_epi32(1023));
+        __m256d scale = _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_cvtepi32_epi64(ni), 52));
+        return _mm256_mul_pd(e, scale);
+    }
+
+    __attribute__((target("avx2,fma")))
+    inline __m256d wrap_avx2(__m256d disp, double d, double dh){
+        __m256d vd = _mm256_set1_pd(d), vdh = _mm256_set1_pd(dh);
+        disp = _mm256_sub_pd(disp, _mm256_and_pd(_mm256_cmp_pd(disp, vdh, _CMP_GT_OQ), vd));
+        return _mm256_add_pd(disp, _mm256_and_pd(_mm256_cmp_pd(disp, _mm256_sub_pd(_mm256_setzero_pd(), vdh), _CMP_LT_OQ), vd));
+    }
+
+    //q_j erfc(alpha r) / r of the partners xj, yj, zj, qj seen from the point px, py, pz, zero outside the cutoff
+    //and for the excluded partner
+    __attribute__((target("avx2,fma")))
+    inline __m256d ewald_short_term_avx2(__m256d px, __m256d py, __m256d pz, __m256d xj, __m256d yj, __m256d zj, __m256d qj,
+                                         __m256d self, const double* d, const double* dh, const bool* periodic, __m256d va, __m256d vc){
+        const __m256d one = _mm256_set1_pd(1.0);
+        __m256d dx = _mm256_sub_pd(px, xj), dy = _mm256_sub_pd(py, yj), dz = _mm256_sub_pd(pz, zj);
+        if(periodic[0]) dx = wrap_avx2(dx, d[0], dh[0]);
+        if(periodic[1]) dy = wrap_avx2(dy, d[1], dh[1]);
+        if(periodic[2]) dz = wrap_avx2(dz, d[2], dh[2]);
+
+        __m256d r = _mm256_sqrt_pd(_mm256_fmadd_pd(dx, dx, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dz, dz))));
+        __m256d mask = _mm256_andnot_pd(self, _mm256_cmp_pd(r, vc, _CMP_LE_OQ));
+
+        __m256d ax = _mm256_mul_pd(va, r);
+        __m256d t = _mm256_div_pd(one, _mm256_fmadd_pd(_mm256_set1_pd(A0), ax, one));
+        __m256d poly = _mm256_fmadd_pd(t, _mm256_set1_pd(a5), _mm256_set1_pd(a4));
+        poly = _mm256_fmadd_pd(t, poly, _mm256_set1_pd(a3));
+        poly = _mm256_fmadd_pd(t, poly, _mm256_set1_pd(a2));
+        poly = _mm256_fmadd_pd(t, poly, _mm256_set1_pd(a1));
+        poly = _mm256_mul_pd(t, poly);
+
+        __m256d e = _mm256_mul_pd(poly, exp_avx2(_mm256_sub_pd(_mm256_setzero_pd(), _mm256_mul_pd(ax, ax))));
+        return _mm256_and_pd(mask, _mm256_div_pd(_mm256_mul_pd(qj, e), r));
+    }
+
+    __attribute__((target("avx2,fma")))
+    inline double ewald_short_avx2(const double* x, const double* y, const double* z, const double* q,
+                                   const unsigned int* idx, unsigned int n, unsigned int skip,
+                                   const double* p, const double* img, const double* d, const double* dh, const bool* periodic,
+                                   double alpha, double cutoff, double* out, double outScale){
+        const __m256d px = _mm256_set1_pd(p[0]), py = _mm256_set1_pd(p[1]), pz = _mm256_set1_pd(p[2]);
+        const double* m = (img == nullptr) ? p : img;
+        const __m256d mx = _mm256_set1_pd(m[0]), my = _mm256_set1_pd(m[1]), mz = _mm256_set1_pd(m[2]);
+        const __m256d va = _mm256_set1_pd(alpha), vc = _mm256_set1_pd(cutoff);
+        const __m128i vskip = _mm_set1_epi32((int) skip);
+        __m256d acc = _mm256_setzero_pd();
+        __m256d xj, yj, zj, qj;
+        __m128i ij;
+
+        unsigned int k = 0;
+        for(; k + 4 <= n; k += 4){
+            if(idx == nullptr){
+                ij = _mm_add_epi32(_mm_set1_epi32((int) k), _mm_setr_epi32(0, 1, 2, 3));
+                xj = _mm256_loadu_pd(x + k);
+                yj = _mm256_loadu_pd(y + k);
+                zj = _mm256_loadu_pd(z + k);
+                qj = _mm256_loadu_pd(q + k);
+            }
+            else{
+                ij = _mm_loadu_si128((const __m128i*) (idx + k));
+                xj = _mm256_i32gather_pd(x, ij, 8);
+                yj = _mm256_i32gather_pd(y, ij, 8);
+                zj = _mm256_i32gather_pd(z, ij, 8);
+                qj = _mm256_i32gather_pd(q, ij, 8);
+            }
+
+            __m256d self = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm_cmpeq_epi32(ij, vskip)));
+            __m256d e = ewald_short_term_avx2(px, py, pz, xj, yj, zj, qj, self, d, dh, periodic, va, vc);
+            if(img != nullptr){
+                e = _mm256_sub_pd(e, ewald_short_term_avx2(mx, my, mz, xj, yj, zj, qj, self, d, dh, periodic, va, vc));
+            }
+            acc = _mm256_add_pd(acc, e);
+
+            if(out != nullptr){
+                if(idx == nullptr){
+                    _mm256_storeu_pd(out + k, _mm256_fmadd_pd(_mm256_set1_pd(outScale), e, _mm256_loadu_pd(out + k)));
+                }
+                else{
+                    alignas(32) double v[4];
+                    _mm256_store_pd(v, e);
+                    for(int l = 0; l < 4; l++){
+                        out[idx[k + l]] += outScale * v[l];
+                    }
+                }
+            }
+        }
+
+        __m128d s = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+        double e = _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+
+        //Remaining partners, contiguous arrays are shifted so that indices stay relative
+        if(idx == nullptr){
+            return e + ewald_short_scalar(x + k, y + k, z + k, q + k, nullptr, n - k, skip - k, p, img, d, dh, periodic, alpha, cutoff,
+                                          (out == nullptr) ? nullptr : out + k, outScale);
+        }
+        return e + ewald_short_scalar(x, y, z, q, idx + k, n - k, skip, p, img, d, dh, periodic, alpha, cutoff, out, outScale);
+    }
+
+
+
+    __attribute__((target("avx512f")))
+    inline __m512d exp_avx512(__m512d x){
+        x = _mm512_max_pd(x, _mm512_set1_pd(-708.0));
+        __m512d n = _mm512_roundscale_pd(_mm512_mul_pd(x, _mm512_set1_pd(LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        x = _mm512_fnmadd_pd(n, _mm512_set1_pd(C1), x);
+        x = _mm512_fnmadd_pd(n, _mm512_set1_pd(C2), x);
+
+        __m512d x2 = _mm512_mul_pd(x, x);
+        __m512d px = _mm512_fmadd_pd(_mm512_fmadd_pd(_mm512_set1_pd(P0), x2, _mm512_set1_pd(P1)), x2, _mm512_set1_pd(P2));
+        px = _mm512_mul_pd(px, x);
+        __m512d qx = _mm512_fmadd_pd(_mm512_fmadd_pd(_mm512_fmadd_pd(_mm512_set1_pd(Q0), x2, _mm512_set1_pd(Q1)), x2,
+                                     _mm512_set1_pd(Q2)), x2, _mm512_set1_pd(Q3));
+        __m512d e = _mm512_div_pd(px, _mm512_sub_pd(qx, px));
+        e = _mm512_fmadd_pd(_mm512_set1_pd(2.0), e, _mm512_set1_pd(1.0));
+        return _mm512_scalef_pd(e, n);
+    }
+
+    __attribute__((target("avx512f")))
+    inline __m512d wrap_avx512(__m512d disp, double d, double dh){
+        __m512d vd = _mm512_set1_pd(d), vdh = _mm512_set1_pd(dh);
+        disp = _mm512_mask_sub_pd(disp, _mm512_cmp_pd_mask(disp, vdh, _CMP_GT_OQ), disp, vd);
+        return _mm512_mask_add_pd(disp, _mm512_cmp_pd_mask(disp, _mm512_sub_pd(_mm512_setzero_pd(), vdh), _CMP_LT_OQ), disp, vd);
+    }
+
+    __attribute__((target("avx512f")))
+    inline __m512d ewald_short_term_avx512(__m512d px, __m512d py, __m512d pz, __m512d xj, __m512d yj, __m512d zj, __m512d qj,
+                                           __mmask8 self, const double* d, const double* dh, const bool* periodic, __m512d va, __m512d vc){
+        const __m512d one = _mm512_set1_pd(1.0);
+        __m512d dx = _mm512_sub_pd(px, xj), dy = _mm512_sub_pd(py, yj), dz = _mm512_sub_pd(pz, zj);
+        if(periodic[0]) dx = wrap_avx512(dx, d[0], dh[0]);
+        if(periodic[1]) dy = wrap_avx512(dy, d[1], dh[1]);
+        if(periodic[2]) dz = wrap_avx512(dz, d[2], dh[2]);
+
+        __m512d r = _mm512_sqrt_pd(_mm512_fmadd_pd(dx, dx, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dz, dz))));
+        __mmask8 mask = _mm512_cmp_pd_mask(r, vc, _CMP_LE_OQ) & ~self;
+
+        __m512d ax = _mm512_mul_pd(va, r);
+        __m512d t = _mm512_div_pd(one, _mm512_fmadd_pd(_mm512_set1_pd(A0), ax, one));
+        __m512d poly = _mm512_fmadd_pd(t, _mm512_set1_pd(a5), _mm512_set1_pd(a4));
+        poly = _mm512_fmadd_pd(t, poly, _mm512_set1_pd(a3));
+        poly = _mm512_fmadd_pd(t, poly, _mm512_set1_pd(a2));
+        poly = _mm512_fmadd_pd(t, poly, _mm512_set1_pd(a1));
+        poly = _mm512_mul_pd(t, poly);
+
+        __m512d e = _mm512_mul_pd(poly, exp_avx512(_mm512_sub_pd(_mm512_setzero_pd(), _mm512_mul_pd(ax, ax))));
+        return _mm512_maskz_mov_pd(mask, _mm512_div_pd(_mm512_mul_pd(qj, e), r));
+    }
+
+    __attribute__((target("avx512f")))
+    inline double ewald_short_avx512(const double* x, const double* y, const double* z, const double* q,
+                                     const unsigned int* idx, unsigned int n, unsigned int skip,
+                                     const double* p, const double* img, const double* d, const double* dh, const bool* periodic,
+                                     double alpha, double cutoff, double* out, double outScale){
+        const __m512d px = _mm512_set1_pd(p[0]), py = _mm512_set1_pd(p[1]), pz = _mm512_set1_pd(p[2]);
+        const double* m = (img == nullptr) ? p : img;
+        const __m512d mx = _mm512_set1_pd(m[0]), my = _mm512_set1_pd(m[1]), mz = _mm512_set1_pd(m[2]);
+        const __m512d va = _mm512_set1_pd(alpha), vc = _mm512_set1_pd(cutoff);
+        const __m256i vskip = _mm256_set1_epi32((int) skip);
+        __m512d acc = _mm512_setzero_pd();
+        __m512d xj, yj, zj, qj;
+        __m256i ij;
+
+        unsigned int k = 0;
+        for(; k + 8 <= n; k += 8){
+            if(idx == nullptr){
+                ij = _mm256_add_epi32(_mm256_set1_epi32((int) k), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+                xj = _mm512_loadu_pd(x + k);
+                yj = _mm512_loadu_pd(y + k);
+                zj = _mm512_loadu_pd(z + k);
+                qj = _mm512_loadu_pd(q + k);
+            }
+            else{
+                ij = _mm256_loadu_si256((const __m256i*) (idx + k));
+                xj = _mm512_i32gather_pd(ij, x, 8);
+                yj = _mm512_i32gather_pd(ij, y, 8);
+                zj = _mm512_i32gather_pd(ij, z, 8);
+                qj = _mm512_i32gather_pd(ij, q, 8);
+            }
+
+            __mmask8 self = _mm512_cmpeq_epi64_mask(_mm512_cvtepi32_epi64(ij), _mm512_cvtepi32_epi64(vskip));
+            __m512d e = ewald_short_term_avx512(px, py, pz, xj, yj, zj, qj, self, d, dh, periodic, va, vc);
+            if(img != nullptr){
+                e = _mm512_sub_pd(e, ewald_short_term_avx512(mx, my, mz, xj, yj, zj, qj, self, d, dh, periodic, va, vc));
+            }
+            acc = _mm512_add_pd(acc, e);
+
+            if(out != nullptr){
+                if(idx == nullptr){
+                    _mm512_storeu_pd(out + k, _mm512_fmadd_pd(_mm512_set1_pd(outScale), e, _mm512_loadu_pd(out + k)));
+                }
+                else{
+                    //Indices within a batch are distinct so gather/scatter is safe
+                    __m512d o = _mm512_i32gather_pd(ij, out, 8);
+                    _mm512_i32scatter_pd(out, ij, _mm512_fmadd_pd(_mm512_set1_pd(outScale), e, o), 8);
+                }
+            }
+        }
+
+        double e = _mm512_reduce_add_pd(acc);
+
+        //Remaining partners, contiguous arrays are shifted so that indices stay relative
+        if(idx == nullptr){
+            return e + ewald_short_scalar(x + k, y + k, z + k, q + k, nullptr, n - k, skip - k, p, img, d, dh, periodic, alpha, cutoff,
+                                          (out == nullptr) ? nullptr : out + k, outScale);
+        }
+        return e + ewald_short_scalar(x, y, z, q, idx + k, n - k, skip, p, img, d, dh, periodic, alpha, cutoff, out, outScale);
+    }
+
+#endif
+
+
+
+    inline EwaldShortKernel select_ewald_short(std::string& name){
+#ifdef SIMD_X86
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx512f")){
+            name = "AVX-512";
+            return ewald_short_avx512;
+        }
+        if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+            name = "AVX2";
+            return ewald_short_avx2;
+        }
+#endif
+        name = "scalar";
+        return ewald_short_scalar;
+    }
+
+    inline std::string& ewald_short_name(){
+        static std::string name;
+        return name;
+    }
+
+    inline EwaldShortKernel ewald_short(){
+        static EwaldShortKernel kernel = select_ewald_short(ewald_short_name());
+        return kernel;
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+
+/*
+    Registry of the particle species. Particles store the id of their species, the parameters
+    shared by a species are kept here with one array per parameter, indexed by the id. A species
+    is registered once, the copies of the parameters in each particle have to agree with it.
+    The copies are kept since the moves and energy terms read them through the particle pointers.
+*/
+class Species{
+
+    public:
+    std::vector<std::string> name;
+    std::vector<double> q, r, rf, b_min, b_max;
+
+    inline unsigned int size() const{
+        return this->name.size();
+    }
+
+    //Id of the species called n, -1 if not registered
+    int find(const std::string& n) const{
+        for(unsigned int i = 0; i < this->name.size(); i++){
+            if(this->name[i] == n) return i;
+        }
+        return -1;
+    }
+
+    //Id of the species called n, registered with the given parameters if it is new. Exits if n is
+    //registered with other parameters
+    int add(const std::string& n, double q, double r, double rf, double b_min, double b_max){
+        int id = this->find(n);
+        if(id >= 0){
+            if(this->q[id] != q || this->r[id] != r || this->rf[id] != rf || this->b_min[id] != b_min || this->b_max[id] != b_max){
+                printf("Species %s is already registered with q: %.3lf, r: %.3lf, rf: %.3lf, b: %.3lf-%.3lf, "
+                       "got q: %.3lf, r: %.3lf, rf: %.3lf, b: %.3lf-%.3lf!\n", n.c_str(), this->q[id], this->r[id], this->rf[id],
+                       this->b_min[id], this->b_max[id], q, r, rf, b_min, b_max);
+                exit(1);
+            }
+            return id;
+        }
+
+        this->name.push_back(n);
+        this->q.push_back(q);
+        this->r.push_back(r);
+        this->rf.push_back(rf);
+        this->b_min.push_back(b_min);
+        this->b_max.push_back(b_max);
+        printf("\tRegistered species %s (id %u), q: %.3lf, r: %.3lf, rf: %.3lf, b: %.3lf-%.3lf\n", n.c_str(), this->size() - 1, q, r, rf, b_min, b_max);
+        return this->size() - 1;
+    }
+};
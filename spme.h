@@ -0,0 +1,334 @@
+#pragma once
+
+#include <vector>
+#include <complex>
+#include <cmath>
+#include <unsupported/Eigen/FFT>
+#include "particles.h"
+
+namespace EwaldLike{
+
+    //In place 3D FFT of a K[0] x K[1] x K[2] row-major grid, one axis at a time
+    inline void fft3(std::vector< std::complex<double> >& grid, const int* K, bool inverse){
+        static Eigen::FFT<double> fft;
+        std::vector< std::complex<double> > in, out;
+
+        int stride[3] = {K[1] * K[2], K[2], 1};
+        for(int d = 0; d < 3; d++){
+            int a = (d + 1) % 3, b = (d + 2) % 3;
+            in.resize(K[d]);
+            out.resize(K[d]);
+
+            for(int i = 0; i < K[a]; i++){
+                for(int j = 0; j < K[b]; j++){
+                    int offset = i * stride[a] + j * stride[b];
+                    for(int n = 0; n < K[d]; n++){
+                        in[n] = grid[offset + n * stride[d]];
+                    }
+                    (inverse) ? fft.inv(out, in) : fft.fwd(out, in);
+                    for(int n = 0; n < K[d]; n++){
+                        grid[offset + n * stride[d]] = out[n];
+                    }
+                }
+            }
+        }
+    }
+
+
+    /*
+        Reciprocal energy of charges spread on a periodic K[0] x K[1] x K[2] mesh, E = sum_m G(m) |F[Q](m)|^2
+        = sum_p Q(p) phi(p), phi = theta * Q, where G is the influence function set by the derived class
+        and theta is its real space counterpart.
+
+        MC moves only change Q at the points of the moved charges, so a trial costs
+        dE = 2 sum dQ phi + dQ theta dQ (+ cross terms with moves accepted since phi was last computed).
+        phi is recomputed with two FFTs once the cross terms have cost about as much as that.
+    */
+    class MeshEwald{
+        protected:
+        struct Point{
+            int a, b, c, index;     //Mesh coordinates and flat index
+            double q;
+        };
+        typedef std::vector<Point> Spread;
+
+        int K[3], order;
+        double volume, selfTerm = 0.0, dSelf = 0.0, xb, yb, zb;
+        double energy = 0.0, dE = 0.0;                          //Committed mesh energy and change from the pending trial
+        std::vector<double> Q, phi, theta, G;
+        std::vector<Spread> accepted;                           //Accepted changes of Q not included in phi
+        unsigned int acceptedPoints = 0;
+        double crossWork = 0.0, fftWork = 0.0;                  //Work spent on cross terms since phi was computed, and the cost of computing it
+        Spread trial;
+
+        //Mesh points and weights of a particle with charge q at pos, including any images
+        virtual void spread_charge(const Eigen::Vector3d& pos, double q, Spread& out) = 0;
+
+        //Weights M_n(f + j), j = 0..n-1, of the cardinal B-spline of order n
+        inline void bspline(int n, double f, double* w){
+            double prev[8];
+            w[0] = f;
+            w[1] = 1.0 - f;
+            for(int j = 2; j < n; j++) w[j] = 0.0;
+            if(n == 1) w[0] = 1.0;
+
+            for(int k = 3; k <= n; k++){
+                std::copy(w, w + n, prev);
+                for(int j = 0; j < k; j++){
+                    double x = f + j;
+                    w[j] = (x * prev[j] + (k - x) * ((j > 0) ? prev[j - 1] : 0.0)) / (k - 1);
+                }
+            }
+        }
+
+        //B-spline spread of a charge q at pos onto the points floor(u + shift) - j, u the mesh coordinate
+        inline void spread(const Eigen::Vector3d& pos, double q, double shift, Spread& out){
+            double L[3] = {this->xb, this->yb, this->zb};
+            double w[3][8];
+            int g0[3];
+
+            for(int d = 0; d < 3; d++){
+                double u = this->K[d] * (pos[d] + L[d] / 2.0) / L[d] + shift;
+                double fl = std::floor(u);
+                g0[d] = (int) fl;
+                this->bspline(this->order, u - fl, w[d]);
+            }
+
+            for(int a = 0; a < this->order; a++){
+                int ga = ((g0[0] - a) % this->K[0] + this->K[0]) % this->K[0];
+                for(int b = 0; b < this->order; b++){
+                    int gb = ((g0[1] - b) % this->K[1] + this->K[1]) % this->K[1];
+                    double wab = q * w[0][a] * w[1][b];
+                    for(int c = 0; c < this->order; c++){
+                        int gc = ((g0[2] - c) % this->K[2] + this->K[2]) % this->K[2];
+                        out.push_back({ga, gb, gc, (ga * this->K[1] + gb) * this->K[2] + gc, wab * w[2][c]});
+                    }
+                }
+            }
+        }
+
+        //sum_{p, q} s1(p) theta(p - q) s2(q), theta only depends on the periodic difference
+        inline double cross(const Spread& s1, const Spread& s2){
+            double e = 0.0;
+            for(auto& p : s1){
+                double ep = 0.0;
+                for(auto& q : s2){
+                    int da = p.a - q.a, db = p.b - q.b, dc = p.c - q.c;
+                    if(da < 0) da += this->K[0];
+                    if(db < 0) db += this->K[1];
+                    if(dc < 0) dc += this->K[2];
+                    ep += q.q * this->theta[(da * this->K[1] + db) * this->K[2] + dc];
+                }
+                e += p.q * ep;
+            }
+            return e;
+        }
+
+        //Signed wavenumber of mesh index a along an axis with k points
+        inline int wavenumber(int a, int k){
+            return (a <= k / 2) ? a : a - k;
+        }
+
+        //phi = theta * Q from the current mesh
+        void compute_phi(){
+            int M = this->K[0] * this->K[1] * this->K[2];
+            std::vector< std::complex<double> > F(this->Q.begin(), this->Q.end());
+
+            fft3(F, this->K, false);
+            this->energy = 0.0;
+            for(int m = 0; m < M; m++){
+                this->energy += this->G[m] * std::norm(F[m]);
+                F[m] *= this->G[m];
+            }
+            fft3(F, this->K, true);
+
+            this->phi.resize(M);
+            for(int p = 0; p < M; p++){
+                this->phi[p] = M * F[p].real();
+            }
+            this->accepted.clear();
+            this->acceptedPoints = 0;
+            this->crossWork = 0.0;
+        }
+
+        //theta, Q and phi from G and the particles
+        void build_mesh(Particles &particles){
+            int M = this->K[0] * this->K[1] * this->K[2];
+
+            std::vector< std::complex<double> > T(this->G.begin(), this->G.end());
+            fft3(T, this->K, true);
+            this->theta.resize(M);
+            for(int p = 0; p < M; p++){
+                this->theta[p] = M * T[p].real();
+            }
+
+            Spread s;
+            this->Q.assign(M, 0.0);
+            for(unsigned int i = 0; i < particles.tot; i++){
+                s.clear();
+                this->spread_charge(particles.pos(i), particles.qs[i], s);
+                for(auto& g : s){
+                    this->Q[g.index] += g.q;
+                }
+            }
+            this->compute_phi();
+
+            //Rough cost of two 3D FFTs in units of one cross term
+            this->fftWork = 10.0 * M * std::log2((double) M);
+
+            this->selfTerm = 0.0;
+            for(unsigned int i = 0; i < particles.tot; i++){
+                this->selfTerm += particles.qs[i] * particles.qs[i];
+            }
+            this->selfTerm *= alpha / std::sqrt(constants::PI);
+            this->discard();
+        }
+
+        public:
+
+        virtual ~MeshEwald(){}
+
+        void set_box(double x, double y, double z){
+            this->xb = x;
+            this->yb = y;
+            this->zb = z;
+            this->volume = x * y * z;
+        }
+
+        inline void update(const std::vector< std::shared_ptr<Particle> >& _old, const std::vector< std::shared_ptr<Particle> >& _new){
+            this->discard();
+
+            for(auto o : _old){
+                this->spread_charge(o->pos, -o->q, this->trial);
+            }
+            for(auto n : _new){
+                this->spread_charge(n->pos, n->q, this->trial);
+            }
+
+            if(_old.empty()){
+                for(auto n : _new){
+                    this->dSelf += n->q * n->q * alpha / std::sqrt(constants::PI);
+                }
+            }
+            if(_new.empty()){
+                for(auto o : _old){
+                    this->dSelf -= o->q * o->q * alpha / std::sqrt(constants::PI);
+                }
+            }
+
+            for(auto& g : this->trial){
+                this->dE += 2.0 * g.q * this->phi[g.index];
+            }
+            for(auto& s : this->accepted){
+                this->dE += 2.0 * this->cross(this->trial, s);
+            }
+            this->dE += this->cross(this->trial, this->trial);
+            this->crossWork += (double) this->trial.size() * this->acceptedPoints;
+        }
+
+        void commit(){
+            if(this->trial.empty() && this->dSelf == 0.0) return;
+
+            for(auto& g : this->trial){
+                this->Q[g.index] += g.q;
+            }
+            this->energy += this->dE;
+            this->selfTerm += this->dSelf;
+
+            this->acceptedPoints += this->trial.size();
+            this->accepted.push_back(this->trial);
+
+            //Once the cross terms have cost as much as recomputing phi, recompute it
+            if(this->crossWork > this->fftWork){
+                this->compute_phi();
+            }
+            this->discard();
+        }
+
+        void discard(){
+            this->trial.clear();
+            this->dE = 0.0;
+            this->dSelf = 0.0;
+        }
+
+        inline double operator()(){
+            return this->energy + this->dE - (this->selfTerm + this->dSelf);
+        }
+    };
+
+
+    /*
+        Smooth particle mesh Ewald (Essmann et al. 1995) reciprocal energy with the same interface as Long.
+        Charges are spread with cardinal B-splines of order spmeOrder and G holds the Ewald influence
+        function and the B-spline moduli.
+    */
+    class LongSPME : public MeshEwald{
+        private:
+        static constexpr int spmeOrder = 4;
+
+        //Smallest power of two mesh resolving the k-vectors of Long twice over
+        inline int mesh_size(int km){
+            int k = 8;
+            while(k < 2 * (2 * km + 1)){
+                k *= 2;
+            }
+            return k;
+        }
+
+        void spread_charge(const Eigen::Vector3d& pos, double q, Spread& out){
+            this->spread(pos, q, 0.0, out);
+        }
+
+        //|b(m)|^2 of the B-spline interpolation along one axis
+        inline std::vector<double> bspline_moduli(int k){
+            double w[spmeOrder];
+            this->bspline(spmeOrder, 0.0, w);          //w[j] = M_n(j)
+
+            std::vector<double> b(k);
+            for(int m = 0; m < k; m++){
+                std::complex<double> den = 0.0;
+                for(int j = 0; j < spmeOrder - 1; j++){
+                    double arg = 2.0 * constants::PI * m * j / k;
+                    den += w[j + 1] * std::complex<double>(std::cos(arg), std::sin(arg));
+                }
+                b[m] = (std::norm(den) > 1e-14) ? 1.0 / std::norm(den) : 0.0;
+            }
+            return b;
+        }
+
+        public:
+
+        void initialize(Particles &particles){
+            this->order = spmeOrder;
+            for(int d = 0; d < 3; d++){
+                this->K[d] = this->mesh_size(kM[d]);
+            }
+            int M = this->K[0] * this->K[1] * this->K[2];
+            double L[3] = {this->xb, this->yb, this->zb};
+
+            printf("Setting up SPME\n");
+            printf("\tMesh: %i x %i x %i, spline order %i\n", this->K[0], this->K[1], this->K[2], spmeOrder);
+
+            //Influence function on the mesh
+            std::vector<double> bx = this->bspline_moduli(this->K[0]), by = this->bspline_moduli(this->K[1]), bz = this->bspline_moduli(this->K[2]);
+            this->G.assign(M, 0.0);
+            for(int a = 0; a < this->K[0]; a++){
+                double kx = 2.0 * constants::PI * this->wavenumber(a, this->K[0]) / L[0];
+                for(int b = 0; b < this->K[1]; b++){
+                    double ky = 2.0 * constants::PI * this->wavenumber(b, this->K[1]) / L[1];
+                    for(int c = 0; c < this->K[2]; c++){
+                        double kz = 2.0 * constants::PI * this->wavenumber(c, this->K[2]) / L[2];
+                        double k2 = kx * kx + ky * ky + kz * kz;
+                        if(k2 < 1e-12) continue;
+
+                        this->G[(a * this->K[1] + b) * this->K[2] + c] = 2.0 * constants::PI / this->volume *
+                                                                         std::exp(-k2 / (4.0 * alpha * alpha)) / k2 * bx[a] * by[b] * bz[c];
+                    }
+                }
+            }
+
+            this->build_mesh(particles);
+            printf("\tSPME initialization Complete\n");
+        }
+    };
+}
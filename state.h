@@ -7,12 +7,129 @@
 #include "geometry.h"
 #include "energy.h"
 #include "potentials.h"
+#include "spme.h"
+#include "p3m.h"
+#include "tuner.h"
+#include "fmm.h"
 #include "Spline.h"
 
 class State{
     private:
 
-    std::shared_ptr<State> _old;
+    struct Box{
+        std::vector<double> d, _d, dh, _dh;
+        double volume = 0.0;
+    };
+
+    //Undo log of the trial in progress. The moves record what they are about to change, revert() swaps
+    //it back into the particles and save() forgets it
+    std::vector< std::shared_ptr<Particle> > journal;   //Pool, the first `recorded` hold fields from before the trial
+    unsigned int recorded = 0;
+    std::vector< std::shared_ptr<Particle> > removed;   //Particles removed by the trial
+    std::vector< std::shared_ptr<Particle> > added;     //Particles added by the trial, while the old state is shown
+    std::vector< std::shared_ptr<Particle> > oldMoved;  //Journal entries and removed particles, as the energies see them
+    std::vector< unsigned int > oldMovedParticles;      //Indices of the moved particles in the old state
+    std::vector< std::shared_ptr<Particle> > newMoved;  //The moved particles in the trial, as the energies see them
+    std::vector<double> rest, olds;                     //Bounds of the terms after each term and their old energies
+    Box box;                                            //Box before a volume trial
+    bool boxChanged = false, showingOld = false;
+    unsigned int oldTot = 0, oldCTot = 0, oldATot = 0;
+
+    //Particles::take and put with the grids following the renumbering, the last particle fills the gap
+    std::shared_ptr<Particle> take(unsigned int i){
+        unsigned int last = this->particles.tot - 1;
+        for(auto c : {&this->cells, &this->hardCells}){
+            c->erase(i);
+            c->relocate(last, i);
+        }
+        return this->particles.take(i);
+    }
+
+    void put(const std::shared_ptr<Particle>& p, unsigned int i){
+        unsigned int end = this->particles.tot;
+        this->particles.put(p, i);
+        for(auto c : {&this->cells, &this->hardCells}){
+            c->relocate(i, end);
+            c->update(i, (c->useCom) ? p->com : p->pos);
+        }
+    }
+
+    //Exchanges the journal with the particles and the box, i.e. toggles between the trial and the old state
+    void swap_trial(){
+        bool toOld = !this->showingOld;
+        this->showingOld = toOld;
+
+        if(toOld){
+            while(this->particles.tot > this->oldTot){
+                this->added.push_back(this->take(this->particles.tot - 1));
+            }
+        }
+        else{
+            for(auto& p : this->removed){
+                this->take(p->index);
+            }
+        }
+
+        for(unsigned int k = 0; k < this->recorded; k++){
+            Particle& j = *this->journal[k];
+            Particle& p = *this->particles.particles[j.index];
+            std::swap(p.pos, j.pos);
+            std::swap(p.com, j.com);
+            std::swap(p.qDisp, j.qDisp);
+            std::swap(p.q, j.q);
+            std::swap(p.b, j.b);
+            std::swap(p.r, j.r);
+            std::swap(p.rf, j.rf);
+            std::swap(p.species, j.species);
+            this->particles.sync(j.index);
+        }
+
+        if(toOld){
+            for(auto it = this->removed.rbegin(); it != this->removed.rend(); ++it){
+                this->put(*it, (*it)->index);
+            }
+        }
+        else{
+            for(auto it = this->added.rbegin(); it != this->added.rend(); ++it){
+                this->put(*it, this->particles.tot);
+            }
+            this->added.clear();
+        }
+
+        if(this->boxChanged){
+            std::swap(this->geo->d, this->box.d);
+            std::swap(this->geo->_d, this->box._d);
+            std::swap(this->geo->dh, this->box.dh);
+            std::swap(this->geo->_dh, this->box._dh);
+            std::swap(this->geo->volume, this->box.volume);
+        }
+
+        if(this->cells.enabled){
+            if(this->boxChanged){
+                this->cells.build(this->particles, this->geo);
+            }
+            else{
+                for(unsigned int k = 0; k < this->recorded; k++){
+                    this->cells.update(this->journal[k]->index, this->particles.pos(this->journal[k]->index));
+                }
+            }
+        }
+    }
+
+    //The current state becomes the one later trials are measured from
+    void clear_journal(){
+        this->recorded = 0;
+        this->removed.clear();
+        this->added.clear();
+        this->oldMoved.clear();
+        this->oldMovedParticles.clear();
+        this->boxChanged = false;
+        this->showingOld = false;
+        this->oldTot = this->particles.tot;
+        this->oldCTot = this->particles.cTot;
+        this->oldATot = this->particles.aTot;
+    }
+
     SplineData spline;
     //IO io;
     
@@ -20,10 +137,15 @@ class State{
 
     int step = 0;
     double energy = 0.0, cummulativeEnergy = 0.0, dE = 0.0, error = 0.0;
+    unsigned int evaluated = 0;                    //Energy terms that have seen the current trial
     Particles particles;
     std::vector< unsigned int > movedParticles;    //Particles that has moved from previous state
     Geometry *geo;
+    int geoType = 0;                               //Type given to set_geometry, selects the instantiation of the pair energies
     std::vector< std::shared_ptr<EnergyBase> > energyFunc;
+    CellList cells;                                //Neighbor grid for the real space terms
+    CellList hardCells;                            //COM grid for the overlap checks, cells wider than 2 rMax
+    double rMax = 0.0;                             //Largest radius among the particles in hardCells
 
     ~State(){
         delete geo;
@@ -54,8 +176,8 @@ class State{
 
 
         #ifdef DEBUG
-        if(this->particles.tot != _old->particles.tot){
-            printf("_old state has %i particles and current state has %i.\n", _old->particles.tot, this->particles.tot);
+        if(this->particles.tot != this->oldTot || this->recorded != 0 || !this->removed.empty()){
+            printf("Journal is not empty, %i recorded particles and %i particles before the trial with %i now.\n", this->recorded, this->oldTot, this->particles.tot);
             exit(1);
         }
         unsigned int cations = 0, anions = 0;
@@ -67,26 +189,14 @@ class State{
                                     this->particles.particles[i]->b);
                 exit(1);
             }
-            if(this->particles.particles[i]->pos != this->_old->particles.particles[i]->pos){
-                printf("current positions is not equal to old positions for particle %i.\n", i);
-                std::cout << this->particles.particles[i]->pos << std::endl;
-                std::cout << "\n" << this->_old->particles.particles[i]->pos<< std::endl;
-                exit(1);
-            }
-            if(this->particles.particles[i]->com != this->_old->particles.particles[i]->com){
-                printf("current center of mass is not equal to old for particle %i.\n", i);
-                std::cout << this->particles.particles[i]->com << std::endl;
-                std::cout << "\n" << this->_old->particles.particles[i]->com << std::endl;
+            if(this->particles.particles[i]->pos != this->particles.pos(i) || this->particles.particles[i]->com != this->particles.com(i)){
+                printf("Particle %i is out of sync.\n", i);
                 exit(1);
             }
             if(this->particles.particles[i]->index != i){
                 printf("index is wrong in current for particle %i, it has index %i.\n", i, this->particles.particles[i]->index );
                 exit(1);
             }
-            if(this->_old->particles.particles[i]->index != i){
-                printf("index is wrong in in _old for particle %i, it has index %i.\n", i, this->_old->particles.particles[i]->index );
-                exit(1);
-            }
 
             (this->particles.particles[i]->q > 0.0) ? cations++ : anions++;
         }
@@ -97,6 +207,11 @@ class State{
             exit(0);
         }
 
+        if(this->particles.cations.size() != cations || this->particles.anions.size() != anions){
+            printf("Cation or anion list is out of step!\n");
+            exit(0);
+        }
+
         if(this->particles.cTot + this->particles.aTot != this->particles.tot){
             printf("cTot + aTot != tot\n");
             exit(0);
@@ -107,8 +222,8 @@ class State{
             exit(0);
         }
 
-        if(!this->_old->movedParticles.empty()){
-            printf("_old Moved particles is not empty!\n");
+        if(!this->oldMovedParticles.empty()){
+            printf("Old moved particles is not empty!\n");
             exit(0);
         }
         #endif
@@ -123,10 +238,20 @@ class State{
 
     void finalize(std::string name){
         printf("\nFinalizing simulation: %s.\n", name.c_str());
-        // Set up old system
-        for(std::shared_ptr<Particle> p : this->particles.particles){
-            _old->particles.add(p);
+        this->particles.sync();
+        this->clear_journal();
+
+        //Build neighbor grids for the terms that use them
+        for(auto e : this->energyFunc){
+            if(e->cells != nullptr){
+                this->cells.cutoff = std::max(this->cells.cutoff, e->get_cutoff());
+            }
+        }
+        this->cells.build(this->particles, this->geo);
+        if(this->cells.enabled){
+            printf("\tNeighbor grid enabled with cutoff %lf\n", this->cells.cutoff);
         }
+        this->build_overlap_grid();
 
         //Calculate the initial energy of the system
         for(auto e : this->energyFunc){
@@ -137,6 +262,12 @@ class State{
         printf("\tEnergy of the first frame is: %.15lf\n\n", this->energy);
     }
 
+    void set_cache(bool useCache){
+        for(auto e : this->energyFunc){
+            e->set_cache(useCache);
+        }
+    }
+
     void reset_energy(){
         this->energy = 0.0;
 
@@ -148,91 +279,94 @@ class State{
     }
 
     void save(){
-        for(auto i : this->movedParticles){
-            if(this->particles.tot > this->_old->particles.tot){
-                this->_old->particles.add(this->particles.particles[i]);
-            }
-            else if(this->particles.tot == this->_old->particles.tot){
-                *(this->_old->particles.particles[i]) = *(this->particles.particles[i]);
-                //For SingleSwap move
-                this->_old->particles.cTot = this->particles.cTot;
-                this->_old->particles.aTot = this->particles.aTot;
-            }
-        }
-
-        for(auto i : this->_old->movedParticles){
-            if(this->particles.tot < this->_old->particles.tot){
-                this->_old->particles.remove(i);
-            }
+        for(auto e : this->energyFunc){
+            e->save(this->oldMoved, this->particles, this->movedParticles);
         }
 
         this->movedParticles.clear();
-        this->_old->movedParticles.clear();
+        this->clear_journal();
         this->cummulativeEnergy += this->dE;
 
-        if(this->geo->volume != this->_old->geo->volume){
-            //Update old geometry
-            this->_old->geo->d = this->geo->d;
-            this->_old->geo->_d = this->geo->_d;
-            this->_old->geo->dh = this->geo->dh;
-            this->_old->geo->_dh = this->geo->_dh;
-            this->_old->geo->volume = this->geo->volume;
+        for(auto e : this->energyFunc){
+            this->cummulativeEnergy += e->refine(this->particles);
         }
     }
 
 
     void revert(){
-        //Set moved partiles in current state equal to previous state
-        if(this->dE != std::numeric_limits<double>::infinity()){
-            for(auto e : this->energyFunc){
-                if(this->geo->volume != this->_old->geo->volume){
-                    e->update(this->_old->geo->d[0], this->_old->geo->d[1], this->_old->geo->d[2]);
-                    e->initialize(this->_old->particles);
-                }
-                else{
-                    e->update( this->particles.get_subset(this->movedParticles), this->_old->particles.get_subset(this->_old->movedParticles) );
-                }
-            }
-        }
+        //Added particles are dropped from the grids, the others follow the restored positions
+        bool added = this->particles.tot > this->oldTot;
 
-        //printf("p1 %.8lf %.8lf %.8lf\n", this->particles[0]->com[0], this->particles[0]->com[1], this->particles[0]->com[2]);
-        for(auto i : this->movedParticles){
-            if(this->particles.tot > _old->particles.tot){
-                //printf("\nReject: removing particle %i from current\n\n", i);
-                this->particles.remove(i);
+        //Back to the old state, only the terms that saw the trial have anything to revert
+        this->swap_trial();
+        this->particles.cTot = this->oldCTot;
+        this->particles.aTot = this->oldATot;
+
+        for(unsigned int t = 0; t < this->evaluated; t++){
+            if(this->boxChanged){
+                this->energyFunc[t]->revert_volume(this->geo->d[0], this->geo->d[1], this->geo->d[2], this->particles);
             }
-            else if(this->particles.tot == this->_old->particles.tot){
-                //printf("\nAssuming normal move\n");
-                *(this->particles.particles[i]) = *(this->_old->particles.particles[i]);
-                //For SingleSwap move
-                this->particles.cTot = this->_old->particles.cTot;
-                this->particles.aTot = this->_old->particles.aTot;
+            else{
+                this->energyFunc[t]->revert();
             }
         }
-    
-        for(auto i : this->_old->movedParticles){
-            if(this->particles.tot < this->_old->particles.tot){
-                //printf("\nRevert: adding back particle %i to current\n", i);
-                this->particles.add(this->_old->particles.particles[i], i);
-            }
+        this->update_overlap_grid(this->movedParticles, this->boxChanged, added);
+
+        this->movedParticles.clear();
+        this->clear_journal();
+    }
+
 
+    //Called by the moves before they change particle i
+    void record(unsigned int i){
+        if(this->recorded == this->journal.size()){
+            this->journal.push_back(std::make_shared<Particle>());
         }
 
-        this->movedParticles.clear();
-        this->_old->movedParticles.clear();
+        Particle& j = *this->journal[this->recorded];
+        const Particle& p = *this->particles.particles[i];
+        j.pos = p.pos;
+        j.com = p.com;
+        j.qDisp = p.qDisp;
+        j.q = p.q;
+        j.b = p.b;
+        j.b_min = p.b_min;
+        j.b_max = p.b_max;
+        j.r = p.r;
+        j.rf = p.rf;
+        j.index = i;
+        j.species = p.species;
+        this->recorded++;
+    }
+
+    //Called by volume moves before they change the box
+    void record_box(){
+        this->box = {this->geo->d, this->geo->_d, this->geo->dh, this->geo->_dh, this->geo->volume};
+        this->boxChanged = true;
+    }
 
-        //Revert geometry
-        this->geo->d      = this->_old->geo->d;
-        this->geo->_d     = this->_old->geo->_d;
-        this->geo->dh     = this->_old->geo->dh;
-        this->geo->_dh    = this->_old->geo->_dh;
-        this->geo->volume = this->_old->geo->volume;
+    //Removes particle i for the trial, it is kept until the trial is saved or reverted.
+    //The last particle takes index i
+    void remove(unsigned int i){
+        this->removed.push_back(this->take(i));
     }
 
 
     //Get energy different between *this and old state
-    double get_energy_change(){
+    //maxDE is the largest dE the move can still accept, the evaluation stops once the terms done so far
+    //and the min_change bounds of the rest exceed it. dE is then infinite and only those terms are reverted
+    double get_energy_change(double maxDE = std::numeric_limits<double>::infinity()){
         double E1 = 0.0, E2 = 0.0;
+        this->evaluated = 0;
+
+        //Bounds of the terms after each term
+        this->rest.assign(this->energyFunc.size() + 1, 0.0);
+        if(maxDE < std::numeric_limits<double>::infinity()){
+            for(int t = (int) this->energyFunc.size() - 1; t >= 0; t--){
+                this->rest[t] = this->rest[t + 1] + this->energyFunc[t]->min_change(this->movedParticles, this->particles);
+            }
+        }
+
         //auto start = std::chrono::steady_clock::now();
         for(auto p : this->movedParticles){
             if(!this->geo->is_inside(this->particles.particles[p]) || this->overlap(p)){
@@ -241,29 +375,44 @@ class State{
             }
         }
 
-        for(auto e : this->energyFunc){
-            //stupid design
-
-            e->geo = this->_old->geo;
+        //Energies of the old state, shown by swapping the journal in
+        this->olds.resize(this->energyFunc.size());
+        this->swap_trial();
+        for(unsigned int t = 0; t < this->energyFunc.size(); t++){
+            this->olds[t] = this->energyFunc[t]->old_energy( this->oldMovedParticles, this->particles );
+        }
+        this->swap_trial();
 
-            E1 += (*e)( this->_old->movedParticles, this->_old->particles );
+        //Margin so that a trial on the edge is left to the move
+        double margin = 1e-9 * (1.0 + std::fabs(maxDE));
+        this->newMoved.clear();
+        for(auto i : this->movedParticles){
+            this->newMoved.push_back(this->particles.particles[i]);
+        }
+        for(auto& e : this->energyFunc){
+            E1 += this->olds[this->evaluated];
 
-            e->geo = this->geo;
-            if(this->geo->volume != this->_old->geo->volume){
-                e->update(this->geo->d[0], this->geo->d[1], this->geo->d[2]);
-                e->initialize(particles);
+            if(this->boxChanged){
+                e->rescale(this->geo->d[0], this->geo->d[1], this->geo->d[2], this->particles);
             }
             else{
-                e->update( this->_old->particles.get_subset(this->_old->movedParticles), this->particles.get_subset(this->movedParticles) );
+                e->update(this->oldMoved, this->newMoved);
             }
 
-            E2 += (*e)( this->movedParticles, this->particles );
+            //A pipeline can stop between its terms, its limit leaves room for the terms before and after it
+            E2 += e->evaluate( this->movedParticles, this->particles, maxDE + margin - (E2 - E1 + this->olds[this->evaluated]) - this->rest[this->evaluated + 1] );
+            this->evaluated++;
+
+            if(E2 - E1 + this->rest[this->evaluated] > maxDE + margin){
+                this->dE = std::numeric_limits<double>::infinity();
+                return this->dE;
+            }
         }
         /*
         printf("particle %u has moved\n", this->movedParticles[0]);
         std::cout << this->particles[this->movedParticles[0]]->pos << std::endl;
         printf("from: \n");
-        std::cout << this->_old->particles[this->_old->movedParticles[0]]->pos << std::endl;
+        std::cout << this->oldMoved[0]->pos << std::endl;
         */
         this->dE = E2 - E1;
         //printf("dE %lf %lf\n", E1, E2);
@@ -276,37 +425,56 @@ class State{
         //this->movedParticles.insert(std::end(movedParticles), std::begin(ps), std::end(ps));
 
         //If a particle is removed, this->movedparticles is empty. 
-        //If particle is added this->_old->particles is empty
-        if(this->particles.tot >= this->_old->particles.tot){
+        //If particle is added this->oldMovedParticles is empty
+        if(this->particles.tot >= this->oldTot){
             std::for_each(std::begin(ps), std::end(ps), [this](int i){ 
                                                     this->movedParticles.push_back(i); });
         }
         
-        std::copy_if(ps.begin(), ps.end(), std::back_inserter(this->_old->movedParticles), 
-                                            [this](unsigned int i){ return i < this->_old->particles.tot; });
+        std::copy_if(ps.begin(), ps.end(), std::back_inserter(this->oldMovedParticles), 
+                                            [this](unsigned int i){ return i < this->oldTot; });
+
+        //The moves record in the order of ps
+        this->oldMoved.assign(this->journal.begin(), this->journal.begin() + this->recorded);
+        this->oldMoved.insert(this->oldMoved.end(), this->removed.begin(), this->removed.end());
         
         //printf("moved %u\n", this->movedParticles[0]);
-        //printf("old moved %u\n", this->_old->movedParticles[0]);
+        //printf("old moved %u\n", this->oldMovedParticles[0]);
         
         /*if(!this->movedParticles.empty()){                                  
             for(auto i : ps){
                 geo->pbc(this->particles[i]);
             }
         }*/
-        /*if(this->movedParticles.empty() && this->_old->movedParticles.empty()){
+        /*if(this->movedParticles.empty() && this->oldMovedParticles.empty()){
             printf("Error both are empty");
             exit(1);
         }*/
 
         for(auto p : this->movedParticles){
             geo->pbc(this->particles[p]);
+            this->particles.sync(p);
+        }
+
+        if(this->cells.enabled){
+            if(this->boxChanged){
+                this->cells.build(this->particles, this->geo);
+            }
+            else{
+                for(auto p : this->movedParticles){
+                    this->cells.update(p, this->particles.particles[p]->pos);
+                }
+            }
         }
+        this->update_overlap_grid(this->movedParticles, this->boxChanged);
     }
 
 
     void equilibrate(double step){
         printf("\nEquilibrating:\n");
         Eigen::Vector3d v;
+        this->particles.sync();
+        this->build_overlap_grid();
         
         // Initial Check
         int i = 0, overlaps = this->get_overlaps();
@@ -316,6 +484,8 @@ class State{
                 this->particles.particles[i]->com = this->geo->random_pos(this->particles.particles[i]->rf);
                 this->particles.particles[i]->pos = this->particles.particles[i]->com + this->particles.particles[i]->qDisp;
             }
+            this->particles.sync();
+            this->build_overlap_grid();
         }
 
         printf("\tInitial overlaps: %i\n", overlaps);
@@ -333,9 +503,13 @@ class State{
                 step_rand = Random::get_random() * step;
                 p->translate(step_rand);
                 //this->geo->pbc(p);
+                this->particles.sync(p->index);
+                this->hardCells.update(p->index, p->com);
                 if(!this->geo->is_inside(p) || this->overlap(p->index)){
                     p->com = oldCom;
                     p->pos = oldPos;
+                    this->particles.sync(p->index);
+                    this->hardCells.update(p->index, p->com);
                 }
 
 
@@ -353,20 +527,58 @@ class State{
         else{
             printf("\tNo overlaps to remove!\n");
         }
+        this->particles.sync();
         printf("\n\tEquilibration done\n\n");
     }
 
 
 
-    bool overlap(std::size_t i){
-        for(auto p : this->particles.particles){
-            if(p->index == i) continue;
+    void build_overlap_grid(){
+        this->rMax = 0.0;
+        for(unsigned int i = 0; i < this->particles.tot; i++){
+            this->rMax = std::max(this->rMax, this->particles.rs[i]);
+        }
+        this->hardCells.useCom = true;
+        this->hardCells.cutoff = 2.0 * this->rMax;
+        this->hardCells.build(this->particles, this->geo);
+    }
 
-            if(this->geo->distance(p->com, this->particles.particles[i]->com) <= p->r + this->particles.particles[i]->r){
-                return true;
+    //Keeps the COM grid in step with the moved particles ps, rebuilt if the box changed
+    void update_overlap_grid(std::vector< unsigned int >& ps, bool rebuild, bool erase = false){
+        for(auto i : ps){
+            if(i < this->particles.tot) this->rMax = std::max(this->rMax, this->particles.rs[i]);
+        }
+
+        if(rebuild || 2.0 * this->rMax > this->hardCells.cutoff){
+            this->build_overlap_grid();
+        }
+        else if(this->hardCells.enabled){
+            for(auto i : ps){
+                (erase) ? this->hardCells.erase(i) : this->hardCells.update(i, this->particles.com(i));
             }
         }
-        return false;
+    }
+
+    bool overlap(std::size_t i){
+        const Particles& P = this->particles;
+        Eigen::Vector3d com = P.com(i);
+        bool found = false;
+
+        auto check = [&](unsigned int j, double r2){
+            if(r2 <= (P.rs[i] + P.rs[j]) * (P.rs[i] + P.rs[j])) found = true;
+        };
+
+        //Particles that do not fit the grid (e.g. Widom test particles) are checked against everything
+        if(this->hardCells.enabled && P.rs[i] + this->rMax <= this->hardCells.cutoff){
+            this->hardCells.for_each_cell(com, [&](const std::vector<unsigned int>& cell){
+                this->geo->for_each_within(P.cx.data(), P.cy.data(), P.cz.data(), cell.data(), cell.size(), com, P.rs[i] + this->rMax, i, check);
+            });
+        }
+        else{
+            double r = *std::max_element(P.rs.begin(), P.rs.begin() + P.tot);
+            this->geo->for_each_within(P.cx.data(), P.cy.data(), P.cz.data(), nullptr, P.tot, com, P.rs[i] + r, i, check);
+        }
+        return found;
     }
 
     int get_overlaps(){
@@ -378,14 +590,13 @@ class State{
     }
 
     void set_geometry(int type, std::vector<double> args){
-        this->_old = std::make_shared<State>();
+        this->geoType = type;
 
         switch (type){
             default:
                 printf("Creating Cuboid box\n");
                 assert(args.size() == 3);
                 this->geo = new Cuboid<true, true, true>(args[0], args[1], args[2]);
-                this->_old->geo = new Cuboid<true, true, true>(args[0], args[1], args[2]);
                 break;
 
             case 1:
@@ -396,21 +607,18 @@ class State{
                 printf("Creating Cuboid-Image box\n");
                 assert(args.size() == 3);
                 this->geo = new CuboidImg<true, true, true>(args[0], args[1], args[2]);
-                this->_old->geo = new CuboidImg<true, true, true>(args[0], args[1], args[2]);
                 break;
 
             case 3:
                 printf("Creating Cuboid-Image box with no PBC in z\n");
                 assert(args.size() == 3);
                 this->geo = new CuboidImg<true, true, false>(args[0], args[1], args[2]);
-                this->_old->geo = new CuboidImg<true, true, false>(args[0], args[1], args[2]);
                 break;
 
             case 4:
                 printf("Creating Cuboid box with no PBC\n");
                 assert(args.size() == 3);
                 this->geo = new Cuboid<false, false, false>(args[0], args[1], args[2]);
-                this->_old->geo = new Cuboid<false, false, false>(args[0], args[1], args[2]);
                 break;
         }
 
@@ -418,55 +626,116 @@ class State{
     
 
 
+    //Calls make with a null pointer to the geometry type chosen in set_geometry, resolved once here so that
+    //the minimum image of the concrete geometry inlines into the pair loops
+    template <typename F>
+    std::shared_ptr<EnergyBase> for_geometry(F make){
+        switch(this->geoType){
+            case 1:
+                return make((Geometry*) nullptr);
+            case 2:
+                return make((CuboidImg<true, true, true>*) nullptr);
+            case 3:
+                return make((CuboidImg<true, true, false>*) nullptr);
+            case 4:
+                return make((Cuboid<false, false, false>*) nullptr);
+            default:
+                return make((Cuboid<true, true, true>*) nullptr);
+        }
+    }
+
+    //Pair energy T with functor E for the geometry chosen in set_geometry
+    template <template <typename, typename> class T, typename E, typename... Args>
+    std::shared_ptr<EnergyBase> make_pair_energy(Args&&... args){
+        return this->for_geometry([&](auto g) -> std::shared_ptr<EnergyBase> {
+            return std::make_shared< T<E, std::remove_pointer_t<decltype(g)> > >(std::forward<Args>(args)...);
+        });
+    }
+
+    //Pair energy T with functor E and the terms ExtEnergy<Ext>... of the box x, y, z composed into one Pipeline.
+    //cells is the neighbor grid of the pair energy, if it uses one, and args are its constructor arguments
+    template <template <typename, typename> class T, typename E, typename... Ext, typename... Args>
+    std::shared_ptr<EnergyBase> make_pipeline(double cutoff, CellList* cells, double x, double y, double z, Args&&... args){
+        return this->for_geometry([&](auto g) -> std::shared_ptr<EnergyBase> {
+            using Real = T<E, std::remove_pointer_t<decltype(g)> >;
+            Real real(std::forward<Args>(args)...);
+            real.set_geo(this->geo);
+            real.set_cells(cells);
+            real.set_cutoff(cutoff);
+            return std::make_shared< Pipeline< Real, ExtEnergy<Ext>... > >(std::move(real), this->ext_energy<Ext>(x, y, z)...);
+        });
+    }
+
+    template <typename Ext>
+    ExtEnergy<Ext> ext_energy(double x, double y, double z){
+        ExtEnergy<Ext> e(x, y, z);
+        e.set_geo(this->geo);
+        return e;
+    }
+
+    //An extra trailing argument to the types with a real space cutoff (1, 2, 3, 6, 7, 11, 12, 13, 14, 16) is the error
+    //tolerance of a tabulated pair potential, used instead of the analytic one
     void set_energy(int type, std::vector<double> args = std::vector<double>()){
+        const double tabulated_rmin = 0.5;     //Analytic below this distance
+
         switch (type){
             case 1:
                 printf("\nAdding Ewald potential\n");
-                assert(args.size() == 7);
-                this->energyFunc.push_back( std::make_shared< PairEnergy<EwaldLike::Short> >() );
-                //this->energyFunc.push_back( std::make_shared< PairEnergyWithRep<EwaldLike::Short> >(1) );
-                this->energyFunc.back()->set_geo(this->geo);
-                this->energyFunc.back()->set_cutoff(args[0]);
-
-                this->energyFunc.push_back( std::make_shared< ExtEnergy<EwaldLike::Long> >(this->geo->d[0], this->geo->d[1], this->geo->d[2]) );
-                this->energyFunc.back()->set_geo(this->geo);
-
+                assert(args.size() == 7 || args.size() == 8);
                 EwaldLike::set_km({ (int) args[1], (int) args[2], (int) args[3] });
                 EwaldLike::alpha = args[4];
                 EwaldLike::kMax = args[5];
                 EwaldLike::spherical = bool(args[6]);
 
+                if(args.size() == 8){
+                    this->energyFunc.push_back( this->make_pipeline< PairEnergy, Tabulated<EwaldLike::Short>, EwaldLike::Long >(
+                                                args[0], &this->cells, this->geo->d[0], this->geo->d[1], this->geo->d[2],
+                                                Tabulated<EwaldLike::Short>(tabulated_rmin, args[0], args[7])) );
+                }
+                else{
+                    this->energyFunc.push_back( this->make_pipeline< PairEnergy, EwaldLike::Short, EwaldLike::Long >(
+                                                args[0], &this->cells, this->geo->d[0], this->geo->d[1], this->geo->d[2]) );
+                }
+
                 printf("\tSpherical cutoff: %s", EwaldLike::spherical ? "true\n" : "false\n");
                 printf("\tReciprocal cutoff: %lf\n", EwaldLike::kMax);
                 printf("\tk-vectors: %d %d %d\n", (int) args[1], (int) args[2], (int) args[3]);
+                simd::ewald_short();
+                printf("\tReal space kernel: %s\n", simd::ewald_short_name().c_str());
                 break;
 
             case 2:
                 printf("\nAdding Halfwald potential\n");
-                assert(args.size() == 5);
-                this->energyFunc.push_back( std::make_shared< ImgEnergy<EwaldLike::Short> >() );
-                this->energyFunc.back()->set_geo(this->geo);
-                this->energyFunc.back()->set_cutoff(args[0]);
-
-                this->energyFunc.push_back( std::make_shared< ExtEnergy<EwaldLike::LongHW> >(this->geo->d[0], this->geo->d[1], this->geo->d[2]) );
-                this->energyFunc.back()->set_geo(this->geo);
-
+                assert(args.size() == 5 || args.size() == 6);
                 EwaldLike::set_km({ (int) args[1], (int) args[2], (int) args[3] });
                 EwaldLike::alpha = args[4];
+
+                if(args.size() == 6){
+                    this->energyFunc.push_back( this->make_pipeline< ImgEnergy, Tabulated<EwaldLike::Short>, EwaldLike::LongHW >(
+                                                args[0], &this->cells, this->geo->d[0], this->geo->d[1], this->geo->d[2],
+                                                Tabulated<EwaldLike::Short>(tabulated_rmin, args[0], args[5])) );
+                }
+                else{
+                    this->energyFunc.push_back( this->make_pipeline< ImgEnergy, EwaldLike::Short, EwaldLike::LongHW >(
+                                                args[0], &this->cells, this->geo->d[0], this->geo->d[1], this->geo->d[2]) );
+                }
                 break;
             
             case 3:
                 printf("\nAdding HalfwaldIPBC potential\n");
-                assert(args.size() == 5);
-                this->energyFunc.push_back( std::make_shared< ImgEnergy<EwaldLike::Short> >() );
-                this->energyFunc.back()->set_geo(this->geo);
-                this->energyFunc.back()->set_cutoff(args[0]);
-
-                this->energyFunc.push_back( std::make_shared< ExtEnergy<EwaldLike::LongHWIPBC> >(this->geo->d[0], this->geo->d[1], this->geo->d[2]) );
-                this->energyFunc.back()->set_geo(this->geo);
-
+                assert(args.size() == 5 || args.size() == 6);
                 EwaldLike::set_km({ (int) args[1], (int) args[2], (int) args[3] });
                 EwaldLike::alpha = args[4];
+
+                if(args.size() == 6){
+                    this->energyFunc.push_back( this->make_pipeline< ImgEnergy, Tabulated<EwaldLike::Short>, EwaldLike::LongHWIPBC >(
+                                                args[0], &this->cells, this->geo->d[0], this->geo->d[1], this->geo->d[2],
+                                                Tabulated<EwaldLike::Short>(tabulated_rmin, args[0], args[5])) );
+                }
+                else{
+                    this->energyFunc.push_back( this->make_pipeline< ImgEnergy, EwaldLike::Short, EwaldLike::LongHWIPBC >(
+                                                args[0], &this->cells, this->geo->d[0], this->geo->d[1], this->geo->d[2]) );
+                }
                 break;
 
             case 4:
@@ -485,31 +754,22 @@ class State{
             case 5:
                 printf("\nAdding Minimum Image Halfwald\n");
                 assert(args.size() == 3);
-                this->energyFunc.push_back( std::make_shared< MIHalfwald<Coulomb> >(args[1], args[2]) );
+                this->energyFunc.push_back( this->make_pair_energy< MIHalfwald, Coulomb >(args[1], args[2]) );
                 this->energyFunc.back()->set_geo(this->geo);
+                this->energyFunc.back()->set_cells(&this->cells);
                 this->energyFunc.back()->set_cutoff(args[0]);
 
                 // Set box size due to reflections, needed for distance PBC
                 printf("\tResetting box size in z to %lf\n", (4.0 * args[1] + 2.0) * this->geo->_d[2]);
                 this->geo->d[2] = (4.0 * args[1] + 2.0) * this->geo->_d[2];
                 this->geo->dh[2] = 0.5 * this->geo->d[2]; 
-                this->_old->geo->d[2] = this->geo->d[2];
-                this->_old->geo->dh[2] = this->geo->dh[2]; 
 
                 break;
 
 
             case 6:
                 printf("\nAdding Truncated Ewald potential\n");
-                assert(args.size() == 8);
-                //this->energyFunc.push_back( std::make_shared< PairEnergy<EwaldLike::ShortTruncated> >() );
-                this->energyFunc.push_back( std::make_shared< PairEnergyWithRep<EwaldLike::ShortTruncated> >(1) );
-                this->energyFunc.back()->set_geo(this->geo);
-                this->energyFunc.back()->set_cutoff(args[0]);
-
-                this->energyFunc.push_back( std::make_shared< ExtEnergy<EwaldLike::LongTruncated> >(this->geo->d[0], this->geo->d[1], this->geo->d[2]) );
-                this->energyFunc.back()->set_geo(this->geo);
-
+                assert(args.size() == 8 || args.size() == 9);
                 EwaldLike::set_km({ (int) args[1], (int) args[2], (int) args[3] });
                 EwaldLike::alpha = args[4];
                 //printf("Sigma: %lf\n", args[4]);
@@ -519,27 +779,38 @@ class State{
                 printf("\tSpherical cutoff: %s", EwaldLike::spherical ? "true\n" : "false\n");
                 printf("\tReciprocal cutoff: %lf\n", EwaldLike::kMax);
                 EwaldLike::eta = EwaldLike::R * 1.0 / (std::sqrt(2.0) * EwaldLike::alpha);
+
+                //this->energyFunc.push_back( std::make_shared< PairEnergy<EwaldLike::ShortTruncated> >() );
+                if(args.size() == 9){
+                    this->energyFunc.push_back( this->make_pipeline< PairEnergyWithRep, Tabulated<EwaldLike::ShortTruncated>, EwaldLike::LongTruncated >(
+                                                args[0], nullptr, this->geo->d[0], this->geo->d[1], this->geo->d[2], 1,
+                                                Tabulated<EwaldLike::ShortTruncated>(tabulated_rmin, EwaldLike::R, args[8])) );
+                }
+                else{
+                    this->energyFunc.push_back( this->make_pipeline< PairEnergyWithRep, EwaldLike::ShortTruncated, EwaldLike::LongTruncated >(
+                                                args[0], nullptr, this->geo->d[0], this->geo->d[1], this->geo->d[2], 1) );
+                }
                 break;
 
             case 7:
                 printf("\nAdding Halfwald with real replicates\n");
-                assert(args.size() == 7);
-                this->energyFunc.push_back( std::make_shared< MIHalfwald<EwaldLike::Short> >(args[1], args[6]) );
-                this->energyFunc.back()->set_geo(this->geo);
-                this->energyFunc.back()->set_cutoff(args[0]);
+                assert(args.size() == 7 || args.size() == 8);
+                EwaldLike::set_km({ (int) args[2], (int) args[3], (int) args[4] });
+                EwaldLike::alpha = args[5];
+
+                if(args.size() == 8){
+                    this->energyFunc.push_back( this->make_pipeline< MIHalfwald, Tabulated<EwaldLike::Short>, EwaldLike::LongHW >(
+                                                args[0], &this->cells, this->geo->_d[0], this->geo->_d[1], this->geo->_d[2] * 2.0, args[1], args[6],
+                                                Tabulated<EwaldLike::Short>(tabulated_rmin, args[0], args[7])) );
+                }
+                else{
+                    this->energyFunc.push_back( this->make_pipeline< MIHalfwald, EwaldLike::Short, EwaldLike::LongHW >(
+                                                args[0], &this->cells, this->geo->_d[0], this->geo->_d[1], this->geo->_d[2] * 2.0, args[1], args[6]) );
+                }
 
                 printf("\tResetting box size in z to %lf\n", (4.0 * args[1] + 2.0) * this->geo->_d[2]);
                 this->geo->d[2] = (4.0 * args[1] + 2.0) * this->geo->_d[2];
                 this->geo->dh[2] = 0.5 * this->geo->d[2]; 
-                this->_old->geo->d[2] = this->geo->d[2];
-                this->_old->geo->dh[2] = this->geo->dh[2]; 
-
-                this->energyFunc.push_back( std::make_shared< ExtEnergy<EwaldLike::LongHW> >(this->geo->_d[0], this->geo->_d[1], this->geo->_d[2] * 2.0) );
-                this->energyFunc.back()->set_geo(this->geo);
-
-                EwaldLike::set_km({ (int) args[2], (int) args[3], (int) args[4] });
-                EwaldLike::alpha = args[5];
-
                 break;
 
             case 8:
@@ -568,53 +839,152 @@ class State{
 
             case 11:
                 printf("\nAdding FanourgakisSP2 with image charges\n");
-                assert(args.size() == 2);
-                                                                                          // kMax     eps
-                this->energyFunc.push_back( std::make_shared< MIHalfwald<Fanourgakis::SP2> >(args[1], 1.0) );
-                this->energyFunc.back()->set_geo(this->geo);
-                this->energyFunc.back()->set_cutoff(args[0]);
-
-                this->energyFunc.push_back( std::make_shared< ExtEnergy<Fanourgakis::SP2Self> >(this->geo->_d[0], this->geo->_d[1], this->geo->_d[2] * 2.0) );
-                this->energyFunc.back()->set_geo(this->geo);
-
+                assert(args.size() == 2 || args.size() == 3);
                 Fanourgakis::R = args[0];
+                                                                                          // kMax     eps
+                if(args.size() == 3){
+                    this->energyFunc.push_back( this->make_pipeline< MIHalfwald, Tabulated<Fanourgakis::SP2>, Fanourgakis::SP2Self >(
+                                                args[0], &this->cells, this->geo->_d[0], this->geo->_d[1], this->geo->_d[2] * 2.0, args[1], 1.0,
+                                                Tabulated<Fanourgakis::SP2>(tabulated_rmin, args[0], args[2])) );
+                }
+                else{
+                    this->energyFunc.push_back( this->make_pipeline< MIHalfwald, Fanourgakis::SP2, Fanourgakis::SP2Self >(
+                                                args[0], &this->cells, this->geo->_d[0], this->geo->_d[1], this->geo->_d[2] * 2.0, args[1], 1.0) );
+                }
 
                 printf("\tResetting box size in z to %lf\n", (4.0 * args[1] + 2.0) * this->geo->_d[2]);
                 this->geo->d[2] = (4.0 * args[1] + 2.0) * this->geo->_d[2];
                 this->geo->dh[2] = 0.5 * this->geo->d[2]; 
-                this->_old->geo->d[2] = this->geo->d[2];
-                this->_old->geo->dh[2] = this->geo->dh[2]; 
                 break;
 
             case 12:
                 printf("\nAdding FanourgakisSP3 with image charges\n");
-                assert(args.size() == 2);
-                this->energyFunc.push_back( std::make_shared< MIHalfwald<Fanourgakis::SP3> >(args[1], 1.0) );
-                this->energyFunc.back()->set_geo(this->geo);
-                this->energyFunc.back()->set_cutoff(args[0]);
-
-                this->energyFunc.push_back( std::make_shared< ExtEnergy<Fanourgakis::SP3Self> >(this->geo->_d[0], this->geo->_d[1], this->geo->_d[2] * 2.0) );
-                this->energyFunc.back()->set_geo(this->geo);
-
+                assert(args.size() == 2 || args.size() == 3);
                 Fanourgakis::R = args[0];
+                                                                                          // kMax     eps
+                if(args.size() == 3){
+                    this->energyFunc.push_back( this->make_pipeline< MIHalfwald, Tabulated<Fanourgakis::SP3>, Fanourgakis::SP3Self >(
+                                                args[0], &this->cells, this->geo->_d[0], this->geo->_d[1], this->geo->_d[2] * 2.0, args[1], 1.0,
+                                                Tabulated<Fanourgakis::SP3>(tabulated_rmin, args[0], args[2])) );
+                }
+                else{
+                    this->energyFunc.push_back( this->make_pipeline< MIHalfwald, Fanourgakis::SP3, Fanourgakis::SP3Self >(
+                                                args[0], &this->cells, this->geo->_d[0], this->geo->_d[1], this->geo->_d[2] * 2.0, args[1], 1.0) );
+                }
 
                 printf("\tResetting box size in z to %lf\n", (4.0 * args[1] + 2.0) * this->geo->_d[2]);
                 this->geo->d[2] = (4.0 * args[1] + 2.0) * this->geo->_d[2];
                 this->geo->dh[2] = 0.5 * this->geo->d[2]; 
-                this->_old->geo->d[2] = this->geo->d[2];
-                this->_old->geo->dh[2] = this->geo->dh[2];
+                break;
+
+            case 13:
+                printf("\nAdding Ewald potential with SPME reciprocal space\n");
+                assert(args.size() == 7 || args.size() == 8);
+                EwaldLike::set_km({ (int) args[1], (int) args[2], (int) args[3] });
+                EwaldLike::alpha = args[4];
+                EwaldLike::kMax = args[5];
+                EwaldLike::spherical = bool(args[6]);
+
+                if(args.size() == 8){
+                    this->energyFunc.push_back( this->make_pipeline< PairEnergy, Tabulated<EwaldLike::Short>, EwaldLike::LongSPME >(
+                                                args[0], &this->cells, this->geo->d[0], this->geo->d[1], this->geo->d[2],
+                                                Tabulated<EwaldLike::Short>(tabulated_rmin, args[0], args[7])) );
+                }
+                else{
+                    this->energyFunc.push_back( this->make_pipeline< PairEnergy, EwaldLike::Short, EwaldLike::LongSPME >(
+                                                args[0], &this->cells, this->geo->d[0], this->geo->d[1], this->geo->d[2]) );
+                }
+
+                printf("\tk-vectors: %d %d %d\n", (int) args[1], (int) args[2], (int) args[3]);
+                simd::ewald_short();
+                printf("\tReal space kernel: %s\n", simd::ewald_short_name().c_str());
+                break;
+
+            //Halfwald with a P3M reciprocal space, args[1..3] are the mesh points and args[5] the assignment order
+            case 14:
+                printf("\nAdding Halfwald potential with P3M reciprocal space\n");
+                assert(args.size() == 6 || args.size() == 7);
+                EwaldLike::set_km({ (int) args[1], (int) args[2], (int) args[3] });
+                EwaldLike::alpha = args[4];
+                EwaldLike::p3mOrder = (int) args[5];
+
+                if(args.size() == 7){
+                    this->energyFunc.push_back( this->make_pipeline< ImgEnergy, Tabulated<EwaldLike::Short>, EwaldLike::LongP3M >(
+                                                args[0], &this->cells, this->geo->d[0], this->geo->d[1], this->geo->d[2],
+                                                Tabulated<EwaldLike::Short>(tabulated_rmin, args[0], args[6])) );
+                }
+                else{
+                    this->energyFunc.push_back( this->make_pipeline< ImgEnergy, EwaldLike::Short, EwaldLike::LongP3M >(
+                                                args[0], &this->cells, this->geo->d[0], this->geo->d[1], this->geo->d[2]) );
+                }
+                break;
+
+            //Ewald in the doubled box of geometry 3 without explicit images, the metal walls enter through
+            //the Levin term. args[7] is the number of 2D wave numbers of the wall term along x and y.
+            //The charges and their images repeat with twice the slab width, so Long keeps the doubled
+            //box and its kz; only the image charges are gone from the real space and structure factor sums
+            case 16:
+                printf("\nAdding Ewald potential with metal slab correction\n");
+                assert(args.size() == 8 || args.size() == 9);
+                if(this->geoType != 3){
+                    printf("Ewald with metal slab correction needs the slab geometry (type 3)!\n");
+                    exit(1);
+                }
+                EwaldLike::set_km({ (int) args[1], (int) args[2], (int) args[3] });
+                EwaldLike::alpha = args[4];
+                EwaldLike::kMax = args[5];
+                EwaldLike::spherical = bool(args[6]);
+                EwaldLike::slabKM = (int) args[7];
+
+                if(args.size() == 9){
+                    this->energyFunc.push_back( this->make_pipeline< PairEnergy, Tabulated<EwaldLike::Short>, EwaldLike::Long, EwaldLike::Levin >(
+                                                args[0], &this->cells, this->geo->d[0], this->geo->d[1], this->geo->d[2],
+                                                Tabulated<EwaldLike::Short>(tabulated_rmin, args[0], args[8])) );
+                }
+                else{
+                    this->energyFunc.push_back( this->make_pipeline< PairEnergy, EwaldLike::Short, EwaldLike::Long, EwaldLike::Levin >(
+                                                args[0], &this->cells, this->geo->d[0], this->geo->d[1], this->geo->d[2]) );
+                }
+                break;
+
+            //Coulomb potential from the fast multipole method, args[0] is the expansion order
+            case 15:
+                printf("\nAdding FMM Coulomb potential\n");
+                assert(args.size() == 1);
+                if(this->geo->periodic[0] || this->geo->periodic[1] || this->geo->periodic[2]){
+                    printf("FMM needs a box without periodic boundaries!\n");
+                    exit(1);
+                }
+
+                this->energyFunc.push_back( std::make_shared<FMMEnergy>(this->geo->d[0], this->geo->d[1], this->geo->d[2], (int) args[0]) );
+                this->energyFunc.back()->set_geo(this->geo);
                 break;
 
             default:
                 printf("\nAdding Coulomb potential\n");
-                this->energyFunc.push_back( std::make_shared< PairEnergy<Coulomb> >() );
+                this->energyFunc.push_back( this->make_pair_energy< PairEnergy, Coulomb >() );
                 this->energyFunc.back()->set_geo(this->geo);
+                this->energyFunc.back()->set_cells(&this->cells);
                 this->energyFunc.back()->set_cutoff(args[0]);
                 break;   
         }
         
     }
 
+    //Ewald summation (type 1) with parameters tuned for the current particles and geometry. Call it after
+    //set_geometry and once the particles are loaded, in place of set_energy. Other terms can be added afterwards
+    void tune_ewald(double tolerance){
+        if(!this->energyFunc.empty()){
+            printf("Ewald tuner adds the electrostatic energy, call it before set_energy!\n");
+            exit(1);
+        }
+
+        EwaldTuner::Params p = EwaldTuner::tune(this->particles, this->geo, tolerance, [&](EwaldTuner::Params& c, CellList* cells){
+            return this->make_pipeline< PairEnergy, EwaldLike::Short, EwaldLike::Long >(c.cutoff, cells, this->geo->d[0], this->geo->d[1], this->geo->d[2]);
+        });
+        this->set_energy(1, {p.cutoff, (double) p.kM, (double) p.kM, (double) p.kM, p.alpha, p.kM + 0.5, 1.0});
+    }
+
     void load_spline(std::vector<double> aKnots, std::vector<double> bKnots, std::vector<double >controlPoints){
         spline.load(aKnots, bKnots, controlPoints);
     }
@@ -632,7 +1002,7 @@ class State{
             this->particles.add(com[i], pos[i], qDisp, r[i], rf[i], charges[i], b[i], b_min[i], b_max[i], names[i]);
 
         }
-        if(!this->particles.setPModel || !this->particles.setNModel){
+        if(this->particles.pSpecies < 0 || this->particles.nSpecies < 0){
             printf("Cation or anion model not set!\n");
             exit(1);
         }
@@ -643,22 +1013,18 @@ class State{
         //assert correct sizes
 
         Eigen::Vector3d ae, be, qDisp;
-        double b_min, b_max;
+        //Old checkpoints have no b range, it is the same for every particle so that the species agree
+        double b_min = 0.0, b_max = 0.0;
 
         for(unsigned int i = 0; i < pos.size(); i++){
             ae << pos[i][0], pos[i][1], pos[i][2];
             be << com[i][0], com[i][1], com[i][2];
             qDisp = this->geo->displacement(ae, be);
 
-            if(charges[i] < 0){
-                b_min = 0.0;
-                b_max = 0.0;
-            }
-
             this->particles.add(com[i], pos[i], qDisp, r[i], rf[i], charges[i], b[i], b_min, b_max, names[i]);
 
         }
-        if(!this->particles.setPModel || !this->particles.setNModel){
+        if(this->particles.pSpecies < 0 || this->particles.nSpecies < 0){
             printf("Cation or anion model not set!\n");
             exit(1);
         }
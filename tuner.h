@@ -0,0 +1,132 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <chrono>
+#include <limits>
+#include "particles.h"
+#include "geometry.h"
+#include "cells.h"
+
+/*
+    Picks Ewald parameters (cutoff, alpha, kM) for a target RMS energy error. For every candidate
+    cutoff alpha is set from the Kolafa-Perram real space error estimate and the number of
+    wavevectors from the reciprocal estimate, each taking half of the error budget. The valid
+    candidates are then timed on single particle trials of the energy State builds for them and the
+    fastest one is returned.
+*/
+namespace EwaldTuner{
+
+    struct Params{
+        double cutoff, alpha, error, time;
+        int kM;
+    };
+
+    //Kolafa-Perram RMS error estimates of the energy (in kT)
+    inline double real_error(double Q2, double volume, double rc, double a){
+        return constants::lB * Q2 * std::sqrt(rc / (2.0 * volume)) * std::exp(-a * a * rc * rc) / (a * a * rc * rc);
+    }
+
+    inline double reciprocal_error(double Q2, double L, int K, double a){
+        double x = constants::PI * K / (a * L);
+        return constants::lB * Q2 * a / (constants::PI * constants::PI) * std::pow(K, -1.5) * std::exp(-x * x);
+    }
+
+    //Smallest alpha with a real space error below tolerance (the error decreases with alpha)
+    inline double solve_alpha(double Q2, double volume, double rc, double tolerance){
+        double lo = 1e-3, hi = 10.0;
+        for(int i = 0; i < 100; i++){
+            double mid = 0.5 * (lo + hi);
+            (real_error(Q2, volume, rc, mid) > tolerance) ? lo = mid : hi = mid;
+        }
+        return hi;
+    }
+
+    //Time of single particle trials for a parameter set, on the energy make(p, cells) builds for it. The trials
+    //go through old_energy, update, the energy and revert as in State::get_energy_change
+    template <typename F>
+    inline double benchmark(Particles& particles, Geometry* geo, Params& p, unsigned int samples, F&& make){
+        EwaldLike::set_km({ p.kM, p.kM, p.kM });
+        EwaldLike::alpha = p.alpha;
+        EwaldLike::kMax = p.kM + 0.5;
+        EwaldLike::spherical = true;
+
+        CellList cells;
+        cells.cutoff = p.cutoff;
+        cells.build(particles, geo);
+
+        std::shared_ptr<EnergyBase> energy = make(p, &cells);
+        energy->initialize(particles);
+
+        double e = 0.0;
+        auto start = std::chrono::steady_clock::now();
+        for(unsigned int s = 0; s < samples; s++){
+            std::vector<unsigned int> moved = {s % particles.tot};
+            std::vector< std::shared_ptr<Particle> > subset = particles.get_subset(moved);
+            e -= energy->old_energy(moved, particles);
+            energy->update(std::vector< std::shared_ptr<Particle> >(subset), std::move(subset));
+            e += (*energy)(moved, particles);
+            energy->revert();
+        }
+        auto end = std::chrono::steady_clock::now();
+
+        if(std::isnan(e)) printf("\tTuner: NaN energy\n");
+        return std::chrono::duration<double>(end - start).count() / samples;
+    }
+
+    //make(p, cells) builds the Ewald energy for the parameters p with the neighbor grid cells, see benchmark
+    template <typename F>
+    inline Params tune(Particles& particles, Geometry* geo, double tolerance, F&& make, int kMaxLimit = 40){
+        if(geo->d.size() < 3 || !(geo->periodic[0] && geo->periodic[1] && geo->periodic[2])){
+            printf("Ewald tuner needs a periodic cuboid!\n");
+            exit(1);
+        }
+        if(particles.tot == 0){
+            printf("Ewald tuner needs particles, load or create them first!\n");
+            exit(1);
+        }
+
+        double Q2 = 0.0;
+        for(unsigned int i = 0; i < particles.tot; i++){
+            Q2 += particles.qs[i] * particles.qs[i];
+        }
+        double L = std::max(geo->d[0], std::max(geo->d[1], geo->d[2]));
+        double rcMax = std::min(geo->d[0], std::min(geo->d[1], geo->d[2])) / 2.0;
+        double budget = tolerance / std::sqrt(2.0);
+        unsigned int samples = std::min(particles.tot, 200u);
+
+        printf("Tuning Ewald parameters for an energy error of %lf kT\n", tolerance);
+
+        std::vector<Params> candidates;
+        for(int c = 1; c <= 8; c++){
+            Params p;
+            p.cutoff = rcMax * c / 8.0;
+            if(p.cutoff < 3.0) continue;
+
+            p.alpha = solve_alpha(Q2, geo->volume, p.cutoff, budget);
+            p.kM = 1;
+            while(p.kM <= kMaxLimit && reciprocal_error(Q2, L, p.kM, p.alpha) > budget){
+                p.kM++;
+            }
+            if(p.kM > kMaxLimit) continue;
+
+            p.error = std::sqrt(std::pow(real_error(Q2, geo->volume, p.cutoff, p.alpha), 2) + std::pow(reciprocal_error(Q2, L, p.kM, p.alpha), 2));
+            candidates.push_back(p);
+        }
+
+        if(candidates.empty()){
+            printf("\tNo parameters reach the tolerance with at most %i wavevectors, increase the tolerance!\n", kMaxLimit);
+            exit(1);
+        }
+
+        Params best = candidates[0];
+        best.time = std::numeric_limits<double>::infinity();
+        for(auto& p : candidates){
+            p.time = benchmark(particles, geo, p, samples, make);
+            printf("\tCutoff: %lf, alpha: %lf, kM: %i, error: %.3e, time: %.3e s\n", p.cutoff, p.alpha, p.kM, p.error, p.time);
+            if(p.time < best.time) best = p;
+        }
+        printf("\tSelected cutoff: %lf, alpha: %lf, kM: %i\n", best.cutoff, best.alpha, best.kM);
+        return best;
+    }
+}